@@ -1,266 +1,4409 @@
 extern "C" {
 #include "binding.h"
 }
+#include "ggml-dispatch.h"
 
 #include "common.h"
+#include "grammar-parser.h"
 #include "llama.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-class LlamaCppSimple {
-  public:
-  LlamaCppSimple(const std::string& path, int context=2048, int gpuLayers=20, int threads=4, int seed=777, int batch_size=512) :
-    modelPath(path), contextTokenLen(context), randSeed(seed), batchSize(batch_size)
-  {
-    llama_backend_init(gptParams.numa);
-    loadModel(gpuLayers, threads);
-    batch = llama_batch_init(batchSize, 0, 1);
-    currentTokenIndex = 0;
+// The AVX2 paths are used when the build targets AVX2, or, in a dispatch
+// build for the x86-64 baseline, compiled for AVX2 alone and taken when the
+// CPU has it.
+#if defined(__AVX2__) && defined(__FMA__)
+#define LLAMA_AVX2 1
+#define LLAMA_AVX2_TARGET
+#elif defined(GGML_DISPATCH) && defined(__x86_64__)
+#define LLAMA_AVX2 1
+#define LLAMA_AVX2_TARGET __attribute__((target("avx2,fma")))
+#endif
+
+#if defined(LLAMA_AVX2)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+struct llama_cancel_token {
+  std::atomic<bool> cancelled { false };
+};
+
+// A token allow/deny set stored as a bitset, plus sparse additive biases.
+// Built once and shared by any number of requests.
+struct llama_token_mask {
+  int nVocab;
+  llama_mask_mode mode;
+  std::vector<uint64_t> bits;
+  std::vector<llama_token> members;                 // the set bits, ascending
+  std::vector<std::pair<llama_token, float>> bias;
+
+  void add(llama_token id) {
+    if (id < 0 || id >= nVocab) return;
+    uint64_t bit = 1ull << (id & 63);
+    if (!(bits[id >> 6] & bit)) {
+      bits[id >> 6] |= bit;
+      members.insert(std::lower_bound(members.begin(), members.end(), id), id);
+    }
   }
 
-  llama_context* getContext() {
-    return currentContext;
+  void addBias(llama_token id, float value) {
+    if (id < 0 || id >= nVocab) return;
+    for (auto& entry : bias) {
+      if (entry.first == id) { entry.second += value; return; }
+    }
+    bias.push_back(std::make_pair(id, value));
   }
 
-  int generateText(const std::string& prompt, int maxNewTokens) {
-    initContext();
-    currentTokenIndex = 0;
+  void apply(float* logits) const {
+    if (mode == LLAMA_MASK_ALLOW) {
+      if (members.size() * 16 < (size_t) nVocab) {
+        // a handful of allowed tokens: save them, blank the whole row with
+        // one vectorizable fill, put them back
+        float saved[256];
+        std::vector<float> savedLarge;
+        float* keep = saved;
+        if (members.size() > 256) {
+          savedLarge.resize(members.size());
+          keep = savedLarge.data();
+        }
+        for (size_t i = 0; i < members.size(); i++) keep[i] = logits[members[i]];
+        std::fill(logits, logits + nVocab, -INFINITY);
+        for (size_t i = 0; i < members.size(); i++) logits[members[i]] = keep[i];
+      } else {
+        for (size_t w = 0; w < bits.size(); w++) {
+          uint64_t word = bits[w];
+          if (word == ~0ull) continue;
+          int base = w * 64;
+          int count = std::min(64, nVocab - base);
+          if (word == 0) {
+            std::fill(logits + base, logits + base + count, -INFINITY);
+            continue;
+          }
+          for (int b = 0; b < count; b++) {
+            if (!((word >> b) & 1)) logits[base + b] = -INFINITY;
+          }
+        }
+      }
+    } else if (mode == LLAMA_MASK_DENY) {
+      for (llama_token id : members) logits[id] = -INFINITY;
+    }
 
-    llama_batch_clear(batch);
+    for (const auto& entry : bias) {
+      logits[entry.first] += entry.second;
+    }
+  }
+};
 
-    int promptTokenCount = processPrompt(prompt, maxNewTokens);
-    currentTokenIndex = promptTokenCount;
+static double msSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
 
-    int totalTokens = promptTokenCount + maxNewTokens;
+// Pulls the model file into the page cache before llama.cpp maps it, so the
+// loader and the first decode take minor faults instead of going to disk.
+// Pages are touched from several threads because a single reader rarely
+// saturates NVMe; the calling thread reports the fraction read to progress.
+static void prefetchModelFile(const std::string& path, int threads,
+    const std::function<void(float)>& progress = nullptr) {
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "%s: warning: unable to open %s for prefetch\n", __func__, path.c_str());
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return;
+  }
+  size_t size = (size_t) st.st_size;
+
+  void* addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    fprintf(stderr, "%s: warning: unable to mmap %s for prefetch\n", __func__, path.c_str());
+    return;
+  }
 
-    if (totalTokens > contextTokenLen) {
-        fprintf(stderr , "%s: error: total potential tokens exceeds context length\n" , __func__);
-        throw std::runtime_error("error: total potential tokens exceeds context length.");
+  madvise(addr, size, MADV_WILLNEED);
+
+  const size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+  const int workers = threads > 0 ? threads : 1;
+  const size_t span = (size / workers + pageSize - 1) / pageSize * pageSize;
+  const volatile char* data = (const volatile char*) addr;
+  const size_t chunk = 4 << 20;
+  std::atomic<size_t> touched { 0 };
+  std::atomic<int> running { 0 };
+
+  std::vector<std::thread> touchers;
+  for (int w = 0; w < workers; w++) {
+    size_t begin = w * span;
+    size_t end = std::min(size, begin + span);
+    if (begin >= end) break;
+    running++;
+    touchers.emplace_back([data, begin, end, pageSize, chunk, &touched, &running]() {
+      char sink = 0;
+      for (size_t from = begin; from < end; from += chunk) {
+        size_t to = std::min(end, from + chunk);
+        for (size_t offset = from; offset < to; offset += pageSize) {
+          sink ^= data[offset];
+        }
+        touched += to - from;
+      }
+      (void) sink;
+      running--;
+    });
+  }
+  if (progress) {
+    while (running > 0) {
+      progress((float) touched.load() / size);
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
     }
+  }
+  for (auto& t : touchers) t.join();
 
-    llama_token selectedToken = 0;
+  munmap(addr, size);
+#else
+  (void) path; (void) threads; (void) progress;
+#endif
+}
 
-    llama_token endOfSequence = llama_token_eos(model);
-    bool predictedEnd = false;
+static ggml_type kvGgmlType(llama_kv_type type) {
+  switch (type) {
+    case LLAMA_KV_Q8_0: return GGML_TYPE_Q8_0;
+    case LLAMA_KV_Q4_0: return GGML_TYPE_Q4_0;
+    default: return GGML_TYPE_F16;
+  }
+}
 
-    do {
-      selectedToken = bestFromLastDecode();
-  
-      predictedEnd = (selectedToken == endOfSequence);
-      if (!predictedEnd) {
-        llama_batch_clear(batch);
- 
-        bool should_continue = outputSingleTokenAsString(selectedToken);
-        fprintf(stderr, " ### %d ### ", should_continue);
+// Storage per element; q8_0 and q4_0 pack 32 elements with an f16 scale.
+static double kvBytesPerElement(llama_kv_type type) {
+  switch (type) {
+    case LLAMA_KV_Q8_0: return 34.0 / 32.0;
+    case LLAMA_KV_Q4_0: return 18.0 / 32.0;
+    default: return 2.0;
+  }
+}
 
-        if (!should_continue) return currentTokenIndex;
+static bool quantFtype(llama_quant_type type, llama_ftype& ftype) {
+  switch (type) {
+    case LLAMA_QUANT_F16:    ftype = LLAMA_FTYPE_MOSTLY_F16; return true;
+    case LLAMA_QUANT_Q4_0:   ftype = LLAMA_FTYPE_MOSTLY_Q4_0; return true;
+    case LLAMA_QUANT_Q4_1:   ftype = LLAMA_FTYPE_MOSTLY_Q4_1; return true;
+    case LLAMA_QUANT_Q5_0:   ftype = LLAMA_FTYPE_MOSTLY_Q5_0; return true;
+    case LLAMA_QUANT_Q5_1:   ftype = LLAMA_FTYPE_MOSTLY_Q5_1; return true;
+    case LLAMA_QUANT_Q8_0:   ftype = LLAMA_FTYPE_MOSTLY_Q8_0; return true;
+    case LLAMA_QUANT_Q2_K:   ftype = LLAMA_FTYPE_MOSTLY_Q2_K; return true;
+    case LLAMA_QUANT_Q3_K_S: ftype = LLAMA_FTYPE_MOSTLY_Q3_K_S; return true;
+    case LLAMA_QUANT_Q3_K_M: ftype = LLAMA_FTYPE_MOSTLY_Q3_K_M; return true;
+    case LLAMA_QUANT_Q3_K_L: ftype = LLAMA_FTYPE_MOSTLY_Q3_K_L; return true;
+    case LLAMA_QUANT_Q4_K_S: ftype = LLAMA_FTYPE_MOSTLY_Q4_K_S; return true;
+    case LLAMA_QUANT_Q4_K_M: ftype = LLAMA_FTYPE_MOSTLY_Q4_K_M; return true;
+    case LLAMA_QUANT_Q5_K_S: ftype = LLAMA_FTYPE_MOSTLY_Q5_K_S; return true;
+    case LLAMA_QUANT_Q5_K_M: ftype = LLAMA_FTYPE_MOSTLY_Q5_K_M; return true;
+    case LLAMA_QUANT_Q6_K:   ftype = LLAMA_FTYPE_MOSTLY_Q6_K; return true;
+  }
+  return false;
+}
 
-        llama_batch_add(batch, selectedToken, currentTokenIndex++, { 0 }, true);
- 
-        decodeToNextTokenScores();
-      } else {
-      }
-      
-    } while (!predictedEnd && currentTokenIndex < totalTokens);
+static double fileBytes(const char* path) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  return file ? (double) file.tellg() : 0;
+}
+
+// llama_model_quantize has no progress callback, but logs "[  i/  n] name"
+// as it starts each tensor; quantizeLog passes the log on to stderr and
+// reports those lines.
+struct QuantizeProgress {
+  llama_quantize_progress_fn fn;
+  void* userData;
+  int total;
+};
+
+static void quantizeLog(ggml_log_level level, const char* text, void* userData) {
+  (void) level;
+  fputs(text, stderr);
+  fflush(stderr);
 
-    return currentTokenIndex;
+  QuantizeProgress* progress = (QuantizeProgress*) userData;
+  int index = 0;
+  int total = 0;
+  char name[128];
+  if (sscanf(text, " [%d/%d] %127s", &index, &total, name) == 3 && index > 0) {
+    progress->total = total;
+    if (progress->fn != NULL) {
+      progress->fn(index - 1, total, name, progress->userData);
+    }
   }
+}
 
-  ~LlamaCppSimple() {
-    llama_free(currentContext);
-    llama_free_model(model);
+// the log callback is process-wide
+static std::mutex quantizeMutex;
 
-    llama_batch_free(batch);
+// Hyperparameters that decide how much memory a context needs.
+struct ModelShape {
+  double weightBytes = 0;
+  long long nLayer = 0;
+  long long nEmbd = 0;
+  long long nHead = 0;
+  long long nHeadKv = 0;
+  long long nFf = 0;
+  long long nVocab = 0;
+  int nCtxTrain = 0;
+};
 
-    llama_backend_free();
+static long long metaInt(const llama_model* model, const std::string& key, long long fallback) {
+  char buf[64];
+  if (llama_model_meta_val_str(model, key.c_str(), buf, sizeof(buf)) < 0) {
+    return fallback;
   }
- 
-  private:
+  return strtoll(buf, NULL, 10);
+}
 
-  void loadModel(int gpuLayers, int threads) {
-    gptParams.model = modelPath;
-    gptParams.n_threads = threads;
-    modelParams = llama_model_default_params();
+// Reads the shape from GGUF metadata through a vocab-only load; the weights
+// are taken to be the file size, which is what mmap maps.
+static bool readModelShape(const char* path, ModelShape& shape) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file) {
+    return false;
+  }
+  shape.weightBytes = (double) file.tellg();
 
-    modelParams.n_gpu_layers = gpuLayers;
+  llama_backend_init(false);
+  llama_model_params params = llama_model_default_params();
+  params.vocab_only = true;
+  llama_model* model = llama_load_model_from_file(path, params);
+  if (model == NULL) {
+    return false;
+  }
 
-    model = llama_load_model_from_file(gptParams.model.c_str(), modelParams);
+  char arch[64] = "llama";
+  llama_model_meta_val_str(model, "general.architecture", arch, sizeof(arch));
+  const std::string prefix = std::string(arch) + ".";
 
-    if (model == NULL) {
-        fprintf(stderr , "%s: error: unable to load model\n" , __func__);
-        throw std::runtime_error("Unable to load model.");
-    }
+  shape.nLayer = metaInt(model, prefix + "block_count", 0);
+  shape.nEmbd = llama_n_embd(model);
+  shape.nHead = metaInt(model, prefix + "attention.head_count", 1);
+  shape.nHeadKv = metaInt(model, prefix + "attention.head_count_kv", shape.nHead);
+  shape.nFf = metaInt(model, prefix + "feed_forward_length", 4 * shape.nEmbd);
+  shape.nVocab = llama_n_vocab(model);
+  shape.nCtxTrain = llama_n_ctx_train(model);
+  llama_free_model(model);
+
+  return shape.nLayer > 0 && shape.nHead > 0 && shape.nHeadKv > 0;
+}
+
+// KV cells hold one K and one V row of n_embd_gqa per layer. The compute
+// buffer is sized by llama.cpp for a full n_batch against every cell; the
+// estimate covers the largest per-layer intermediates (KQ scores, the FFN
+// activations) plus the logits buffer, since ggml-alloc reuses memory
+// between layers.
+static llama_memory_plan estimateMemory(const ModelShape& shape, int nCtx, int nParallel,
+    llama_kv_type kvType, int batch, double budget) {
+  const double nEmbdGqa = (double) shape.nEmbd / shape.nHead * shape.nHeadKv;
+  const double nBatch = std::min(batch, nCtx);
+
+  llama_memory_plan plan = {};
+  plan.n_ctx = nCtx;
+  plan.n_parallel = nParallel;
+  plan.kv_type = kvType;
+  plan.weight_bytes = shape.weightBytes;
+  plan.kv_bytes = shape.nLayer * (double) nCtx * nEmbdGqa *
+      (kvBytesPerElement(kvType) + kvBytesPerElement(LLAMA_KV_F16));
+  plan.compute_bytes = 4.0 * nBatch *
+      (shape.nHead * (double) nCtx + 3.0 * shape.nFf + 8.0 * shape.nEmbd + 2.0 * shape.nVocab);
+  plan.total_bytes = plan.weight_bytes + plan.kv_bytes + plan.compute_bytes;
+  plan.fits = plan.total_bytes <= budget;
+  return plan;
+}
+
+
+// Repetition, frequency and presence penalties over the last lastN tokens.
+// Token counts are updated as tokens enter and leave the window, so applying
+// the penalties only touches the distinct tokens in it rather than scanning
+// the window against every candidate on each step. One window per sequence.
+struct PenaltyWindow {
+  int lastN = 0;              // 0 disables the window
+  std::vector<llama_token> ring;
+  size_t oldest = 0;
+  std::unordered_map<llama_token, int> counts;
+
+  void reset(int windowSize) {
+    lastN = std::max(0, windowSize);
+    ring.clear();
+    ring.reserve(lastN);
+    oldest = 0;
+    counts.clear();
   }
 
-  void initContext() {
-    fprintf(stderr, "initializing context..\n");
-    
-    llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.seed  = randSeed;
-    ctx_params.n_ctx = contextTokenLen;
-    ctx_params.n_threads = gptParams.n_threads;
-    ctx_params.n_threads_batch = gptParams.n_threads_batch == -1 ? gptParams.n_threads : gptParams.n_threads_batch;
+  void push(llama_token id) {
+    if (lastN == 0) return;
+    if ((int) ring.size() < lastN) {
+      ring.push_back(id);
+    } else {
+      auto evicted = counts.find(ring[oldest]);
+      if (--evicted->second == 0) counts.erase(evicted);
+      ring[oldest] = id;
+      oldest = (oldest + 1) % lastN;
+    }
+    counts[id]++;
+  }
 
-    if (currentContext != 0) {
-      llama_free(currentContext);
+  // Same arithmetic as llama_sample_repetition_penalties.
+  void apply(float* logits, float repeat, float frequency, float presence) const {
+    for (const auto& entry : counts) {
+      float& logit = logits[entry.first];
+      if (repeat != 1.0f) {
+        logit = logit <= 0 ? logit * repeat : logit / repeat;
+      }
+      logit -= entry.second * frequency + presence;
     }
-    currentContext = llama_new_context_with_model(model, ctx_params);
+  }
+};
 
-    if (currentContext == NULL) {
-        fprintf(stderr , "%s: error: failed to create the llama_context\n" , __func__);
-        throw std::runtime_error("Failed to create the llama_context");
+// Holds back generated text that could still become a stop sequence, so
+// callers never see a partial one. One matcher per sequence.
+struct StopMatcher {
+  std::vector<std::string> stops;
+  std::string pending;
+
+  void reset(const char* const* sequences, int count) {
+    stops.clear();
+    pending.clear();
+    for (int i = 0; i < count; i++) {
+      if (sequences[i] != NULL && sequences[i][0] != '\0') {
+        stops.push_back(sequences[i]);
+      }
     }
   }
 
-  inline void tokenize(const std::string& inputString, int totalTokens, std::vector<llama_token>& tokens_list, bool is_start) {
-    tokens_list = llama_tokenize(model, inputString, is_start, true);
-    llama_token endOfSequence = llama_token_eos(model);
-    
-    //fprintf(stderr, "EOS is %d\ntokenize result:\n", endOfSequence);
-    for (int i = 0; i < tokens_list.size(); i++) {
-      const char* str = llama_token_to_piece(currentContext, tokens_list[i]).c_str();
-      //fprintf(stderr, " {%s}[%d] ", str, tokens_list[i]);
+  // Appends piece and moves the text that is safe to emit into ready.
+  // Returns true when a stop sequence was found; ready then holds the text
+  // before it.
+  bool feed(const std::string& piece, std::string& ready) {
+    if (stops.empty()) {
+      ready = piece;
+      return false;
+    }
 
-      if (tokens_list[i] == endOfSequence) {
-        fprintf(stderr, " *Found EOS* ");
+    pending += piece;
+
+    size_t stopAt = std::string::npos;
+    for (const auto& stop : stops) {
+      stopAt = std::min(stopAt, pending.find(stop));
+    }
+    if (stopAt != std::string::npos) {
+      ready = pending.substr(0, stopAt);
+      pending.clear();
+      return true;
+    }
+
+    size_t held = 0;
+    for (const auto& stop : stops) {
+      for (size_t len = std::min(stop.size() - 1, pending.size()); len > held; len--) {
+        if (pending.compare(pending.size() - len, len, stop, 0, len) == 0) {
+          held = len;
+          break;
+        }
       }
     }
-    //fprintf(stderr, "\n");
 
-    const int n_ctx    = llama_n_ctx(currentContext);
-    const int n_kv_req = tokens_list.size() + (totalTokens - tokens_list.size());
+    ready = pending.substr(0, pending.size() - held);
+    pending.erase(0, pending.size() - held);
+    return false;
+  }
 
-    // make sure the KV cache is big enough to hold all the prompt and generated tokens
-    if (n_kv_req > n_ctx) {
-        throw std::runtime_error("Error: input overran context length.");
+  std::string flush() {
+    std::string rest;
+    rest.swap(pending);
+    return rest;
+  }
+};
+
+// Token pieces can end inside a multi-byte UTF-8 character. The assembler
+// holds back such a tail (at most 3 bytes) until the next piece completes it,
+// so every chunk handed to the caller is whole code points. Invalid bytes are
+// passed through rather than held.
+struct Utf8Assembler {
+  std::string pending;
+
+  // Length of the prefix of pending that ends on a code point boundary.
+  size_t completeLength() const {
+    size_t n = pending.size();
+    for (size_t back = 1; back <= 3 && back <= n; back++) {
+      unsigned char c = pending[n - back];
+      if ((c & 0xC0) == 0x80) continue;       // continuation byte
+      size_t need = (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+      return need > back ? n - back : n;
     }
+    return n;
   }
+};
 
-  inline bool outputSingleTokenAsString(llama_token& token) {
-    const char* str = llama_token_to_piece(currentContext, token).c_str();
-    return tokenCallback((void*)10000, (char*)str);
+#if defined(LLAMA_AVX2)
+static inline bool useAvx2() {
+#if defined(__AVX2__) && defined(__FMA__)
+  return true;
+#else
+  static const bool supported = ggml_dispatch_level() >= GGML_DISPATCH_AVX2;
+  return supported;
+#endif
+}
+
+// exp(x) as 2^i * p(f) with a degree-5 polynomial for 2^f (relative error
+// below 4e-6). Inputs are clamped at -87 so masked (-inf) logits give a
+// negligible term instead of a NaN.
+LLAMA_AVX2_TARGET static inline __m256 fastExp8(__m256 x) {
+  x = _mm256_max_ps(x, _mm256_set1_ps(-87.0f));
+  __m256 t = _mm256_mul_ps(x, _mm256_set1_ps(1.44269504f));
+  __m256 whole = _mm256_floor_ps(t);
+  __m256 f = _mm256_sub_ps(t, whole);
+  __m256 p = _mm256_set1_ps(1.8775767e-3f);
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(8.9893397e-3f));
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(5.5826318e-2f));
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(2.4015361e-1f));
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(6.9315308e-1f));
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(9.9999994e-1f));
+  __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(whole), _mm256_set1_epi32(127)), 23);
+  return _mm256_mul_ps(p, _mm256_castsi256_ps(bits));
+}
+
+LLAMA_AVX2_TARGET static inline float horizontalSum(__m256 v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_movehdup_ps(s));
+  return _mm_cvtss_f32(s);
+}
+
+// Max of the first n - n % 8 values into m; returns how many were read.
+LLAMA_AVX2_TARGET static int maxLogitAvx2(const float* x, int n, float& m) {
+  int i = 0;
+  __m256 lanes = _mm256_set1_ps(-INFINITY);
+  for (; i + 8 <= n; i += 8) lanes = _mm256_max_ps(lanes, _mm256_loadu_ps(x + i));
+  float spill[8];
+  _mm256_storeu_ps(spill, lanes);
+  for (int j = 0; j < 8; j++) m = std::max(m, spill[j]);
+  return i;
+}
+
+// Adds exp(x - maxValue) over the first n - n % 8 values to sum; returns
+// how many were read.
+LLAMA_AVX2_TARGET static int sumExpAvx2(const float* x, int n, float maxValue, double& sum) {
+  int i = 0;
+  __m256 shift = _mm256_set1_ps(maxValue);
+  // lanes are flushed into the double total every 512 values to keep the
+  // float partial sums accurate
+  while (i + 8 <= n) {
+    __m256 lanes = _mm256_setzero_ps();
+    for (int end = std::min(n - n % 8, i + 512); i < end; i += 8) {
+      lanes = _mm256_add_ps(lanes, fastExp8(_mm256_sub_ps(_mm256_loadu_ps(x + i), shift)));
+    }
+    sum += horizontalSum(lanes);
   }
+  return i;
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+static inline float32x4_t fastExp4(float32x4_t x) {
+  x = vmaxq_f32(x, vdupq_n_f32(-87.0f));
+  float32x4_t t = vmulq_f32(x, vdupq_n_f32(1.44269504f));
+  float32x4_t whole = vrndmq_f32(t);
+  float32x4_t f = vsubq_f32(t, whole);
+  float32x4_t p = vdupq_n_f32(1.8775767e-3f);
+  p = vfmaq_f32(vdupq_n_f32(8.9893397e-3f), p, f);
+  p = vfmaq_f32(vdupq_n_f32(5.5826318e-2f), p, f);
+  p = vfmaq_f32(vdupq_n_f32(2.4015361e-1f), p, f);
+  p = vfmaq_f32(vdupq_n_f32(6.9315308e-1f), p, f);
+  p = vfmaq_f32(vdupq_n_f32(9.9999994e-1f), p, f);
+  int32x4_t bits = vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(whole), vdupq_n_s32(127)), 23);
+  return vmulq_f32(p, vreinterpretq_f32_s32(bits));
+}
+#endif
 
-  inline bool outputTokensAsString(const std::vector<llama_token>& tokens) {
-    for (auto id : tokens) {
-      const char* str = llama_token_to_piece(currentContext, id).c_str();
-      if (!tokenCallback((void*)10000, (char*)str)) {
-        return false;
-      }
+static float maxLogit(const float* x, int n) {
+  float m = -INFINITY;
+  int i = 0;
+#if defined(LLAMA_AVX2)
+  if (useAvx2()) i = maxLogitAvx2(x, n, m);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  float32x4_t lanes = vdupq_n_f32(-INFINITY);
+  for (; i + 4 <= n; i += 4) lanes = vmaxq_f32(lanes, vld1q_f32(x + i));
+  m = vmaxvq_f32(lanes);
+#endif
+  for (; i < n; i++) m = std::max(m, x[i]);
+  return m;
+}
+
+// log(sum(exp(x))) given max(x), in one SIMD pass.
+static float logSumExp(const float* x, int n, float maxValue) {
+  double sum = 0;
+  int i = 0;
+#if defined(LLAMA_AVX2)
+  if (useAvx2()) i = sumExpAvx2(x, n, maxValue, sum);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  float32x4_t shift = vdupq_n_f32(maxValue);
+  while (i + 4 <= n) {
+    float32x4_t lanes = vdupq_n_f32(0.0f);
+    for (int end = std::min(n - n % 4, i + 512); i < end; i += 4) {
+      lanes = vaddq_f32(lanes, fastExp4(vsubq_f32(vld1q_f32(x + i), shift)));
     }
-    return true;
+    sum += vaddvq_f32(lanes);
   }
+#endif
+  for (; i < n; i++) sum += expf(x[i] - maxValue);
+  return maxValue + (float) log(sum);
+}
 
-  inline int processPrompt(const std::string& prompt, int maxNewTokens) {
-    // TODO: verify that we don't overrun context length 
+static void logSoftmax(const float* logits, int n, float* out) {
+  const float logZ = logSumExp(logits, n, maxLogit(logits, n));
+  for (int i = 0; i < n; i++) {
+    out[i] = logits[i] - logZ;
+  }
+}
 
-    std::vector<llama_token> promptTokens;
-    tokenize(prompt, contextTokenLen, promptTokens, true);
+// Writes the indices of the k largest values into ids, best first, and
+// returns how many were written. Nearly every value fails the threshold
+// test, so this is one cheap pass for small k.
+static int topK(const float* x, int n, int k, int* ids) {
+  k = std::min(k, n);
+  int count = 0;
+  for (int i = 0; i < n; i++) {
+    if (count == k && x[i] <= x[ids[k - 1]]) continue;
+    int at = count < k ? count++ : k - 1;
+    while (at > 0 && x[ids[at - 1]] < x[i]) {
+      ids[at] = ids[at - 1];
+      at--;
+    }
+    ids[at] = i;
+  }
+  return count;
+}
 
-    fprintf(stderr, "c\n");
-    fprintf(stderr, "Prompt tokens len: %d\n", promptTokens.size());
+struct BeamHypothesis {
+  llama_seq_id seqId;
+  std::vector<llama_token> tokens;
+  double logprob;
+  int batchIndex;
+  bool ended;                 // finished with EOS
+  PenaltyWindow penalties;
+};
 
-    fprintf(stderr, "Batch size: %d\n", batchSize);
+struct BeamCandidate {
+  int parent;
+  llama_token token;
+  double score;
+};
 
-    int processedTokens = 0;
+// Decodes UTF-8 into code points; false if the text is not complete UTF-8
+// (byte-fallback tokens that carry part of a character).
+static bool decodeUtf8(const std::string& text, std::vector<uint32_t>& out) {
+  out.clear();
+  size_t i = 0;
+  while (i < text.size()) {
+    unsigned char lead = text[i];
+    int extra = lead < 0x80 ? 0 : (lead >> 5) == 0x6 ? 1 : (lead >> 4) == 0xE ? 2 : (lead >> 3) == 0x1E ? 3 : -1;
+    if (extra < 0 || i + extra >= text.size()) {
+      return false;
+    }
+    uint32_t cp = extra == 0 ? lead : lead & (0x3F >> extra);
+    for (int k = 1; k <= extra; k++) {
+      unsigned char cont = text[i + k];
+      if ((cont & 0xC0) != 0x80) return false;
+      cp = (cp << 6) | (cont & 0x3F);
+    }
+    out.push_back(cp);
+    i += extra + 1;
+  }
+  return true;
+}
 
-    while (processedTokens < promptTokens.size() ) {
-      int start = processedTokens;
-      
-      llama_batch_clear(batch);
+// The vocabulary as a trie keyed by the code points of each token's piece.
+// Grammar masking walks this once per step, so a shared prefix such as
+// `"na` is matched against the grammar once for every token starting with
+// it instead of once per token.
+struct TokenTrie {
+  struct Node {
+    std::vector<std::pair<uint32_t, int>> children;
+    std::vector<llama_token> tokens;
+  };
+  std::vector<Node> nodes;
+  std::vector<std::vector<uint32_t>> codepoints;   // per token, empty if unusable
 
-      while (processedTokens < start + batchSize && 
-          processedTokens < promptTokens.size() ) { 
-          llama_batch_add(batch, promptTokens[processedTokens], processedTokens, { 0 }, false);
-          //llama_batch_add(batch, promptTokens[processedTokens], currentTokenIndex, { 0 }, false); 
-          processedTokens++;
-          //currentTokenIndex++;
+  void build(llama_context* ctx, int nVocab) {
+    nodes.assign(1, Node());
+    codepoints.assign(nVocab, std::vector<uint32_t>());
+    for (llama_token id = 0; id < nVocab; id++) {
+      if (!decodeUtf8(llama_token_to_piece(ctx, id), codepoints[id])) {
+        codepoints[id].clear();
       }
-      fprintf(stderr, "processed tokens: %d", processedTokens);
-
-      if (processedTokens == promptTokens.size()) {
-        // llama_decode will output logits only for the last token of the prompt
-        batch.logits[batch.n_tokens - 1] = true;
+      if (codepoints[id].empty()) {
+        continue;
       }
-      if (llama_decode(currentContext, batch) != 0) {
-          LOG_TEE("%s: llama_decode() failed\n", __func__);
-          throw std::runtime_error("llama_decode() failed");
+      int node = 0;
+      for (uint32_t cp : codepoints[id]) {
+        int child = -1;
+        for (const auto& edge : nodes[node].children) {
+          if (edge.first == cp) { child = edge.second; break; }
+        }
+        if (child < 0) {
+          child = nodes.size();
+          nodes[node].children.push_back(std::make_pair(cp, child));
+          nodes.push_back(Node());
+        }
+        node = child;
       }
+      nodes[node].tokens.push_back(id);
     }
+  }
+};
 
-    return promptTokens.size();
-    //return currentTokenIndex;
+typedef std::vector<const llama_grammar_element*> GrammarStack;
+
+// GBNF matcher over the rules produced by grammar_parser. It follows
+// llama.cpp's pushdown-stack semantics; the stack helpers live inside
+// llama.cpp and are not exported, so they are reimplemented here to allow
+// advancing the state one code point at a time along the trie.
+class GrammarMatcher {
+  public:
+  explicit GrammarMatcher(const char* source) {
+    parsed = grammar_parser::parse(source);
+    auto root = parsed.symbol_ids.find("root");
+    if (parsed.rules.empty() || root == parsed.symbol_ids.end()) {
+      throw std::runtime_error("Invalid grammar, a root rule is required.");
+    }
+
+    const llama_grammar_element* pos = parsed.rules[root->second].data();
+    while (true) {
+      GrammarStack stack;
+      if (!isEndOfSequence(pos)) {
+        stack.push_back(pos);
+      }
+      advanceStack(stack, stacks);
+      while (!isEndOfSequence(pos)) pos++;
+      if (pos->type != LLAMA_GRETYPE_ALT) break;
+      pos++;
+    }
   }
 
-  inline llama_token bestFromLastDecode() {
+  // Sets the logits of every token the grammar cannot accept next to -inf.
+  void maskLogits(const TokenTrie& trie, float* logits, int nVocab, llama_token endOfSequence) {
+    allowed.assign(nVocab, 0);
+    walk(trie, 0, stacks);
 
-    int numTokensInVocabulary = llama_n_vocab(model);
-    auto* tokenLikelihoodScores  = llama_get_logits_ith(currentContext, batch.n_tokens - 1);
+    bool canEnd = false;
+    for (const auto& stack : stacks) {
+      if (stack.empty()) canEnd = true;
+    }
+    if (canEnd || std::find(allowed.begin(), allowed.end(), 1) == allowed.end()) {
+      allowed[endOfSequence] = 1;
+    }
 
-    std::vector<llama_token_data> candidates;
-    candidates.reserve(numTokensInVocabulary);
-  
-    for (llama_token token_id = 0; token_id < numTokensInVocabulary; token_id++) {
-        candidates.emplace_back(llama_token_data{ token_id, tokenLikelihoodScores[token_id], 0.0f });
+    for (int id = 0; id < nVocab; id++) {
+      if (!allowed[id]) logits[id] = -INFINITY;
     }
+  }
 
-    llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
-    
-    const llama_token highestScoringToken = llama_sample_token_greedy(currentContext, &candidates_p);
-    return highestScoringToken;
+  void acceptToken(const std::vector<uint32_t>& codepoints) {
+    for (uint32_t cp : codepoints) {
+      stacks = accept(stacks, cp);
+    }
   }
 
-  inline void decodeToNextTokenScores() {
-    // evaluate the current batch with the transformer model
-    if (llama_decode(currentContext, batch)) {
-        fprintf(stderr, "%s : failed to eval, return code %d\n", __func__, 1);
-        throw std::runtime_error("Error 1313: input exceeded context length.");
+  private:
+  GrammarMatcher(const GrammarMatcher&) = delete;
+  GrammarMatcher& operator=(const GrammarMatcher&) = delete;
+
+  static bool isEndOfSequence(const llama_grammar_element* pos) {
+    return pos->type == LLAMA_GRETYPE_END || pos->type == LLAMA_GRETYPE_ALT;
+  }
+
+  // Expands rule references at the top of stack until every resulting stack
+  // has a terminal (or nothing) on top.
+  void advanceStack(const GrammarStack& stack, std::vector<GrammarStack>& out) const {
+    if (stack.empty()) {
+      if (std::find(out.begin(), out.end(), stack) == out.end()) out.push_back(stack);
+      return;
+    }
+
+    const llama_grammar_element* pos = stack.back();
+    if (pos->type == LLAMA_GRETYPE_RULE_REF) {
+      const llama_grammar_element* subpos = parsed.rules[pos->value].data();
+      while (true) {
+        GrammarStack next(stack.begin(), stack.end() - 1);
+        if (!isEndOfSequence(pos + 1)) next.push_back(pos + 1);
+        if (!isEndOfSequence(subpos)) next.push_back(subpos);
+        advanceStack(next, out);
+        while (!isEndOfSequence(subpos)) subpos++;
+        if (subpos->type != LLAMA_GRETYPE_ALT) break;
+        subpos++;
+      }
+    } else if (std::find(out.begin(), out.end(), stack) == out.end()) {
+      out.push_back(stack);
     }
   }
- 
-  llama_model* model;
-  llama_model_params modelParams;
-  gpt_params gptParams;
-  int currentTokenIndex;
-  std::string modelPath;
-  llama_context* currentContext = 0;
-  llama_batch batch;
-  int contextTokenLen, randSeed, batchSize;
-};
 
-// Wrapper function definitions
+  static bool matchChar(const llama_grammar_element*& pos, uint32_t chr) {
+    bool positive = pos->type == LLAMA_GRETYPE_CHAR;
+    bool found = false;
+    do {
+      if (pos[1].type == LLAMA_GRETYPE_CHAR_RNG_UPPER) {
+        found = found || (pos->value <= chr && chr <= pos[1].value);
+        pos += 2;
+      } else {
+        found = found || pos->value == chr;
+        pos += 1;
+      }
+    } while (pos->type == LLAMA_GRETYPE_CHAR_ALT);
+    return found == positive;
+  }
 
-extern "C" {
+  std::vector<GrammarStack> accept(const std::vector<GrammarStack>& from, uint32_t chr) const {
+    std::vector<GrammarStack> out;
+    for (const auto& stack : from) {
+      if (stack.empty()) continue;
+      const llama_grammar_element* pos = stack.back();
+      if (!matchChar(pos, chr)) continue;
+      GrammarStack next(stack.begin(), stack.end() - 1);
+      if (!isEndOfSequence(pos)) next.push_back(pos);
+      advanceStack(next, out);
+    }
+    return out;
+  }
 
-LlamaCppSimple* llama_create(const char* model_path, int context, int gpu_layers, int threads, int seed, int batch) {
-    try {
-        return new LlamaCppSimple(model_path, context, gpu_layers, threads, seed, batch);
-    } catch (const std::exception& e) {
-        // Handle exceptions if necessary
-        return nullptr;
+  void walk(const TokenTrie& trie, int node, const std::vector<GrammarStack>& state) {
+    for (const auto& edge : trie.nodes[node].children) {
+      std::vector<GrammarStack> next = accept(state, edge.first);
+      if (next.empty()) continue;
+      for (llama_token id : trie.nodes[edge.second].tokens) allowed[id] = 1;
+      walk(trie, edge.second, next);
     }
-}
+  }
 
-void llama_destroy(LlamaCppSimple* instance) {
-    delete instance;
-}
+  grammar_parser::parse_state parsed;
+  std::vector<GrammarStack> stacks;
+  std::vector<char> allowed;
+};
 
-void* llama_get_context(LlamaCppSimple* instance) {
-  return (void*)(instance->getContext());
+// Runs fn(i) for i in [0, n) on up to `threads` threads, pulling indices
+// from a shared counter so uneven items balance out.
+static void parallelFor(int n, int threads, const std::function<void(int)>& fn) {
+  threads = std::min(threads, n);
+  if (threads <= 1) {
+    for (int i = 0; i < n; i++) fn(i);
+    return;
+  }
+  std::atomic<int> next { 0 };
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&next, n, &fn]() {
+      for (int i = next++; i < n; i = next++) fn(i);
+    });
+  }
+  for (auto& w : workers) w.join();
 }
 
-int llama_generate_text(LlamaCppSimple* instance, const char* prompt, int total_tokens) {
-    if (instance == nullptr) {
+// Tokenizer over a model's vocabulary. It only reads the vocab, so calls may
+// run concurrently with each other and with generation. Pinned segments
+// (system prompts, chat template markers) are tokenized once and served from
+// the cache when a text matches one exactly. A tokenizer from
+// llama_tokenizer_load owns a vocab-only model; an instance's borrows its
+// model.
+struct llama_tokenizer {
+  llama_model* model = NULL;
+  bool ownsModel = false;
+  int threads = 1;
+
+  llama_tokenizer() {}
+  llama_tokenizer(const llama_tokenizer&) = delete;
+  llama_tokenizer& operator=(const llama_tokenizer&) = delete;
+
+  ~llama_tokenizer() {
+    if (ownsModel && model != NULL) {
+      llama_free_model(model);
+    }
+  }
+
+  std::vector<llama_token> tokenize(const char* text, int textLen, bool addBos, bool special) {
+    if (hasSegments.load()) {
+      std::lock_guard<std::mutex> lock(segmentMutex);
+      auto it = segments.find(segmentKey(text, textLen, addBos, special));
+      if (it != segments.end()) {
+        return it->second;
+      }
+    }
+    std::vector<llama_token> tokens(textLen + (addBos ? 1 : 0) + 1);
+    int n = llama_tokenize(model, text, textLen, tokens.data(), tokens.size(), addBos, special);
+    if (n < 0) {
+      tokens.resize(-n);
+      n = llama_tokenize(model, text, textLen, tokens.data(), tokens.size(), addBos, special);
+    }
+    tokens.resize(std::max(0, n));
+    return tokens;
+  }
+
+  // Small inputs are tokenized inline; thread start-up would dominate.
+  void tokenizeMany(const char* const* texts, const int* textLens, int nTexts, bool addBos, bool special,
+      std::vector<std::vector<llama_token>>& out) {
+    out.assign(nTexts, std::vector<llama_token>());
+    size_t bytes = 0;
+    for (int i = 0; i < nTexts; i++) bytes += length(texts, textLens, i);
+    parallelFor(nTexts, bytes < 32 * 1024 ? 1 : threads, [&](int i) {
+      out[i] = tokenize(texts[i], length(texts, textLens, i), addBos, special);
+    });
+  }
+
+  std::string detokenize(const llama_token* tokens, int nTokens) {
+    std::string text;
+    char piece[64];
+    for (int i = 0; i < nTokens; i++) {
+      int n = llama_token_to_piece(model, tokens[i], piece, sizeof(piece));
+      if (n >= 0) {
+        text.append(piece, n);
+      } else {
+        std::vector<char> large(-n);
+        n = llama_token_to_piece(model, tokens[i], large.data(), large.size());
+        text.append(large.data(), std::max(0, n));
+      }
+    }
+    return text;
+  }
+
+  int pinSegment(const char* text, bool addBos, bool special) {
+    int textLen = strlen(text);
+    std::vector<llama_token> tokens = tokenize(text, textLen, addBos, special);
+    std::lock_guard<std::mutex> lock(segmentMutex);
+    segments[segmentKey(text, textLen, addBos, special)] = tokens;
+    hasSegments = true;
+    return tokens.size();
+  }
+
+  void clearSegments() {
+    std::lock_guard<std::mutex> lock(segmentMutex);
+    segments.clear();
+    hasSegments = false;
+  }
+
+  static int length(const char* const* texts, const int* textLens, int i) {
+    return textLens != NULL ? textLens[i] : (int) strlen(texts[i]);
+  }
+
+  private:
+  static std::string segmentKey(const char* text, int textLen, bool addBos, bool special) {
+    std::string key;
+    key.reserve(textLen + 2);
+    key.push_back(addBos ? '1' : '0');
+    key.push_back(special ? '1' : '0');
+    key.append(text, textLen);
+    return key;
+  }
+
+  std::mutex segmentMutex;
+  std::unordered_map<std::string, std::vector<llama_token>> segments;
+  std::atomic<bool> hasSegments { false };
+};
+
+// Carries sampled tokens from the decode thread to a delivery thread through
+// a lock-free single-producer single-consumer ring, so detokenizing, stop
+// matching and the callbacks overlap the next llama_decode. The threads only
+// meet on the mutex to sleep, when the ring is empty or full or at the end
+// of a request; a stop decided by delivery comes back through stopped.
+class TokenPipeline {
+  public:
+  typedef std::function<bool(llama_token)> DeliverFn;
+
+  // capacity must be a power of two; it bounds how far decode runs ahead
+  explicit TokenPipeline(size_t capacity) : slots(capacity), mask(capacity - 1) {
+    worker = std::thread([this]() { run(); });
+  }
+
+  ~TokenPipeline() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quit = true;
+    }
+    condition.notify_all();
+    worker.join();
+  }
+
+  // Starts a request: deliver gets its tokens until it returns false.
+  void begin(DeliverFn fn) {
+    std::lock_guard<std::mutex> lock(mutex);
+    deliver = std::move(fn);
+    delivered = 0;
+    stopFlag = false;
+    active = true;
+  }
+
+  // Queues a token, waiting while the ring is full. False once delivery has
+  // stopped; the token is dropped.
+  bool push(llama_token token) {
+    size_t t = tail.load();
+    if (t - head.load() == slots.size()) {
+      std::unique_lock<std::mutex> lock(mutex);
+      decodeWaiting = true;
+      condition.wait(lock, [&]() { return t - head.load() < slots.size() || stopFlag.load(); });
+      decodeWaiting = false;
+    }
+    if (stopFlag.load()) {
+      return false;
+    }
+    slots[t & mask] = token;
+    tail.store(t + 1);
+    if (workerSleeping.load()) {
+      std::lock_guard<std::mutex> lock(mutex);
+      condition.notify_all();
+    }
+    return true;
+  }
+
+  bool stopped() const {
+    return stopFlag.load();
+  }
+
+  // Waits until every queued token has been handled, dropping the rest with
+  // abort. Returns how many tokens delivery accepted.
+  int finish(bool abort) {
+    if (!active) {
+      return delivered;
+    }
+    if (abort) {
+      stopFlag = true;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    decodeWaiting = true;
+    condition.wait(lock, [&]() { return head.load() == tail.load(); });
+    decodeWaiting = false;
+    active = false;
+    deliver = nullptr;
+    return delivered;
+  }
+
+  // Finishes an unfinished request on every way out of the decode loop;
+  // the callbacks may reference the caller's stack.
+  class Request {
+    public:
+    Request(TokenPipeline* pipeline, DeliverFn fn) : pipeline(pipeline) {
+      if (pipeline != NULL) pipeline->begin(std::move(fn));
+    }
+    ~Request() {
+      if (pipeline != NULL) pipeline->finish(true);
+    }
+    private:
+    TokenPipeline* pipeline;
+  };
+
+  private:
+  std::vector<llama_token> slots;
+  size_t mask;
+  std::atomic<size_t> head { 0 };       // next token to handle; advanced once it is
+  std::atomic<size_t> tail { 0 };       // next free slot
+  std::atomic<bool> stopFlag { false };
+  std::atomic<bool> workerSleeping { false };
+  std::atomic<bool> decodeWaiting { false };
+  std::atomic<int> delivered { 0 };
+  DeliverFn deliver;
+  bool active = false;
+  bool quit = false;
+  std::mutex mutex;
+  std::condition_variable condition;
+  std::thread worker;
+
+  void run() {
+    while (true) {
+      size_t h = head.load();
+      if (h != tail.load()) {
+        if (!stopFlag.load()) {
+          if (deliver(slots[h & mask])) {
+            delivered++;
+          } else {
+            stopFlag = true;
+          }
+        }
+        head.store(h + 1);
+        if (decodeWaiting.load()) {
+          std::lock_guard<std::mutex> lock(mutex);
+          condition.notify_all();
+        }
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(mutex);
+      workerSleeping = true;
+      condition.wait(lock, [&]() { return quit || head.load() != tail.load(); });
+      workerSleeping = false;
+      if (quit) {
+        return;
+      }
+    }
+  }
+};
+
+// Tokens decode may run ahead of a slow consumer; a stop costs at most this
+// many wasted decodes.
+static const size_t pipelineSlots = 32;
+
+// Per-prompt state for generateBatch.
+struct BatchSequence {
+  int index;
+  llama_seq_id seqId;
+  std::vector<llama_token> promptTokens;
+  int maxNewTokens;
+  int cachedTokens;           // prompt tokens shared from the prefix cache
+  int prefixNode;             // prefix cache node this sequence holds, or -1
+  int nPast;
+  int generated;
+  llama_token nextToken;
+  double nextLogprob;
+  double logprob;             // sum over every sampled token, EOS included
+  std::mt19937 rng;
+  StopMatcher stopMatcher;
+  PenaltyWindow penalties;
+  std::vector<llama_token> decoded;   // generated tokens in the KV cache
+  std::string text;
+  llama_stream_fn stream;
+  void* streamUserData;
+  Utf8Assembler utf8;
+  llama_stop_reason stopReason;
+  std::chrono::steady_clock::time_point admitted;
+  double prefillMs, firstTokenMs, totalMs;
+};
+
+// Sequence ids from here up outlive a request (sessions and cached
+// prefixes); stateless requests number theirs from 0.
+static const llama_seq_id keptSeqBase = 1 << 24;
+
+// A batch prompt sharing at least this many more tokens with one admitted
+// in the same round waits a step for that prompt to be cached.
+static const int prefixDeferTokens = 64;
+
+// Radix tree of prompt prefixes whose KV cells stay in the context between
+// requests. A new sequence links the deepest matching prefix into itself
+// with llama_kv_cache_seq_cp, so the cells are shared instead of recomputed,
+// and prefills only the rest. Every leaf owns a kept sequence holding its
+// whole path, which keeps an ancestor's cells alive while any leaf below it
+// survives. Leaves no live sequence uses are evicted least recently used
+// first.
+struct PrefixCache {
+  struct Node {
+    std::vector<llama_token> tokens;    // edge from the parent
+    int depth = 0;                      // prefix length at the end of the edge
+    int parent = -1;                    // -1 for the root and free nodes
+    std::unordered_map<llama_token, int> children;
+    llama_seq_id holder = -1;           // leaves only
+    int refs = 0;                       // live sequences whose path runs through here
+    uint64_t lastUsed = 0;
+  };
+
+  llama_context* ctx = nullptr;
+  std::function<llama_seq_id()> acquireSeq;
+  std::function<void(llama_seq_id)> releaseSeq;
+
+  PrefixCache() : nodes(1) {}
+
+  // Length of the longest cached prefix of tokens; node is where it ends,
+  // possibly partway along its edge.
+  int match(const llama_token* tokens, int n, int& node) const {
+    node = 0;
+    int i = 0;
+    while (i < n) {
+      auto it = nodes[node].children.find(tokens[i]);
+      if (it == nodes[node].children.end()) {
+        break;
+      }
+      const std::vector<llama_token>& edge = nodes[it->second].tokens;
+      int k = 1;
+      while (k < (int) edge.size() && i + k < n && edge[k] == tokens[i + k]) k++;
+      node = it->second;
+      i += k;
+      if (k < (int) edge.size()) {
+        break;
+      }
+    }
+    return i;
+  }
+
+  // Shares the cells of the cached part of tokens, at most limit, into seq.
+  // Returns how many were shared; node is where they end (0 if none).
+  int attach(llama_seq_id seq, const llama_token* tokens, int n, int limit, int& node) {
+    int shared = std::min(match(tokens, n, node), limit);
+    if (shared <= 0) {
+      node = 0;
+      return 0;
+    }
+    llama_kv_cache_seq_cp(ctx, holderOf(node), seq, 0, shared);
+    touch(node);
+    return shared;
+  }
+
+  // Caches tokens[0, n), whose cells seq holds. Returns the node ending at n.
+  int insert(llama_seq_id seq, const llama_token* tokens, int n) {
+    int node;
+    int matched = match(tokens, n, node);
+    if (node != 0 && matched < nodes[node].depth) {
+      node = split(node, matched);
+    }
+    if (matched < n) {
+      if (node != 0 && nodes[node].children.empty()) {
+        // a leaf grows in place and its sequence takes the new cells
+        Node& leaf = nodes[node];
+        llama_kv_cache_seq_cp(ctx, seq, leaf.holder, leaf.depth, n);
+        leaf.tokens.insert(leaf.tokens.end(), tokens + matched, tokens + n);
+        leaf.depth = n;
+      } else {
+        node = newNode(node, tokens + matched, n - matched);
+        nodes[node].holder = acquireSeq();
+        llama_kv_cache_seq_cp(ctx, seq, nodes[node].holder, 0, n);
+      }
+    }
+    touch(node);
+    return node;
+  }
+
+  void acquire(int node) {
+    for (; node > 0; node = nodes[node].parent) nodes[node].refs++;
+  }
+
+  void release(int node) {
+    for (; node > 0; node = nodes[node].parent) nodes[node].refs--;
+  }
+
+  void releaseAll() {
+    for (auto& node : nodes) node.refs = 0;
+  }
+
+  // Drops the least recently used leaf no live sequence uses; false if
+  // there is none.
+  bool evictOne() {
+    int victim = -1;
+    for (int i = 1; i < (int) nodes.size(); i++) {
+      const Node& node = nodes[i];
+      if (node.parent >= 0 && node.children.empty() && node.refs == 0 &&
+          (victim < 0 || node.lastUsed < nodes[victim].lastUsed)) {
+        victim = i;
+      }
+    }
+    if (victim < 0) {
+      return false;
+    }
+    remove(victim);
+    return true;
+  }
+
+  void clear() {
+    for (int i = 1; i < (int) nodes.size(); i++) {
+      if (nodes[i].holder >= 0) {
+        llama_kv_cache_seq_rm(ctx, nodes[i].holder, -1, -1);
+        releaseSeq(nodes[i].holder);
+      }
+    }
+    nodes.assign(1, Node());
+    freeNodes.clear();
+  }
+
+  private:
+
+  std::vector<Node> nodes;              // 0 is the root
+  std::vector<int> freeNodes;
+  uint64_t clock = 0;
+
+  int newNode(int parent, const llama_token* tokens, int n) {
+    int id;
+    if (!freeNodes.empty()) {
+      id = freeNodes.back();
+      freeNodes.pop_back();
+      nodes[id] = Node();
+    } else {
+      id = nodes.size();
+      nodes.push_back(Node());
+    }
+    nodes[id].tokens.assign(tokens, tokens + n);
+    nodes[id].parent = parent;
+    nodes[id].depth = nodes[parent].depth + n;
+    nodes[parent].children[tokens[0]] = id;
+    return id;
+  }
+
+  // Cuts node's edge so that a new node ends at depth; returns the new node,
+  // which takes node's place under the parent.
+  int split(int node, int depth) {
+    int cut = depth - (nodes[node].depth - (int) nodes[node].tokens.size());
+    std::vector<llama_token> head(nodes[node].tokens.begin(), nodes[node].tokens.begin() + cut);
+    int mid = newNode(nodes[node].parent, head.data(), cut);
+    Node& child = nodes[node];
+    child.tokens.erase(child.tokens.begin(), child.tokens.begin() + cut);
+    child.parent = mid;
+    nodes[mid].children[child.tokens[0]] = node;
+    nodes[mid].refs = child.refs;
+    nodes[mid].lastUsed = child.lastUsed;
+    return mid;
+  }
+
+  llama_seq_id holderOf(int node) const {
+    while (nodes[node].holder < 0) {
+      node = nodes[node].children.begin()->second;
+    }
+    return nodes[node].holder;
+  }
+
+  void touch(int node) {
+    uint64_t now = ++clock;
+    for (; node > 0; node = nodes[node].parent) nodes[node].lastUsed = now;
+  }
+
+  void remove(int leaf) {
+    Node& node = nodes[leaf];
+    Node& parent = nodes[node.parent];
+    parent.children.erase(node.tokens[0]);
+    if (node.parent != 0 && parent.children.empty()) {
+      // the parent becomes a leaf and keeps its path in the same sequence
+      llama_kv_cache_seq_rm(ctx, node.holder, parent.depth, -1);
+      parent.holder = node.holder;
+    } else {
+      llama_kv_cache_seq_rm(ctx, node.holder, -1, -1);
+      releaseSeq(node.holder);
+    }
+    node = Node();
+    freeNodes.push_back(leaf);
+  }
+};
+
+// A conversation that keeps its KV sequence between calls. history holds
+// every appended and generated token; the KV cache holds history[0, nPast)
+// and the rest is decoded by the next generate. Appends stop one token
+// short so generate always samples from a fresh logits row.
+struct llama_session {
+  LlamaCppSimple* owner = nullptr;
+  llama_seq_id seqId = -1;
+  std::vector<llama_token> history;
+  int nPast = 0;
+  llama_adapter* adapter = nullptr;
+};
+
+// A registered LoRA adapter. Binding merges it into the model weights with
+// llama_model_apply_lora_from_file; unbinding merges the base tensors back
+// from basePath, or the adapter again with the negated scale.
+struct llama_adapter {
+  LlamaCppSimple* owner = nullptr;    // NULL once the instance is destroyed
+  std::string path;
+  std::string basePath;
+  float scale = 1.0f;
+  llama_adapter_stats stats = {};
+};
+
+// guards llama_adapter::owner and each instance's adapter list
+static std::mutex adapterOwnerMutex;
+
+// Hands the context to one call at a time, highest priority first and in
+// arrival order within a priority. The holder may lend it: waiting guests
+// (stateless requests) of higher priority with the lender's adapter then run
+// until none is left, and the lender takes it back before anyone else.
+// Lenders stack, so a guest batch can lend again.
+class ContextGate {
+  public:
+  class Turn {
+    public:
+    Turn(ContextGate& gate, int priority = 0, bool guest = false, const void* key = NULL) : gate(gate) {
+      gate.enter(priority, guest, key);
+    }
+    ~Turn() { gate.leave(); }
+    private:
+    ContextGate& gate;
+  };
+
+  // True when a waiting call would run as a guest of a lender with this
+  // priority and key.
+  bool preemptWanted(int priority, const void* key) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto& waiter : waiting) {
+      if (guestOf(waiter, priority, key)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Called by the holder; returns once it holds the context again.
+  void lend(int priority, const void* key) {
+    std::unique_lock<std::mutex> lock(mutex);
+    lenders.push_back({ priority, 0, false, key });
+    size_t depth = lenders.size();
+    held = false;
+    condition.notify_all();
+    condition.wait(lock, [&]() { return !held && lenders.size() == depth && !guestWaiting(); });
+    lenders.pop_back();
+    held = true;
+  }
+
+  int waitingCount() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return waiting.size();
+  }
+
+  bool busy() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return held || !lenders.empty();
+  }
+
+  private:
+  struct Ticket {
+    int priority;
+    uint64_t order;
+    bool guest;
+    const void* key;
+  };
+
+  std::mutex mutex;
+  std::condition_variable condition;
+  std::vector<Ticket> waiting;
+  std::vector<Ticket> lenders;
+  uint64_t nextOrder = 0;
+  bool held = false;
+
+  static bool guestOf(const Ticket& waiter, int priority, const void* key) {
+    return waiter.guest && waiter.priority > priority && waiter.key == key;
+  }
+
+  bool eligible(const Ticket& waiter) const {
+    return lenders.empty() || guestOf(waiter, lenders.back().priority, lenders.back().key);
+  }
+
+  bool guestWaiting() const {
+    for (const auto& waiter : waiting) {
+      if (guestOf(waiter, lenders.back().priority, lenders.back().key)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool isNext(uint64_t order) const {
+    const Ticket* best = NULL;
+    for (const auto& waiter : waiting) {
+      if (eligible(waiter) && (best == NULL || waiter.priority > best->priority)) {
+        best = &waiter;
+      }
+    }
+    return best != NULL && best->order == order;
+  }
+
+  void enter(int priority, bool guest, const void* key) {
+    std::unique_lock<std::mutex> lock(mutex);
+    uint64_t order = nextOrder++;
+    waiting.push_back({ priority, order, guest, key });
+    condition.wait(lock, [&]() { return !held && isNext(order); });
+    waiting.erase(std::find_if(waiting.begin(), waiting.end(),
+        [&](const Ticket& waiter) { return waiter.order == order; }));
+    held = true;
+  }
+
+  void leave() {
+    std::lock_guard<std::mutex> lock(mutex);
+    held = false;
+    condition.notify_all();
+  }
+};
+
+class LlamaCppSimple {
+  public:
+  LlamaCppSimple(const std::string& path, const llama_load_options& options) :
+    modelPath(path), loadOptions(options), contextTokenLen(options.context), randSeed(options.seed), batchSize(options.batch)
+  {
+    batch = llama_batch_init(batchSize, 0, 1);
+    currentTokenIndex = 0;
+    prefixCache.acquireSeq = [this]() { return acquireKeptSeq(); };
+    prefixCache.releaseSeq = [this](llama_seq_id id) { releaseKeptSeq(id); };
+  }
+
+  // Runs every startup phase on the calling thread and throws on failure.
+  void load() {
+    auto start = std::chrono::steady_clock::now();
+    auto phase = start;
+
+    llama_backend_init(gptParams.numa);
+    backendInitialized = true;
+    startupStats.cpu_kernels = (llama_cpu_kernels) ggml_dispatch_level();
+    startupStats.cpu_dispatch = ggml_dispatch_runtime() != 0;
+    startupStats.backend_ms = msSince(phase);
+
+    if (loadOptions.prefetch) {
+      reportProgress(0.0f);
+      phase = std::chrono::steady_clock::now();
+      // the prefetch is the first fifth of the range onLoadProgress continues
+      prefetchModelFile(modelPath, loadOptions.threads, [this](float read) { reportProgress(0.2f * read); });
+      startupStats.prefetch_ms = msSince(phase);
+    }
+
+    phase = std::chrono::steady_clock::now();
+    loadModel(loadOptions.gpu_layers, loadOptions.threads);
+    startupStats.load_ms = msSince(phase);
+
+    phase = std::chrono::steady_clock::now();
+    initContext();
+    startupStats.context_ms = msSince(phase);
+
+    if (loadOptions.warmup) {
+      phase = std::chrono::steady_clock::now();
+      warmUp();
+      startupStats.warmup_ms = msSince(phase);
+    }
+
+    startupStats.total_ms = msSince(start);
+    reportProgress(1.0f);
+
+    fprintf(stderr, "%s: ready in %.1f ms (backend %.1f, prefetch %.1f, load %.1f, context %.1f, warmup %.1f), %s kernels%s\n",
+        __func__, startupStats.total_ms, startupStats.backend_ms, startupStats.prefetch_ms,
+        startupStats.load_ms, startupStats.context_ms, startupStats.warmup_ms,
+        ggml_dispatch_name(startupStats.cpu_kernels), startupStats.cpu_dispatch ? " (runtime dispatch)" : "");
+  }
+
+  // Starts load() on a background thread; callers block in waitReady().
+  void loadAsync() {
+    loader = std::thread([this]() {
+      LoadState result = LOAD_READY;
+      try {
+        load();
+      } catch (const std::exception& e) {
+        fprintf(stderr, "%s: error: %s\n", __func__, e.what());
+        result = LOAD_FAILED;
+      }
+      std::lock_guard<std::mutex> lock(loadMutex);
+      loadState = result;
+      loadCondition.notify_all();
+    });
+  }
+
+  bool waitReady() {
+    std::unique_lock<std::mutex> lock(loadMutex);
+    loadCondition.wait(lock, [this]() { return loadState != LOAD_PENDING; });
+    return loadState == LOAD_READY;
+  }
+
+  int readyState() {
+    std::lock_guard<std::mutex> lock(loadMutex);
+    return loadState == LOAD_READY ? 1 : (loadState == LOAD_FAILED ? -1 : 0);
+  }
+
+  void markReady() {
+    std::lock_guard<std::mutex> lock(loadMutex);
+    loadState = LOAD_READY;
+  }
+
+  const llama_startup_stats& getStartupStats() const {
+    return startupStats;
+  }
+
+  llama_sched_stats getSchedStats() {
+    std::lock_guard<std::mutex> lock(schedMutex);
+    llama_sched_stats stats = schedStats;
+    stats.waiting = contextGate.waitingCount();
+    return stats;
+  }
+
+  llama_context* getContext() {
+    return currentContext;
+  }
+
+  // Adds the given token ids, plus every token of each string tokenized the
+  // same way as prompt text, to the mask (or to its bias list).
+  void fillTokenMask(llama_token_mask& mask, const int* tokens, int nTokens,
+      const char* const* strings, int nStrings, bool asBias, float bias) {
+    if (!waitReady()) {
+      throw std::runtime_error("Model failed to load.");
+    }
+    std::vector<llama_token> ids(tokens, tokens + std::max(0, nTokens));
+    for (int i = 0; i < nStrings; i++) {
+      std::vector<llama_token> pieces = llama_tokenize(model, strings[i], false, false);
+      ids.insert(ids.end(), pieces.begin(), pieces.end());
+    }
+    for (llama_token id : ids) {
+      if (asBias) mask.addBias(id, bias);
+      else mask.add(id);
+    }
+  }
+
+  int vocabSize() {
+    return waitReady() ? llama_n_vocab(model) : 0;
+  }
+
+  llama_tokenizer* getTokenizer() {
+    return waitReady() ? &tokenizer : NULL;
+  }
+
+  int generateText(const std::string& prompt, int maxNewTokens, const llama_generate_params& params, llama_generate_result& result) {
+    auto requestStart = std::chrono::steady_clock::now();
+    if (!waitReady()) {
+      throw std::runtime_error("Model failed to load.");
+    }
+
+    std::vector<llama_token> promptTokens;
+    tokenize(prompt, contextTokenLen, promptTokens, true);
+    return generateTokens(promptTokens.data(), promptTokens.size(), maxNewTokens, params, result, requestStart);
+  }
+
+  // Generates from an already tokenized prompt. The ids are decoded straight
+  // from the caller's array; nothing is detokenized or copied.
+  int generateTokens(const llama_token* promptTokens, int nPromptTokens, int maxNewTokens,
+      const llama_generate_params& params, llama_generate_result& result,
+      std::chrono::steady_clock::time_point requestStart = std::chrono::steady_clock::now()) {
+    result = llama_generate_result();
+    result.stop_reason = LLAMA_STOP_ERROR;
+    result.ttft_ms = -1.0;
+
+    if (!waitReady()) {
+      throw std::runtime_error("Model failed to load.");
+    }
+    if (nPromptTokens < 1 || nPromptTokens > contextTokenLen) {
+      throw std::runtime_error("Error: input overran context length.");
+    }
+    if (nPromptTokens + maxNewTokens > contextTokenLen) {
+      fprintf(stderr, "%s: error: total potential tokens exceeds context length\n", __func__);
+      throw std::runtime_error("error: total potential tokens exceeds context length.");
+    }
+    if (params.beam_width > 1 && params.grammar != NULL && params.grammar[0] != '\0') {
+      throw std::runtime_error("Grammar constraints are not supported with beam search.");
+    }
+    result.prompt_tokens = nPromptTokens;
+
+    if (!admit(nPromptTokens, params)) {
+      fprintf(stderr, "%s: rejected, projected prefill exceeds the deadline\n", __func__);
+      result.stop_reason = LLAMA_STOP_REJECTED;
+      result.total_ms = msSince(requestStart);
+      return 0;
+    }
+
+    queuedPromptTokens += nPromptTokens;
+    ContextGate::Turn turn(contextGate, params.priority, true, params.adapter);
+    queuedPromptTokens -= nPromptTokens;
+
+    beginRequest(requestStart, params);
+    bindAdapter(params.adapter);
+    initContext();
+    currentTokenIndex = 0;
+
+    llama_batch_clear(batch);
+
+    auto prefillStart = std::chrono::steady_clock::now();
+    setRunningWork(nPromptTokens, maxNewTokens);
+    int promptTokenCount = prefillCached(promptTokens, nPromptTokens, maxNewTokens, result.cached_tokens);
+    setRunningWork(0, maxNewTokens);
+    if (promptTokenCount < 0) {
+      return finishRequest(releaseInterrupted(0), 0, result);
+    }
+    result.prefill_ms = msSince(prefillStart);
+    recordPrefill(promptTokenCount - result.cached_tokens, result.prefill_ms);
+    currentTokenIndex = promptTokenCount;
+    seedPenalties(penalties, promptTokens, nPromptTokens);
+
+    if (beamWidth > 1) {
+      return finishRequest(beamSearch(promptTokenCount, maxNewTokens), promptTokenCount, result);
+    }
+
+    return decodeLoop(promptTokenCount, maxNewTokens, result);
+  }
+
+  void clearPrefixCache() {
+    if (!waitReady()) {
+      return;
+    }
+    ContextGate::Turn turn(contextGate);
+    prefixCache.clear();
+  }
+
+  // Registers an adapter after checking its files, and reads the adapter
+  // into the page cache so binding it later doesn't wait on the disk.
+  void loadAdapter(llama_adapter& adapter) {
+    if (!waitReady()) {
+      throw std::runtime_error("Model failed to load.");
+    }
+    if (!loadOptions.lora) {
+      throw std::runtime_error("LoRA adapters need llama_load_options.lora.");
+    }
+    auto start = std::chrono::steady_clock::now();
+    double bytes = fileBytes(adapter.path.c_str());
+    if (bytes <= 0) {
+      throw std::runtime_error("Unable to read LoRA adapter.");
+    }
+    if (!adapter.basePath.empty() && fileBytes(adapter.basePath.c_str()) <= 0) {
+      throw std::runtime_error("Unable to read LoRA base model.");
+    }
+    prefetchModelFile(adapter.path, loadOptions.threads);
+    adapter.stats.file_bytes = bytes;
+    adapter.stats.load_ms = msSince(start);
+
+    std::lock_guard<std::mutex> lock(adapterOwnerMutex);
+    adapter.owner = this;
+    adapters.push_back(&adapter);
+  }
+
+  // Called with adapterOwnerMutex held.
+  void unregisterAdapter(llama_adapter& adapter) {
+    ContextGate::Turn turn(contextGate);
+    if (boundAdapter == &adapter) {
+      bindAdapter(NULL);
+    }
+    adapters.erase(std::remove(adapters.begin(), adapters.end(), &adapter), adapters.end());
+  }
+
+  void setSessionAdapter(llama_session& session, llama_adapter* adapter) {
+    if (adapter != NULL && adapter->owner != this) {
+      throw std::runtime_error("LoRA adapter belongs to another instance.");
+    }
+    if (!session.history.empty()) {
+      throw std::runtime_error("Session is not empty.");
+    }
+    session.adapter = adapter;
+  }
+
+  // Opens a session with its own sequence id. Sessions hold cells in the
+  // shared context until they are closed, so stateless requests get fewer.
+  void openSession(llama_session& session) {
+    if (!waitReady()) {
+      throw std::runtime_error("Model failed to load.");
+    }
+    ContextGate::Turn turn(contextGate);
+    session.owner = this;
+    session.seqId = acquireKeptSeq();
+  }
+
+  void closeSession(llama_session& session) {
+    ContextGate::Turn turn(contextGate);
+    llama_kv_cache_seq_rm(currentContext, session.seqId, -1, -1);
+    releaseKeptSeq(session.seqId);
+    session.seqId = -1;
+  }
+
+  // The child shares every decoded cell with the parent through
+  // llama_kv_cache_seq_cp; nothing is recomputed until the two diverge.
+  void forkSession(const llama_session& parent, llama_session& child) {
+    ContextGate::Turn turn(contextGate);
+    child.history = parent.history;
+    child.nPast = parent.nPast;
+    child.adapter = parent.adapter;
+    child.owner = this;
+    child.seqId = acquireKeptSeq();
+    if (child.nPast > 0) {
+      llama_kv_cache_seq_cp(currentContext, parent.seqId, child.seqId, 0, child.nPast);
+    }
+  }
+
+  // Adds tokens to the history and decodes all but the last right away, so
+  // forks taken afterwards share them. Returns the history length.
+  int appendToSession(llama_session& session, const llama_token* tokens, int n) {
+    if (!waitReady()) {
+      throw std::runtime_error("Model failed to load.");
+    }
+    if (n <= 0) {
+      return session.history.size();
+    }
+    if ((int) session.history.size() + n > contextTokenLen) {
+      throw std::runtime_error("Error: session overran context length.");
+    }
+    session.history.insert(session.history.end(), tokens, tokens + n);
+
+    int target = session.history.size() - 1;
+    if (target > session.nPast) {
+      ContextGate::Turn turn(contextGate);
+      // cells left by the last request would count as used
+      initContext();
+      if (!makeRoom(target - session.nPast)) {
+        session.history.resize(session.history.size() - n);
+        throw std::runtime_error("KV cache full: other sessions hold the cells this one needs.");
+      }
+      beginRequest(std::chrono::steady_clock::now(), llama_generate_default_params());
+      bindAdapter(session.adapter);
+      activeSeq = session.seqId;
+      retainedCells = session.nPast;
+      llama_batch_clear(batch);
+      processPrompt(session.history.data() + session.nPast, target - session.nPast, session.nPast);
+      session.nPast = target;
+      activeSeq = 0;
+      retainedCells = 0;
+    }
+    return session.history.size();
+  }
+
+  int appendTextToSession(llama_session& session, const char* text) {
+    if (!waitReady()) {
+      throw std::runtime_error("Model failed to load.");
+    }
+    std::vector<llama_token> tokens = tokenizer.tokenize(text, strlen(text), session.history.empty(), true);
+    return appendToSession(session, tokens.data(), tokens.size());
+  }
+
+  // Drops history from position n on, freeing the cells behind it.
+  void truncateSession(llama_session& session, int n) {
+    n = std::max(0, std::min(n, (int) session.history.size()));
+    ContextGate::Turn turn(contextGate);
+    session.history.resize(n);
+    if (session.nPast > n) {
+      llama_kv_cache_seq_rm(currentContext, session.seqId, n, -1);
+      session.nPast = n;
+    }
+  }
+
+  // Continues the session from its history. Generated tokens other than EOS
+  // join the history; an interrupted call leaves the history as it was.
+  int generateInSession(llama_session& session, int maxNewTokens, const llama_generate_params& params,
+      llama_generate_result& result) {
+    auto requestStart = std::chrono::steady_clock::now();
+    result = llama_generate_result();
+    result.stop_reason = LLAMA_STOP_ERROR;
+    result.ttft_ms = -1.0;
+
+    if (session.history.empty()) {
+      throw std::runtime_error("Session is empty.");
+    }
+    if (params.beam_width > 1) {
+      throw std::runtime_error("Beam search is not supported in sessions.");
+    }
+    int historyLen = session.history.size();
+    if (historyLen + maxNewTokens > contextTokenLen) {
+      throw std::runtime_error("error: total potential tokens exceeds context length.");
+    }
+    result.prompt_tokens = historyLen;
+
+    ContextGate::Turn turn(contextGate, params.priority);
+    beginRequest(requestStart, params);
+    bindAdapter(session.adapter);
+    initContext();
+
+    // the last history token is decoded here so its logits are this call's
+    if (session.nPast == historyLen) {
+      llama_kv_cache_seq_rm(currentContext, session.seqId, historyLen - 1, -1);
+      session.nPast = historyLen - 1;
+    }
+    // other sessions and forks share the cells, so the history fitting the
+    // context is not enough
+    if (!makeRoom(historyLen - session.nPast + maxNewTokens)) {
+      cancelToken = NULL;
+      throw std::runtime_error("KV cache full: other sessions hold the cells this one needs.");
+    }
+    activeSeq = session.seqId;
+    retainedCells = session.nPast;
+
+    llama_batch_clear(batch);
+    auto prefillStart = std::chrono::steady_clock::now();
+    int pending = historyLen - session.nPast;
+    setRunningWork(pending, maxNewTokens);
+    int prefilled = processPrompt(session.history.data() + session.nPast, pending, session.nPast);
+    setRunningWork(0, maxNewTokens);
+    if (prefilled < 0) {
+      return finishRequest(releaseInterrupted(session.nPast), session.nPast, result);
+    }
+    result.prefill_ms = msSince(prefillStart);
+    recordPrefill(pending, result.prefill_ms);
+    session.nPast = historyLen;
+    retainedCells = historyLen;
+    seedPenalties(penalties, session.history.data(), historyLen);
+
+    std::vector<llama_token> emitted;
+    emittedTokens = &emitted;
+    int decoded = decodeLoop(historyLen, maxNewTokens, result);
+    if (result.stop_reason != LLAMA_STOP_CANCELLED && result.stop_reason != LLAMA_STOP_DEADLINE) {
+      session.history.insert(session.history.end(), emitted.begin(), emitted.end());
+      session.nPast = decoded;
+    }
+    return decoded;
+  }
+
+  private:
+
+  // Samples and decodes one token at a time on activeSeq from the logits of
+  // the last batch row, positions starting at promptTokenCount.
+  int decodeLoop(int promptTokenCount, int maxNewTokens, llama_generate_result& result) {
+    currentTokenIndex = promptTokenCount;
+    int totalTokens = promptTokenCount + maxNewTokens;
+
+    llama_token selectedToken = 0;
+
+    llama_token endOfSequence = llama_token_eos(model);
+    bool predictedEnd = false;
+
+    bool pipelined = pipelineRequested;
+    if (pipelined && !tokenPipeline) {
+      tokenPipeline.reset(new TokenPipeline(pipelineSlots));
+    }
+    deliveryStop = LLAMA_STOP_ERROR;
+    TokenPipeline::Request delivery(pipelined ? tokenPipeline.get() : NULL,
+        [this](llama_token token) { return deliverPipelined(token); });
+
+    do {
+      if (interrupted()) {
+        if (pipelined) {
+          settlePipeline(promptTokenCount, true);
+        }
+        return finishRequest(releaseInterrupted(currentTokenIndex), promptTokenCount, result);
+      }
+      if (pipelined && tokenPipeline->stopped()) {
+        break;
+      }
+
+      if (grammar) {
+        auto maskStart = std::chrono::steady_clock::now();
+        grammar->maskLogits(tokenTrie, llama_get_logits_ith(currentContext, batch.n_tokens - 1), llama_n_vocab(model), endOfSequence);
+        grammarMs += msSince(maskStart);
+      }
+
+      selectedToken = bestFromLastDecode();
+  
+      predictedEnd = (selectedToken == endOfSequence);
+      if (grammar && !predictedEnd) {
+        grammar->acceptToken(tokenTrie.codepoints[selectedToken]);
+      }
+      if (!predictedEnd) {
+        recordLogprobs(batch.n_tokens - 1, selectedToken);
+        if (emittedTokens != NULL) {
+          emittedTokens->push_back(selectedToken);
+        }
+      }
+      penalties.push(selectedToken);
+      if (!predictedEnd) {
+        llama_batch_clear(batch);
+ 
+        bool should_continue;
+        if (pipelined) {
+          if (firstTokenMs < 0) {
+            firstTokenMs = msSince(requestStart);
+          }
+          should_continue = tokenPipeline->push(selectedToken);
+        } else {
+          should_continue = outputSingleTokenAsString(selectedToken);
+        }
+        if (!should_continue && pipelined) {
+          break;
+        }
+        if (!should_continue) {
+          if (stopReason != LLAMA_STOP_SEQUENCE) {
+            stopReason = LLAMA_STOP_CALLBACK;
+          }
+          return finishRequest(currentTokenIndex, promptTokenCount, result);
+        }
+
+        llama_batch_add(batch, selectedToken, currentTokenIndex++, { activeSeq }, true);
+        runningDecodeSteps = totalTokens - currentTokenIndex;
+
+        auto stepStart = std::chrono::steady_clock::now();
+        decodeToNextTokenScores();
+        recordDecodeStep(msSince(stepStart));
+      } else {
+      }
+      
+    } while (!predictedEnd && currentTokenIndex < totalTokens);
+
+    if (pipelined) {
+      settlePipeline(promptTokenCount, false);
+      if (deliveryStop != LLAMA_STOP_ERROR) {
+        stopReason = deliveryStop;
+        return finishRequest(currentTokenIndex, promptTokenCount, result);
+      }
+    }
+
+    stopReason = predictedEnd ? LLAMA_STOP_EOS : LLAMA_STOP_LENGTH;
+    flushPendingText();
+
+    return finishRequest(currentTokenIndex, promptTokenCount, result);
+  }
+
+  // Runs on the delivery thread for each pipelined token.
+  bool deliverPipelined(llama_token token) {
+    bool hitStop = false;
+    if (deliverToken(token, hitStop)) {
+      return true;
+    }
+    deliveryStop = hitStop ? LLAMA_STOP_SEQUENCE : LLAMA_STOP_CALLBACK;
+    return false;
+  }
+
+  // Waits for the delivery thread, then drops what decode ran ahead with
+  // past the last token delivery accepted, so the request ends as if it had
+  // stopped in step.
+  void settlePipeline(int promptTokenCount, bool abort) {
+    int delivered = tokenPipeline->finish(abort);
+    int end = promptTokenCount + delivered;
+    if (end < currentTokenIndex) {
+      llama_kv_cache_seq_rm(currentContext, activeSeq, end, -1);
+      currentTokenIndex = end;
+    }
+    nLogprobs = std::min(nLogprobs, delivered);
+    if (emittedTokens != NULL && (int) emittedTokens->size() > delivered) {
+      emittedTokens->resize(delivered);
+    }
+  }
+
+  public:
+
+  // Runs many prompts through the shared context at once. Prompts are
+  // admitted while their prompt plus generation budget fits in the KV cache,
+  // prefilled together in packed batches under separate sequence ids, and
+  // then decoded in lock-step, one token per live sequence per llama_decode.
+  // A finished sequence's cells are freed so a queued prompt can take them.
+  void generateBatch(const llama_batch_request* requests, int count, int maxParallel,
+      const llama_generate_params& params, llama_batch_result* results) {
+    auto callStart = std::chrono::steady_clock::now();
+
+    if (!waitReady()) {
+      throw std::runtime_error("Model failed to load.");
+    }
+    if (params.grammar != NULL && params.grammar[0] != '\0') {
+      throw std::runtime_error("Grammar constraints are not supported in batches.");
+    }
+
+    std::vector<std::vector<llama_token>> promptTokens(count);
+    for (int i = 0; i < count; i++) {
+      if (requests[i].tokens != NULL) {
+        promptTokens[i].assign(requests[i].tokens, requests[i].tokens + std::max(0, requests[i].n_tokens));
+      } else {
+        tokenize(requests[i].prompt, contextTokenLen, promptTokens[i], true);
+      }
+    }
+
+    ContextGate::Turn turn(contextGate, params.priority, true, params.adapter);
+
+    beginRequest(callStart, params);
+    bindAdapter(params.adapter);
+    initContext();
+
+    // after beginRequest: sequences take the request's seed and penalties
+    std::vector<BatchSequence> sequences(count);
+    for (int i = 0; i < count; i++) {
+      initSequence(sequences[i], i, promptTokens[i], requests[i].max_new_tokens, params);
+      sequences[i].stream = requests[i].stream;
+      sequences[i].streamUserData = requests[i].stream_user_data;
+    }
+    batchResults = results;
+
+    if (maxParallel <= 0) {
+      maxParallel = loadOptions.parallel > 0 ? loadOptions.parallel : batchSize;
+    }
+    int parallelLimit = std::min(batchSize, maxParallel);
+    useRequestSeqs(parallelLimit);
+    size_t nextQueued = 0;
+    std::vector<BatchSequence*> live;
+    std::vector<llama_seq_id> freeSeqIds;
+    for (int id = parallelLimit - 1; id >= 0; id--) {
+      freeSeqIds.push_back(id);
+    }
+
+    while (true) {
+      if (contextGate.preemptWanted(params.priority, params.adapter)) {
+        lendContext(callStart, params, parallelLimit, live);
+      }
+      noteBatchWork(sequences, nextQueued, live);
+
+      // cells the live sequences may still take
+      int pendingCells = 0;
+      for (auto* seq : live) {
+        pendingCells += seq->maxNewTokens - seq->generated;
+      }
+
+      // admit queued prompts while they fit; a cached prefix needs no new
+      // cells, and cached prefixes no sequence uses are evicted for room
+      std::vector<BatchSequence*> admitted;
+      while (nextQueued < sequences.size() && !freeSeqIds.empty()) {
+        BatchSequence& seq = sequences[nextQueued];
+        int promptLen = seq.promptTokens.size();
+        if (promptLen + seq.maxNewTokens > contextTokenLen || seq.promptTokens.empty()) {
+          finishSequence(seq, LLAMA_STOP_ERROR, callStart);
+          nextQueued++;
+          continue;
+        }
+        int cached = 0;
+        int node = 0;
+        if (loadOptions.prefix_cache) {
+          cached = std::min(prefixCache.match(seq.promptTokens.data(), promptLen, node), promptLen - 1);
+          if (sharesPendingPrefill(admitted, seq.promptTokens, cached)) {
+            break;
+          }
+          prefixCache.acquire(node);
+        }
+        int need = promptLen - cached + seq.maxNewTokens;
+        if (!makeRoom(pendingCells + need)) {
+          prefixCache.release(node);
+          if (live.empty() && admitted.empty()) {
+            // nothing will free up cells for it
+            finishSequence(seq, LLAMA_STOP_ERROR, callStart);
+            nextQueued++;
+            continue;
+          }
+          break;
+        }
+        pendingCells += need;
+        seq.seqId = freeSeqIds.back();
+        freeSeqIds.pop_back();
+        if (cached > 0) {
+          prefixCache.release(node);
+          seq.cachedTokens = prefixCache.attach(seq.seqId, seq.promptTokens.data(), promptLen, promptLen - 1, seq.prefixNode);
+          prefixCache.acquire(seq.prefixNode);
+          seq.nPast = seq.cachedTokens;
+        }
+        seq.admitted = std::chrono::steady_clock::now();
+        admitted.push_back(&seq);
+        nextQueued++;
+      }
+
+      if (interrupted()) {
+        for (auto* seq : live) finishSequence(*seq, stopReason, callStart);
+        for (auto* seq : admitted) finishSequence(*seq, stopReason, callStart);
+        for (; nextQueued < sequences.size(); nextQueued++) {
+          finishSequence(sequences[nextQueued], stopReason, callStart);
+        }
+        clearRequestCells();
+        break;
+      }
+
+      if (!admitted.empty()) {
+        prefillPacked(admitted);
+        for (auto* seq : admitted) {
+          seq->prefillMs = msSince(seq->admitted);
+          if (loadOptions.prefix_cache) {
+            int node = prefixCache.insert(seq->seqId, seq->promptTokens.data(), seq->promptTokens.size());
+            prefixCache.acquire(node);
+            prefixCache.release(seq->prefixNode);
+            seq->prefixNode = node;
+          }
+          live.push_back(seq);
+        }
+      }
+
+      if (live.empty()) {
+        break;
+      }
+
+      std::vector<BatchSequence*> finished;
+      stepSequences(live, finished, callStart);
+      for (auto* seq : finished) {
+        llama_kv_cache_seq_rm(currentContext, seq->seqId, -1, -1);
+        prefixCache.release(seq->prefixNode);
+        seq->prefixNode = -1;
+        freeSeqIds.push_back(seq->seqId);
+      }
+    }
+
+    setRunningWork(0, 0);
+    batchResults = NULL;
+    cancelToken = NULL;
+  }
+
+  // Best-of-n: the prompt is prefilled once on sequence 0 and its KV cells
+  // are shared with sequences 1..n-1 through llama_kv_cache_seq_cp. All
+  // branches then decode together, each with its own RNG, so they diverge
+  // as soon as temperature > 0.
+  void generateN(const std::string& prompt, int maxNewTokens, int n,
+      const llama_generate_params& params, llama_batch_result* results) {
+    auto callStart = std::chrono::steady_clock::now();
+
+    if (!waitReady()) {
+      throw std::runtime_error("Model failed to load.");
+    }
+    if (n < 1 || n > batchSize) {
+      throw std::runtime_error("n must be between 1 and the batch size.");
+    }
+    if (params.grammar != NULL && params.grammar[0] != '\0') {
+      throw std::runtime_error("Grammar constraints are not supported with n completions.");
+    }
+
+    std::vector<llama_token> promptTokens;
+    tokenize(prompt, contextTokenLen, promptTokens, true);
+    if ((int) promptTokens.size() + n * maxNewTokens > contextTokenLen) {
+      throw std::runtime_error("error: total potential tokens exceeds context length.");
+    }
+
+    ContextGate::Turn turn(contextGate, params.priority, true, params.adapter);
+
+    beginRequest(callStart, params);
+    bindAdapter(params.adapter);
+    initContext();
+    useRequestSeqs(n);
+
+    llama_batch_clear(batch);
+    int cachedTokens = 0;
+    int promptTokenCount = prefillCached(promptTokens.data(), promptTokens.size(), n * maxNewTokens, cachedTokens);
+    double prefillMs = msSince(callStart);
+
+    std::vector<BatchSequence> branches(n);
+    batchResults = results;
+    for (int i = 0; i < n; i++) {
+      BatchSequence& seq = branches[i];
+      initSequence(seq, i, promptTokens, maxNewTokens, params);
+      seq.seqId = i;
+      seq.cachedTokens = cachedTokens;
+      seq.nPast = promptTokenCount;
+      seq.prefillMs = prefillMs;
+      if (promptTokenCount < 0) {
+        finishSequence(seq, stopReason, callStart);
+        continue;
+      }
+      if (i > 0) {
+        llama_kv_cache_seq_cp(currentContext, 0, i, -1, -1);
+      }
+      // every branch samples its first token from the shared prompt logits,
+      // which only need masking once
+      seq.nextToken = sampleFromLogits(batch.n_tokens - 1, seq.rng, &seq.penalties, &seq.nextLogprob, i == 0);
+      seq.penalties.push(seq.nextToken);
+      seq.logprob += seq.nextLogprob;
+    }
+
+    std::vector<BatchSequence*> live;
+    if (promptTokenCount >= 0) {
+      for (auto& seq : branches) live.push_back(&seq);
+    }
+
+    while (!live.empty()) {
+      if (interrupted()) {
+        for (auto* seq : live) finishSequence(*seq, stopReason, callStart);
+        break;
+      }
+      std::vector<BatchSequence*> finished;
+      stepSequences(live, finished, callStart);
+      for (auto* seq : finished) {
+        llama_kv_cache_seq_rm(currentContext, seq->seqId, -1, -1);
+      }
+    }
+    clearRequestCells();
+
+    batchResults = NULL;
+    cancelToken = NULL;
+  }
+
+  // Log-probabilities of continuations given a shared context. The context
+  // is prefilled once on sequence 0 and each continuation gets its own
+  // sequence sharing those cells through llama_kv_cache_seq_cp.
+  // Continuations are packed into as few llama_decode calls as fit, with
+  // logits requested only at positions that predict a continuation token; a
+  // continuation's last token is never decoded since nothing is predicted
+  // from it. Returns false if the request was cancelled or ran out of time.
+  bool score(const llama_token* context, int nContext, const llama_token* tokens, const int* counts, int n,
+      const llama_generate_params& params, float* tokenLogprobs, double* totals) {
+    auto callStart = std::chrono::steady_clock::now();
+
+    if (!waitReady()) {
+      throw std::runtime_error("Model failed to load.");
+    }
+    if (nContext < 1 || nContext >= contextTokenLen) {
+      throw std::runtime_error("Error: input overran context length.");
+    }
+
+    ContextGate::Turn turn(contextGate, params.priority, true, params.adapter);
+
+    beginRequest(callStart, params);
+    bindAdapter(params.adapter);
+    initContext();
+    llama_batch_clear(batch);
+    int cachedTokens = 0;
+    if (prefillCached(context, nContext, 0, cachedTokens) < 0) {
+      cancelToken = NULL;
+      return false;
+    }
+
+    // every first continuation token is predicted by the context's last row
+    const int nVocab = llama_n_vocab(model);
+    const float* contextRow = llama_get_logits_ith(currentContext, batch.n_tokens - 1);
+    const float contextLogZ = logSumExp(contextRow, nVocab, maxLogit(contextRow, nVocab));
+    for (int i = 0, offset = 0; i < n; offset += counts[i], i++) {
+      if (counts[i] > 0) {
+        tokenLogprobs[offset] = contextRow[tokens[offset]] - contextLogZ;
+      }
+    }
+
+    std::vector<int> predicts;            // per batch row: index of the token it predicts
+    std::vector<llama_seq_id> resident;
+    bool completed = true;
+    llama_batch_clear(batch);
+
+    for (int i = 0, offset = 0; i < n && completed; offset += counts[i], i++) {
+      int decodeLen = counts[i] - 1;
+      if (decodeLen <= 0) {
+        continue;
+      }
+      if (nContext + decodeLen > contextTokenLen) {
+        throw std::runtime_error("error: context plus continuation exceeds context length.");
+      }
+      // packed rows take cells only when decoded, and sessions and cached
+      // prefixes may hold some, so room is asked of the cache itself
+      if (!makeRoom(batch.n_tokens + decodeLen)) {
+        completed = decodeScoringChunk(tokens, predicts, tokenLogprobs);
+        if (!completed) break;
+        releasePackedSeqs(resident);
+        if (!makeRoom(decodeLen)) {
+          clearRequestCells();
+          cancelToken = NULL;
+          throw std::runtime_error("KV cache full: sessions and cached prefixes in use hold the cells scoring needs.");
+        }
+      }
+
+      llama_seq_id seq = resident.size() + 1;
+      useRequestSeqs(seq + 1);
+      llama_kv_cache_seq_cp(currentContext, 0, seq, -1, -1);
+      resident.push_back(seq);
+      for (int j = 0; j < decodeLen; j++) {
+        if (batch.n_tokens == batchSize) {
+          completed = decodeScoringChunk(tokens, predicts, tokenLogprobs);
+          if (!completed) break;
+        }
+        llama_batch_add(batch, tokens[offset + j], nContext + j, { seq }, true);
+        predicts.push_back(offset + j + 1);
+      }
+    }
+    if (completed && batch.n_tokens > 0) {
+      completed = decodeScoringChunk(tokens, predicts, tokenLogprobs);
+    }
+    clearRequestCells();
+    cancelToken = NULL;
+
+    for (int i = 0, offset = 0; i < n; offset += counts[i], i++) {
+      double total = 0;
+      for (int j = 0; j < counts[i]; j++) total += tokenLogprobs[offset + j];
+      totals[i] = completed ? total : NAN;
+    }
+    return completed;
+  }
+
+  // The prefix is prefilled (through the prefix cache, so a repeated query
+  // is free) on sequence 0. Each document then takes a sequence that shares
+  // those cells via llama_kv_cache_seq_cp, and its tokens plus the suffix go
+  // into packed multi-sequence batches; only its last token asks for logits.
+  // When the cells run out, the pending batch is decoded and the documents'
+  // sequences are dropped, keeping the prefix.
+  bool rerank(const llama_token* prefix, int nPrefix, const llama_token* documents, const int* counts, int n,
+      const llama_token* suffix, int nSuffix, llama_token yes, llama_token no,
+      const llama_generate_params& params, float* scores) {
+    auto callStart = std::chrono::steady_clock::now();
+
+    if (!waitReady()) {
+      throw std::runtime_error("Model failed to load.");
+    }
+    const int nVocab = llama_n_vocab(model);
+    if (nPrefix < 1 || nPrefix + nSuffix >= contextTokenLen) {
+      throw std::runtime_error("Error: input overran context length.");
+    }
+    if (yes < 0 || yes >= nVocab || no < 0 || no >= nVocab) {
+      throw std::runtime_error("Answer token out of range.");
+    }
+    std::fill(scores, scores + n, NAN);
+
+    ContextGate::Turn turn(contextGate, params.priority, true, params.adapter);
+
+    beginRequest(callStart, params);
+    bindAdapter(params.adapter);
+    initContext();
+    llama_batch_clear(batch);
+    int cachedTokens = 0;
+    if (prefillCached(prefix, nPrefix, 0, cachedTokens) < 0) {
+      cancelToken = NULL;
+      return false;
+    }
+
+    const int maxDocument = contextTokenLen - nPrefix - nSuffix;
+    std::vector<std::pair<int, int>> rows;    // batch row with logits, document
+    std::vector<llama_seq_id> resident;
+    bool completed = true;
+    llama_batch_clear(batch);
+
+    for (int i = 0, offset = 0; i < n && completed; offset += counts[i], i++) {
+      int documentLen = std::min(counts[i], maxDocument);
+      int pairLen = documentLen + nSuffix;
+      if (pairLen == 0) {
+        continue;
+      }
+      if (!makeRoom(batch.n_tokens + pairLen)) {
+        completed = decodeRerankChunk(rows, yes, no, scores);
+        if (!completed) break;
+        releasePackedSeqs(resident);
+        if (!makeRoom(pairLen)) {
+          clearRequestCells();
+          cancelToken = NULL;
+          throw std::runtime_error("KV cache full: sessions and cached prefixes in use hold the cells reranking needs.");
+        }
+      }
+
+      llama_seq_id seq = resident.size() + 1;
+      useRequestSeqs(seq + 1);
+      llama_kv_cache_seq_cp(currentContext, 0, seq, -1, -1);
+      resident.push_back(seq);
+      for (int j = 0; j < pairLen && completed; j++) {
+        if (batch.n_tokens == batchSize) {
+          completed = decodeRerankChunk(rows, yes, no, scores);
+          if (!completed) break;
+        }
+        llama_token token = j < documentLen ? documents[offset + j] : suffix[j - documentLen];
+        bool last = j == pairLen - 1;
+        llama_batch_add(batch, token, nPrefix + j, { seq }, last);
+        if (last) {
+          rows.push_back(std::make_pair(batch.n_tokens - 1, i));
+        }
+      }
+    }
+    if (completed && batch.n_tokens > 0) {
+      completed = decodeRerankChunk(rows, yes, no, scores);
+    }
+    clearRequestCells();
+    cancelToken = NULL;
+
+    if (!completed) {
+      std::fill(scores, scores + n, NAN);
+    }
+    return completed;
+  }
+
+  ~LlamaCppSimple() {
+    abandonLoad = true;
+    if (loader.joinable()) {
+      loader.join();
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(adapterOwnerMutex);
+      for (auto* adapter : adapters) {
+        adapter->owner = nullptr;
+      }
+    }
+
+    if (currentContext != 0) {
+      llama_free(currentContext);
+    }
+    if (model != 0) {
+      llama_free_model(model);
+    }
+
+    llama_batch_free(batch);
+
+    if (backendInitialized) {
+      llama_backend_free();
+    }
+  }
+ 
+  private:
+
+  enum LoadState { LOAD_PENDING, LOAD_READY, LOAD_FAILED };
+
+  // Lends the context to the waiting calls of higher priority, then resets
+  // the request state they replaced. The live sequences give up their cells
+  // and prefix cache references first: guests may clear request cells and
+  // evict prefixes, and a saved context state would not bring the cells
+  // back, since llama_copy_state_data only copies K/V up to the cache head,
+  // which freeing a finished sequence moves below cells still in use. Their
+  // cells are rebuilt from their tokens afterwards.
+  void lendContext(std::chrono::steady_clock::time_point callStart,
+      const llama_generate_params& params, int parallelLimit, const std::vector<BatchSequence*>& live) {
+    llama_batch_result* results = batchResults;
+    double lenderFirstTokenMs = firstTokenMs;
+    for (auto* seq : live) {
+      llama_kv_cache_seq_rm(currentContext, seq->seqId, -1, -1);
+      prefixCache.release(seq->prefixNode);
+      seq->prefixNode = -1;
+    }
+    {
+      std::lock_guard<std::mutex> lock(schedMutex);
+      schedStats.preemptions++;
+    }
+    contextGate.lend(params.priority, params.adapter);
+    beginRequest(callStart, params);
+    firstTokenMs = lenderFirstTokenMs;
+    batchResults = results;
+    useRequestSeqs(parallelLimit);
+    refillSequences(live);
+  }
+
+  // Rebuilds the cells of sequences that gave them up: the prompt is shared
+  // from the prefix cache as far as it survived, and the rest of it plus the
+  // tokens decoded since are prefilled in packed batches. Each sequence's
+  // next token was sampled before it was paused, so no logits are read.
+  void refillSequences(const std::vector<BatchSequence*>& live) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<int> cached(live.size(), 0);
+    int need = 0;
+    for (size_t i = 0; i < live.size(); i++) {
+      BatchSequence* seq = live[i];
+      llama_kv_cache_seq_rm(currentContext, seq->seqId, -1, -1);
+      int promptLen = seq->promptTokens.size();
+      if (loadOptions.prefix_cache) {
+        cached[i] = prefixCache.attach(seq->seqId, seq->promptTokens.data(), promptLen, promptLen, seq->prefixNode);
+        prefixCache.acquire(seq->prefixNode);
+      }
+      need += seq->nPast - cached[i] + seq->maxNewTokens - seq->generated;
+    }
+    if (!makeRoom(need)) {
+      throw std::runtime_error("KV cache full: the preempted batch cannot resume.");
+    }
+
+    int refilled = 0;
+    llama_batch_clear(batch);
+    for (size_t i = 0; i < live.size(); i++) {
+      BatchSequence* seq = live[i];
+      int promptLen = seq->promptTokens.size();
+      for (int p = cached[i]; p < seq->nPast; p++) {
+        if (batch.n_tokens == batchSize) {
+          decodeRefillChunk();
+        }
+        llama_token token = p < promptLen ? seq->promptTokens[p] : seq->decoded[p - promptLen];
+        llama_batch_add(batch, token, p, { seq->seqId }, false);
+        refilled++;
+      }
+    }
+    if (batch.n_tokens > 0) {
+      decodeRefillChunk();
+    }
+
+    std::lock_guard<std::mutex> lock(schedMutex);
+    schedStats.refilled_tokens += refilled;
+    schedStats.refill_ms += msSince(start);
+  }
+
+  void decodeRefillChunk() {
+    if (llama_decode(currentContext, batch) != 0) {
+      LOG_TEE("%s: llama_decode() failed\n", __func__);
+      throw std::runtime_error("llama_decode() failed");
+    }
+    llama_batch_clear(batch);
+  }
+
+  // Makes adapter (NULL = the base model) the one merged into the weights.
+  // Cells decoded under other weights no longer match, so a switch drops
+  // the prefix cache; sessions bind their own adapter before decoding.
+  void bindAdapter(llama_adapter* adapter) {
+    if (adapter == boundAdapter) {
+      return;
+    }
+    if (adapter != NULL && adapter->owner != this) {
+      throw std::runtime_error("LoRA adapter belongs to another instance.");
+    }
+    prefixCache.clear();
+    if (boundAdapter != NULL) {
+      llama_adapter* previous = boundAdapter;
+      boundAdapter = NULL;
+      mergeAdapter(*previous, false);
+    }
+    if (adapter != NULL) {
+      mergeAdapter(*adapter, true);
+      boundAdapter = adapter;
+    }
+  }
+
+  void mergeAdapter(llama_adapter& adapter, bool merge) {
+    auto start = std::chrono::steady_clock::now();
+    const char* base = adapter.basePath.empty() ? NULL : adapter.basePath.c_str();
+    // with base tensors the result is base + scale * BA, so scale 0 restores them
+    float scale = merge ? adapter.scale : (base != NULL ? 0.0f : -adapter.scale);
+    int threads = loadOptions.threads > 0 ? loadOptions.threads : 1;
+    if (llama_model_apply_lora_from_file(model, adapter.path.c_str(), scale, base, threads) != 0) {
+      throw std::runtime_error("Unable to apply LoRA adapter.");
+    }
+    adapter.stats.last_apply_ms = msSince(start);
+    adapter.stats.apply_ms += adapter.stats.last_apply_ms;
+    adapter.stats.applies++;
+  }
+
+  void beginRequest(std::chrono::steady_clock::time_point start, const llama_generate_params& params) {
+    requestStart = start;
+    cancelToken = params.cancel;
+    deadlineMs = params.deadline_ms;
+    ttftDeadlineMs = params.ttft_deadline_ms;
+    firstTokenMs = -1.0;
+    stopReason = LLAMA_STOP_ERROR;
+    activeSeq = 0;
+    retainedCells = 0;
+    emittedTokens = NULL;
+    batchResults = NULL;
+    setRunningWork(0, 0);
+
+    samplingTemp = params.temperature;
+    samplingTopK = params.top_k;
+    samplingTopP = params.top_p > 0 ? params.top_p : 1.0f;
+    samplingSeed = params.seed != 0 ? params.seed : (unsigned int) randSeed;
+    requestRng.seed(samplingSeed);
+
+    beamWidth = params.beam_width;
+    beamLengthPenalty = params.length_penalty;
+
+    penaltyRepeat = params.repeat_penalty > 0 ? params.repeat_penalty : 1.0f;
+    penaltyFrequency = params.frequency_penalty;
+    penaltyPresence = params.presence_penalty;
+    penaltyLastN = params.repeat_last_n < 0 ? contextTokenLen : params.repeat_last_n;
+    if (penaltyRepeat == 1.0f && penaltyFrequency == 0.0f && penaltyPresence == 0.0f) {
+      penaltyLastN = 0;
+    }
+
+    pipelineRequested = params.pipelined;
+
+    tokenMasks.clear();
+    for (int i = 0; i < params.n_masks; i++) {
+      const llama_token_mask* mask = params.masks[i];
+      if (mask == NULL) continue;
+      if (mask->nVocab != llama_n_vocab(model)) {
+        throw std::runtime_error("Token mask was built for a different vocabulary.");
+      }
+      tokenMasks.push_back(mask);
+    }
+
+    grammar.reset();
+    grammarMs = 0;
+    if (params.grammar != NULL && params.grammar[0] != '\0') {
+      grammar.reset(new GrammarMatcher(params.grammar));
+      if (tokenTrie.nodes.empty()) {
+        tokenTrie.build(currentContext, llama_n_vocab(model));
+      }
+    }
+
+    stopMatcher.reset(params.stop_sequences, params.n_stop_sequences);
+    streamFn = params.stream;
+    streamUserData = params.stream_user_data;
+    logprobsOut = params.logprobs;
+    logprobsCapacity = params.logprobs != NULL ? std::max(0, params.logprobs_capacity) : 0;
+    topLogprobs = std::min(std::max(0, params.top_logprobs), LLAMA_MAX_TOP_LOGPROBS);
+    nLogprobs = 0;
+    utf8.pending.clear();
+  }
+
+  int finishRequest(int tokensProcessed, int promptTokenCount, llama_generate_result& result) {
+    result.stop_reason = stopReason;
+    result.generated_tokens = std::max(0, tokensProcessed - promptTokenCount);
+    result.ttft_ms = firstTokenMs;
+    result.total_ms = msSince(requestStart);
+    result.grammar_ms = grammarMs;
+    result.n_logprobs = nLogprobs;
+    cancelToken = NULL;
+    logprobsOut = NULL;
+    grammar.reset();
+    setRunningWork(0, 0);
+    return tokensProcessed;
+  }
+
+  // Rejects a request whose deadline would already have passed by the time
+  // the call holding the context finishes its prefill and decode, and the
+  // prompts queued ahead of it and its own prompt are prefilled.
+  bool admit(int promptTokens, const llama_generate_params& params) {
+    double budget = params.deadline_ms;
+    if (params.ttft_deadline_ms > 0 && (budget <= 0 || params.ttft_deadline_ms < budget)) {
+      budget = params.ttft_deadline_ms;
+    }
+    double msPerToken = prefillMsPerToken.load();
+    if (budget <= 0 || msPerToken <= 0) {
+      return true;
+    }
+    double ahead = (queuedPromptTokens.load() + promptTokens) * msPerToken;
+    if (contextGate.busy()) {
+      ahead += runningPrefillTokens.load() * msPerToken + runningDecodeSteps.load() * decodeMsPerStep.load();
+    }
+    return ahead <= budget;
+  }
+
+  // Work left in the call holding the context, for admit.
+  void setRunningWork(int prefillTokens, int decodeSteps) {
+    runningPrefillTokens = prefillTokens;
+    runningDecodeSteps = decodeSteps;
+  }
+
+  void recordDecodeStep(double elapsedMs) {
+    double previous = decodeMsPerStep.load();
+    decodeMsPerStep.store(previous <= 0 ? elapsedMs : 0.8 * previous + 0.2 * elapsedMs);
+  }
+
+  void recordPrefill(int tokens, double elapsedMs) {
+    // tiny prompts are dominated by fixed overhead and would skew the rate
+    if (tokens < 8) {
+      return;
+    }
+    double sample = elapsedMs / tokens;
+    double previous = prefillMsPerToken.load();
+    prefillMsPerToken.store(previous <= 0 ? sample : 0.8 * previous + 0.2 * sample);
+  }
+
+  // A batch's outstanding work: the prompts not yet admitted, and as many
+  // steps as its longest remaining generation.
+  void noteBatchWork(const std::vector<BatchSequence>& sequences, size_t nextQueued,
+      const std::vector<BatchSequence*>& live) {
+    int prefillTokens = 0;
+    int steps = 0;
+    for (size_t i = nextQueued; i < sequences.size(); i++) {
+      prefillTokens += sequences[i].promptTokens.size();
+      steps = std::max(steps, sequences[i].maxNewTokens);
+    }
+    for (auto* seq : live) {
+      steps = std::max(steps, seq->maxNewTokens - seq->generated);
+    }
+    setRunningWork(prefillTokens, steps);
+  }
+
+  // Prefills several prompts in as few llama_decode calls as possible. Only
+  // each prompt's last position requests logits; because later chunks
+  // overwrite the logits buffer, a prompt's first token is sampled right
+  // after the chunk that holds its last position.
+  void prefillPacked(const std::vector<BatchSequence*>& sequences) {
+    std::vector<std::pair<BatchSequence*, int>> sampleAt;
+    llama_batch_clear(batch);
+
+    for (auto* seq : sequences) {
+      int n = seq->promptTokens.size();
+      for (int p = seq->nPast; p < n; p++) {
+        if (batch.n_tokens == batchSize) {
+          decodePackedChunk(sampleAt);
+        }
+        bool last = (p == n - 1);
+        if (last) {
+          sampleAt.push_back(std::make_pair(seq, (int) batch.n_tokens));
+        }
+        llama_batch_add(batch, seq->promptTokens[p], p, { seq->seqId }, last);
+      }
+      seq->nPast = n;
+    }
+    if (batch.n_tokens > 0) {
+      decodePackedChunk(sampleAt);
+    }
+  }
+
+  void decodePackedChunk(std::vector<std::pair<BatchSequence*, int>>& sampleAt) {
+    if (llama_decode(currentContext, batch) != 0) {
+      LOG_TEE("%s: llama_decode() failed\n", __func__);
+      throw std::runtime_error("llama_decode() failed");
+    }
+    for (auto& entry : sampleAt) {
+      BatchSequence* seq = entry.first;
+      seq->nextToken = sampleFromLogits(entry.second, seq->rng, &seq->penalties, &seq->nextLogprob);
+      seq->penalties.push(seq->nextToken);
+      seq->logprob += seq->nextLogprob;
+    }
+    sampleAt.clear();
+    llama_batch_clear(batch);
+  }
+
+  void initSequence(BatchSequence& seq, int index, const std::vector<llama_token>& promptTokens,
+      int maxNewTokens, const llama_generate_params& params) {
+    seq.index = index;
+    seq.seqId = -1;
+    seq.promptTokens = promptTokens;
+    seq.maxNewTokens = maxNewTokens;
+    seq.cachedTokens = 0;
+    seq.prefixNode = -1;
+    seq.stream = NULL;
+    seq.streamUserData = NULL;
+    seq.utf8.pending.clear();
+    seq.nPast = 0;
+    seq.decoded.clear();
+    seq.generated = 0;
+    seq.nextToken = 0;
+    seq.nextLogprob = 0;
+    seq.logprob = 0;
+    seq.rng.seed(samplingSeed + index);
+    seq.stopMatcher.reset(params.stop_sequences, params.n_stop_sequences);
+    seedPenalties(seq.penalties, promptTokens.data(), promptTokens.size());
+    seq.stopReason = LLAMA_STOP_ERROR;
+    seq.prefillMs = 0;
+    seq.firstTokenMs = -1.0;
+    seq.totalMs = 0;
+  }
+
+  // Emits each live sequence's pending token, moves the sequences that are
+  // done into finished, and decodes one token for every remaining sequence
+  // in a single llama_decode.
+  void stepSequences(std::vector<BatchSequence*>& live, std::vector<BatchSequence*>& finished,
+      std::chrono::steady_clock::time_point callStart) {
+    llama_token endOfSequence = llama_token_eos(model);
+
+    llama_batch_clear(batch);
+    std::vector<BatchSequence*> stepping;
+    for (auto* seq : live) {
+      bool done = false;
+      if (seq->nextToken == endOfSequence) {
+        finishSequence(*seq, LLAMA_STOP_EOS, callStart);
+        done = true;
+      } else {
+        if (seq->firstTokenMs < 0) {
+          seq->firstTokenMs = msSince(callStart);
+          firstTokenMs = seq->firstTokenMs;
+        }
+        std::string ready;
+        bool hitStop = seq->stopMatcher.feed(llama_token_to_piece(currentContext, seq->nextToken), ready);
+        seq->text += ready;
+        seq->generated++;
+        bool keepGoing = streamSequence(*seq, ready);
+        if (hitStop) {
+          finishSequence(*seq, LLAMA_STOP_SEQUENCE, callStart);
+          done = true;
+        } else if (!keepGoing) {
+          finishSequence(*seq, LLAMA_STOP_CALLBACK, callStart);
+          done = true;
+        } else if (seq->generated >= seq->maxNewTokens) {
+          finishSequence(*seq, LLAMA_STOP_LENGTH, callStart);
+          done = true;
+        }
+      }
+
+      if (done) {
+        finished.push_back(seq);
+      } else {
+        llama_batch_add(batch, seq->nextToken, seq->nPast++, { seq->seqId }, true);
+        seq->decoded.push_back(seq->nextToken);
+        stepping.push_back(seq);
+      }
+    }
+    live.swap(stepping);
+
+    if (live.empty()) {
+      return;
+    }
+
+    auto stepStart = std::chrono::steady_clock::now();
+    decodeToNextTokenScores();
+    recordDecodeStep(msSince(stepStart));
+    for (int i = 0; i < (int) live.size(); i++) {
+      live[i]->nextToken = sampleFromLogits(i, live[i]->rng, &live[i]->penalties, &live[i]->nextLogprob);
+      live[i]->penalties.push(live[i]->nextToken);
+      live[i]->logprob += live[i]->nextLogprob;
+    }
+  }
+
+  // Beam search with all live beams decoded in one multi-sequence batch.
+  // Each beam owns a KV sequence id. When a beam is pruned its sequence is
+  // removed; when a beam has several surviving children, the extra children
+  // get a copy of its cells via llama_kv_cache_seq_cp (shared cells, no
+  // recompute). The best hypothesis is emitted through the token callback
+  // once the search ends.
+  int beamSearch(int promptTokenCount, int maxNewTokens) {
+    const int width = beamWidth;
+    const int nVocab = llama_n_vocab(model);
+    const llama_token endOfSequence = llama_token_eos(model);
+
+    if (width > batchSize || promptTokenCount + width * maxNewTokens > contextTokenLen) {
+      throw std::runtime_error("error: beam search does not fit in the context.");
+    }
+
+    std::vector<BeamHypothesis> beams(1);
+    beams[0].seqId = 0;
+    beams[0].logprob = 0;
+    beams[0].batchIndex = batch.n_tokens - 1;
+    beams[0].ended = false;
+    beams[0].penalties = penalties;
+
+    useRequestSeqs(width);
+    std::vector<llama_seq_id> freeSeqIds;
+    for (llama_seq_id id = width - 1; id > 0; id--) {
+      freeSeqIds.push_back(id);
+    }
+
+    std::vector<BeamHypothesis> finished;
+    std::vector<float> logProbs(nVocab);
+    std::vector<llama_token> order(nVocab);
+
+    for (int step = 0; step < maxNewTokens && !beams.empty() && (int) finished.size() < width; step++) {
+      if (interrupted()) {
+        clearRequestCells();
+        return promptTokenCount;
+      }
+
+      // width + 1 candidates per beam so an EOS never leaves us short
+      std::vector<BeamCandidate> candidates;
+      for (int b = 0; b < (int) beams.size(); b++) {
+        logSoftmax(requestLogits(beams[b].batchIndex, &beams[b].penalties), nVocab, logProbs.data());
+        for (llama_token id = 0; id < nVocab; id++) order[id] = id;
+        int take = std::min(width + 1, nVocab);
+        std::partial_sort(order.begin(), order.begin() + take, order.end(),
+            [&logProbs](llama_token x, llama_token y) { return logProbs[x] > logProbs[y]; });
+        for (int k = 0; k < take; k++) {
+          candidates.push_back(BeamCandidate{ b, order[k], beams[b].logprob + logProbs[order[k]] });
+        }
+      }
+      std::sort(candidates.begin(), candidates.end(),
+          [](const BeamCandidate& x, const BeamCandidate& y) { return x.score > y.score; });
+
+      std::vector<BeamHypothesis> next;
+      std::vector<int> children(beams.size(), 0);
+      for (int rank = 0; rank < (int) candidates.size() && (int) next.size() < width; rank++) {
+        const BeamCandidate& c = candidates[rank];
+        if (c.token == endOfSequence) {
+          if (rank < width) {
+            BeamHypothesis done = beams[c.parent];
+            done.logprob = c.score;
+            done.ended = true;
+            finished.push_back(done);
+          }
+          continue;
+        }
+        BeamHypothesis extended;
+        extended.seqId = -1;
+        extended.tokens = beams[c.parent].tokens;
+        extended.tokens.push_back(c.token);
+        extended.penalties = beams[c.parent].penalties;
+        extended.penalties.push(c.token);
+        extended.logprob = c.score;
+        extended.ended = false;
+        extended.batchIndex = c.parent;   // parent index until ids are assigned
+        children[c.parent]++;
+        next.push_back(extended);
+      }
+
+      // drop pruned beams first so their ids can be reused by the forks
+      for (int b = 0; b < (int) beams.size(); b++) {
+        if (children[b] == 0) {
+          llama_kv_cache_seq_rm(currentContext, beams[b].seqId, -1, -1);
+          freeSeqIds.push_back(beams[b].seqId);
+        }
+      }
+
+      std::vector<bool> parentSeqTaken(beams.size(), false);
+      for (auto& beam : next) {
+        const BeamHypothesis& parent = beams[beam.batchIndex];
+        if (!parentSeqTaken[beam.batchIndex]) {
+          beam.seqId = parent.seqId;
+          parentSeqTaken[beam.batchIndex] = true;
+        } else {
+          beam.seqId = freeSeqIds.back();
+          freeSeqIds.pop_back();
+          llama_kv_cache_seq_rm(currentContext, beam.seqId, -1, -1);
+          llama_kv_cache_seq_cp(currentContext, parent.seqId, beam.seqId, -1, -1);
+        }
+      }
+
+      beams.swap(next);
+      if (beams.empty() || (int) finished.size() >= width || step + 1 == maxNewTokens) {
+        break;
+      }
+
+      llama_batch_clear(batch);
+      for (int b = 0; b < (int) beams.size(); b++) {
+        beams[b].batchIndex = b;
+        llama_batch_add(batch, beams[b].tokens.back(), promptTokenCount + beams[b].tokens.size() - 1,
+            { beams[b].seqId }, true);
+      }
+      decodeToNextTokenScores();
+    }
+
+    for (auto& beam : beams) {
+      finished.push_back(beam);
+    }
+    clearRequestCells();
+
+    if (finished.empty()) {
+      stopReason = LLAMA_STOP_LENGTH;
+      return promptTokenCount;
+    }
+
+    // length-normalised score: logprob / len^penalty
+    const BeamHypothesis* best = &finished[0];
+    double bestScore = -INFINITY;
+    for (const auto& hyp : finished) {
+      double len = std::max<size_t>(1, hyp.tokens.size() + (hyp.ended ? 1 : 0));
+      double score = hyp.logprob / pow(len, beamLengthPenalty);
+      if (score > bestScore) {
+        bestScore = score;
+        best = &hyp;
+      }
+    }
+
+    stopReason = best->ended ? LLAMA_STOP_EOS : LLAMA_STOP_LENGTH;
+    int emitted = 0;
+    for (llama_token token : best->tokens) {
+      emitted++;
+      if (!outputSingleTokenAsString(token)) {
+        if (stopReason != LLAMA_STOP_SEQUENCE) {
+          stopReason = LLAMA_STOP_CALLBACK;
+        }
+        return promptTokenCount + emitted;
+      }
+    }
+    flushPendingText();
+    return promptTokenCount + emitted;
+  }
+
+  // Logits row at batchIndex with the sequence's penalties and the request's
+  // token masks applied in place. Call once per row: both are cumulative.
+  float* requestLogits(int batchIndex, const PenaltyWindow* window) {
+    float* logits = llama_get_logits_ith(currentContext, batchIndex);
+    if (window != NULL) {
+      window->apply(logits, penaltyRepeat, penaltyFrequency, penaltyPresence);
+    }
+    for (const llama_token_mask* mask : tokenMasks) {
+      mask->apply(logits);
+    }
+    return logits;
+  }
+
+  // Picks the next token from the logits at batchIndex; temperature <= 0 is
+  // greedy. The sampler keeps no state besides rng and the penalty window,
+  // so each sequence gets independent draws. logprob receives the token's
+  // log-probability under the penalized, masked distribution.
+  llama_token sampleFromLogits(int batchIndex, std::mt19937& rng, const PenaltyWindow* window,
+      double* logprob, bool applyMasks = true) {
+    const float* logits = applyMasks ? requestLogits(batchIndex, window) : llama_get_logits_ith(currentContext, batchIndex);
+    const int nVocab = llama_n_vocab(model);
+
+    llama_token best = 0;
+    for (llama_token id = 1; id < nVocab; id++) {
+      if (logits[id] > logits[best]) best = id;
+    }
+
+    llama_token chosen = best;
+    if (samplingTemp > 0) {
+      std::vector<llama_token_data> candidates;
+      candidates.reserve(nVocab);
+      for (llama_token id = 0; id < nVocab; id++) {
+        candidates.push_back(llama_token_data{ id, logits[id] / samplingTemp, 0.0f });
+      }
+
+      auto byLogit = [](const llama_token_data& a, const llama_token_data& b) { return a.logit > b.logit; };
+      size_t keep = candidates.size();
+      if (samplingTopK > 0 && samplingTopK < nVocab) {
+        keep = samplingTopK;
+      }
+      std::partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end(), byLogit);
+      candidates.resize(keep);
+
+      double sum = 0;
+      for (auto& c : candidates) {
+        c.p = expf(c.logit - candidates[0].logit);
+        sum += c.p;
+      }
+
+      double cumulative = 0;
+      size_t cut = candidates.size();
+      for (size_t i = 0; i < candidates.size(); i++) {
+        candidates[i].p /= sum;
+        cumulative += candidates[i].p;
+        if (samplingTopP < 1.0f && cumulative >= samplingTopP) {
+          cut = i + 1;
+          break;
+        }
+      }
+
+      double draw = std::uniform_real_distribution<double>(0.0, cumulative)(rng);
+      chosen = candidates[cut - 1].id;
+      for (size_t i = 0; i < cut; i++) {
+        draw -= candidates[i].p;
+        if (draw <= 0) {
+          chosen = candidates[i].id;
+          break;
+        }
+      }
+    }
+
+    if (logprob != NULL) {
+      *logprob = logits[chosen] - logSumExp(logits, nVocab, logits[best]);
+    }
+    return chosen;
+  }
+
+  // Decodes the pending scoring batch and turns each row into the
+  // log-probability of the token it predicts.
+  bool decodeScoringChunk(const llama_token* tokens, std::vector<int>& predicts, float* tokenLogprobs) {
+    if (interrupted()) {
+      return false;
+    }
+    decodeToNextTokenScores();
+    const int nVocab = llama_n_vocab(model);
+    for (int row = 0; row < (int) predicts.size(); row++) {
+      const float* logits = llama_get_logits_ith(currentContext, row);
+      tokenLogprobs[predicts[row]] = logits[tokens[predicts[row]]] - logSumExp(logits, nVocab, maxLogit(logits, nVocab));
+    }
+    predicts.clear();
+    llama_batch_clear(batch);
+    return true;
+  }
+
+  // Frees the cells of decoded packed sequences, keeping the shared prefix
+  // on sequence 0.
+  void releasePackedSeqs(std::vector<llama_seq_id>& resident) {
+    for (llama_seq_id seq : resident) {
+      llama_kv_cache_seq_rm(currentContext, seq, -1, -1);
+    }
+    resident.clear();
+  }
+
+  // The log-softmax normalizer cancels in log p(yes) - log p(no), so the
+  // logit difference is the score.
+  bool decodeRerankChunk(std::vector<std::pair<int, int>>& rows, llama_token yes, llama_token no, float* scores) {
+    if (interrupted()) {
+      return false;
+    }
+    decodeToNextTokenScores();
+    for (const auto& row : rows) {
+      const float* logits = llama_get_logits_ith(currentContext, row.first);
+      scores[row.second] = logits[yes] - logits[no];
+    }
+    rows.clear();
+    llama_batch_clear(batch);
+    return true;
+  }
+
+  // Appends the chosen token's log-probability and the top-k alternatives to
+  // the caller's array. The row already holds the penalized, masked logits
+  // the token was sampled from.
+  void recordLogprobs(int batchIndex, llama_token token) {
+    if (nLogprobs >= logprobsCapacity) {
+      return;
+    }
+    const float* logits = llama_get_logits_ith(currentContext, batchIndex);
+    const int nVocab = llama_n_vocab(model);
+    const float logZ = logSumExp(logits, nVocab, maxLogit(logits, nVocab));
+
+    llama_token_logprobs& entry = logprobsOut[nLogprobs++];
+    entry.token = token;
+    entry.logprob = logits[token] - logZ;
+    entry.n_top = topK(logits, nVocab, topLogprobs, entry.top_tokens);
+    for (int i = 0; i < entry.n_top; i++) {
+      entry.top_logprobs[i] = logits[entry.top_tokens[i]] - logZ;
+    }
+  }
+
+  // Starts a window for this request's penalty settings, holding the tail
+  // of the prompt.
+  void seedPenalties(PenaltyWindow& window, const llama_token* promptTokens, int nPromptTokens) {
+    window.reset(penaltyLastN);
+    int first = std::max(0, nPromptTokens - penaltyLastN);
+    for (int i = first; i < nPromptTokens; i++) {
+      window.push(promptTokens[i]);
+    }
+  }
+
+  // Fills the sequence's result as soon as it ends, then tells its stream
+  // with a zero-length call, so a caller can answer it while the others run.
+  void finishSequence(BatchSequence& seq, llama_stop_reason reason, std::chrono::steady_clock::time_point callStart) {
+    std::string tail = seq.stopMatcher.flush();
+    seq.text += tail;
+    seq.stopReason = reason;
+    seq.totalMs = msSince(callStart);
+    streamSequence(seq, tail, true);
+    if (batchResults != NULL) {
+      fillBatchResult(seq, batchResults[seq.index]);
+    }
+    if (seq.stream != NULL) {
+      seq.stream(seq.text.data(), 0, seq.streamUserData);
+    }
+  }
+
+  // Hands a sequence's newly ready text to its stream in whole code points;
+  // false if the stream asked to stop.
+  bool streamSequence(BatchSequence& seq, const std::string& text, bool flush = false) {
+    if (seq.stream == NULL) {
+      return true;
+    }
+    seq.utf8.pending += text;
+    size_t n = flush ? seq.utf8.pending.size() : seq.utf8.completeLength();
+    if (n == 0) {
+      return true;
+    }
+    bool keepGoing = seq.stream(seq.utf8.pending.data(), n, seq.streamUserData);
+    seq.utf8.pending.erase(0, n);
+    return keepGoing;
+  }
+
+  void fillBatchResult(const BatchSequence& seq, llama_batch_result& result) {
+    result.text = (char*) malloc(seq.text.size() + 1);
+    if (result.text != NULL) {
+      memcpy(result.text, seq.text.data(), seq.text.size());
+      result.text[seq.text.size()] = '\0';
+    }
+    result.text_len = seq.text.size();
+    result.stop_reason = seq.stopReason;
+    result.prompt_tokens = seq.promptTokens.size();
+    result.cached_tokens = seq.cachedTokens;
+    result.generated_tokens = seq.generated;
+    result.prefill_ms = seq.prefillMs;
+    result.ttft_ms = seq.firstTokenMs;
+    result.total_ms = seq.totalMs;
+    result.logprob = seq.logprob;
+  }
+
+  inline bool isCancelled() const {
+    return cancelToken != NULL && cancelToken->cancelled.load(std::memory_order_relaxed);
+  }
+
+  // Returns true and records the stop reason once the request has been
+  // cancelled or has run past one of its deadlines.
+  bool interrupted() {
+    if (isCancelled()) {
+      stopReason = LLAMA_STOP_CANCELLED;
+      return true;
+    }
+    double elapsed = msSince(requestStart);
+    if ((deadlineMs > 0 && elapsed > deadlineMs) ||
+        (firstTokenMs < 0 && ttftDeadlineMs > 0 && elapsed > ttftDeadlineMs)) {
+      stopReason = LLAMA_STOP_DEADLINE;
+      return true;
+    }
+    return false;
+  }
+
+  // Frees the sequence's KV cells right away so an interrupted request does
+  // not hold cache space until the next request clears it. A session keeps
+  // the cells it had before the call.
+  int releaseInterrupted(int tokensProcessed) {
+    fprintf(stderr, "%s: generation stopped after %d tokens\n", __func__, tokensProcessed);
+    llama_kv_cache_seq_rm(currentContext, activeSeq, retainedCells, -1);
+    llama_batch_clear(batch);
+    return tokensProcessed;
+  }
+
+  void reportProgress(float progress) {
+    if (loadOptions.progress_callback != NULL) {
+      loadOptions.progress_callback(progress, loadOptions.progress_user_data);
+    }
+  }
+
+  // llama.cpp reports its own 0..1 progress; fold it into the overall range
+  // so callers see one monotonic value across all startup phases.
+  static bool onLoadProgress(float progress, void* userData) {
+    LlamaCppSimple* self = (LlamaCppSimple*) userData;
+    float begin = self->loadOptions.prefetch ? 0.2f : 0.0f;
+    self->reportProgress(begin + (0.9f - begin) * progress);
+    return !self->abandonLoad;
+  }
+
+  void loadModel(int gpuLayers, int threads) {
+    gptParams.model = modelPath;
+    gptParams.n_threads = threads;
+    modelParams = llama_model_default_params();
+
+    modelParams.n_gpu_layers = gpuLayers;
+    modelParams.use_mlock = loadOptions.mlock;
+    // merging an adapter writes to the weights, which mmap maps read-only
+    modelParams.use_mmap = !loadOptions.lora;
+    modelParams.progress_callback = onLoadProgress;
+    modelParams.progress_callback_user_data = this;
+
+    model = llama_load_model_from_file(gptParams.model.c_str(), modelParams);
+
+    if (model == NULL) {
+        fprintf(stderr , "%s: error: unable to load model\n" , __func__);
+        throw std::runtime_error("Unable to load model.");
+    }
+    tokenizer.model = model;
+    tokenizer.threads = std::max(1, threads);
+  }
+
+  // The context is created once and reused; between requests the KV cache is
+  // cleared instead, which keeps the graph allocations warm.
+  void initContext() {
+    if (currentContext != 0) {
+      clearRequestCells();
+      llama_set_rng_seed(currentContext, randSeed);
+      return;
+    }
+
+    fprintf(stderr, "initializing context..\n");
+    
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.seed  = randSeed;
+    ctx_params.n_ctx = contextTokenLen;
+    ctx_params.n_batch = batchSize;
+    ctx_params.n_threads = gptParams.n_threads;
+    ctx_params.n_threads_batch = gptParams.n_threads_batch == -1 ? gptParams.n_threads : gptParams.n_threads_batch;
+    ctx_params.type_k = kvGgmlType(loadOptions.kv_type);
+    ctx_params.type_v = GGML_TYPE_F16;
+
+    currentContext = llama_new_context_with_model(model, ctx_params);
+
+    if (currentContext == NULL) {
+        fprintf(stderr , "%s: error: failed to create the llama_context\n" , __func__);
+        throw std::runtime_error("Failed to create the llama_context");
+    }
+    prefixCache.ctx = currentContext;
+  }
+
+  // With no kept sequence (session or cached prefix) a full clear is
+  // cheapest; otherwise only the sequence ids stateless requests used go.
+  void clearRequestCells() {
+    prefixCache.releaseAll();
+    if (keptSeqs == 0) {
+      llama_kv_cache_clear(currentContext);
+    } else {
+      for (llama_seq_id id = 0; id < requestSeqs; id++) {
+        llama_kv_cache_seq_rm(currentContext, id, -1, -1);
+      }
+    }
+    requestSeqs = 1;
+  }
+
+  // Prefills tokens on activeSeq starting from the longest cached prefix,
+  // then caches the prompt. Room is made for reserve more cells, and it
+  // throws if there is none. Returns the position after the prompt, or -1
+  // if the request was interrupted.
+  int prefillCached(const llama_token* tokens, int n, int reserve, int& cached) {
+    cached = 0;
+    int node = 0;
+    if (loadOptions.prefix_cache) {
+      // the last token is always decoded so its logits are this request's
+      cached = prefixCache.attach(activeSeq, tokens, n, n - 1, node);
+      prefixCache.acquire(node);
+    }
+    if (!makeRoom(n - cached + reserve)) {
+      prefixCache.release(node);
+      throw std::runtime_error("KV cache full: sessions and cached prefixes in use hold the cells this request needs.");
+    }
+    int end = processPrompt(tokens + cached, n - cached, cached);
+    if (end >= 0 && loadOptions.prefix_cache) {
+      prefixCache.acquire(prefixCache.insert(activeSeq, tokens, n));
+    }
+    return end;
+  }
+
+  // Evicts cached prefixes until cells are free; false if they cannot be.
+  bool makeRoom(int cells) {
+    while (contextTokenLen - llama_get_kv_cache_used_cells(currentContext) < cells) {
+      if (!prefixCache.evictOne()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static bool sharesPendingPrefill(const std::vector<BatchSequence*>& admitted,
+      const std::vector<llama_token>& prompt, int cached) {
+    for (auto* other : admitted) {
+      const std::vector<llama_token>& p = other->promptTokens;
+      int n = std::min(p.size(), prompt.size());
+      int common = 0;
+      while (common < n && p[common] == prompt[common]) common++;
+      if (common - cached >= prefixDeferTokens) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void useRequestSeqs(int n) {
+    requestSeqs = std::max(requestSeqs, n);
+  }
+
+  llama_seq_id acquireKeptSeq() {
+    keptSeqs++;
+    if (!freeKeptSeqs.empty()) {
+      llama_seq_id id = freeKeptSeqs.back();
+      freeKeptSeqs.pop_back();
+      return id;
+    }
+    return nextKeptSeq++;
+  }
+
+  void releaseKeptSeq(llama_seq_id id) {
+    keptSeqs--;
+    freeKeptSeqs.push_back(id);
+  }
+
+  // Decodes a full batch and a single token once so both graph shapes are
+  // allocated and the weights are resident before the first real request.
+  void warmUp() {
+    llama_token bos = llama_token_bos(model);
+    int warmupTokens = std::min(batchSize, contextTokenLen);
+
+    llama_batch_clear(batch);
+    for (int i = 0; i < warmupTokens; i++) {
+      llama_batch_add(batch, bos, i, { 0 }, i == warmupTokens - 1);
+    }
+    auto start = std::chrono::steady_clock::now();
+    if (llama_decode(currentContext, batch) != 0) {
+      fprintf(stderr, "%s: warning: warm-up decode failed\n", __func__);
+    } else {
+      // seeds the prefill rate used for deadline admission
+      recordPrefill(warmupTokens, msSince(start));
+    }
+
+    llama_batch_clear(batch);
+    llama_batch_add(batch, bos, 0, { 0 }, true);
+    llama_kv_cache_clear(currentContext);
+    if (llama_decode(currentContext, batch) != 0) {
+      fprintf(stderr, "%s: warning: warm-up decode failed\n", __func__);
+    }
+
+    llama_kv_cache_clear(currentContext);
+    llama_reset_timings(currentContext);
+  }
+
+  inline void tokenize(const std::string& inputString, int totalTokens, std::vector<llama_token>& tokens_list, bool is_start) {
+    tokens_list = tokenizer.tokenize(inputString.c_str(), inputString.size(), is_start, true);
+    llama_token endOfSequence = llama_token_eos(model);
+    
+    //fprintf(stderr, "EOS is %d\ntokenize result:\n", endOfSequence);
+    for (int i = 0; i < tokens_list.size(); i++) {
+      const char* str = llama_token_to_piece(currentContext, tokens_list[i]).c_str();
+      //fprintf(stderr, " {%s}[%d] ", str, tokens_list[i]);
+
+      if (tokens_list[i] == endOfSequence) {
+        fprintf(stderr, " *Found EOS* ");
+      }
+    }
+    //fprintf(stderr, "\n");
+
+    const int n_ctx    = llama_n_ctx(currentContext);
+    const int n_kv_req = tokens_list.size() + (totalTokens - tokens_list.size());
+
+    // make sure the KV cache is big enough to hold all the prompt and generated tokens
+    if (n_kv_req > n_ctx) {
+        throw std::runtime_error("Error: input overran context length.");
+    }
+  }
+
+  // Passes text through the UTF-8 assembler and on to the stream callback,
+  // or to tokenCallback when the request has none. With flush the held-back
+  // tail goes out too.
+  inline bool deliverText(const std::string& text, bool flush = false) {
+    utf8.pending += text;
+    size_t n = flush ? utf8.pending.size() : utf8.completeLength();
+    if (n == 0) {
+      return true;
+    }
+    bool keepGoing;
+    if (streamFn != NULL) {
+      keepGoing = streamFn(utf8.pending.data(), n, streamUserData);
+    } else {
+      std::string chunk(utf8.pending, 0, n);
+      keepGoing = tokenCallback((void*)10000, (char*)chunk.c_str());
+    }
+    utf8.pending.erase(0, n);
+    return keepGoing;
+  }
+
+  // The token's bytes, written into a reused buffer.
+  inline const std::string& pieceOf(llama_token token) {
+    int n = llama_token_to_piece(model, token, &pieceBuffer[0], pieceBuffer.size());
+    if (n < 0) {
+      pieceBuffer.resize(-n);
+      n = llama_token_to_piece(model, token, &pieceBuffer[0], pieceBuffer.size());
+    }
+    piece.assign(pieceBuffer.data(), std::max(0, n));
+    return piece;
+  }
+
+  inline bool outputSingleTokenAsString(llama_token& token) {
+    if (firstTokenMs < 0) {
+      firstTokenMs = msSince(requestStart);
+    }
+
+    bool hitStop = false;
+    bool keepGoing = deliverToken(token, hitStop);
+    if (hitStop) {
+      stopReason = LLAMA_STOP_SEQUENCE;
+    }
+    return keepGoing;
+  }
+
+  // Detokenizes and sends on a token's text, holding back what may start a
+  // stop sequence. Only touches the delivery state (stop matcher, UTF-8
+  // assembler, piece buffers), so it can run on the delivery thread.
+  inline bool deliverToken(llama_token token, bool& hitStop) {
+    if (stopMatcher.feed(pieceOf(token), readyText)) {
+      hitStop = true;
+      deliverText(readyText, true);
+      return false;
+    }
+    return readyText.empty() || deliverText(readyText);
+  }
+
+  inline void flushPendingText() {
+    deliverText(stopMatcher.flush(), true);
+  }
+
+  inline bool outputTokensAsString(const std::vector<llama_token>& tokens) {
+    for (auto id : tokens) {
+      const char* str = llama_token_to_piece(currentContext, id).c_str();
+      if (!tokenCallback((void*)10000, (char*)str)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Decodes tokens at positions startPos.. on sequence 0; only the last one
+  // requests logits. A non-zero startPos appends to what the cache already
+  // holds. Returns the position after the last token, or -1 if interrupted.
+  inline int processPrompt(const llama_token* promptTokens, int nPromptTokens, int startPos = 0) {
+    // TODO: verify that we don't overrun context length 
+
+    int processedTokens = 0;
+
+    while (processedTokens < nPromptTokens ) {
+      // each chunk is one llama_decode, so this bounds how long a cancelled
+      // or expired request keeps computing to a single batch
+      if (interrupted()) {
+        return -1;
+      }
+
+      int start = processedTokens;
+      
+      llama_batch_clear(batch);
+
+      while (processedTokens < start + batchSize && 
+          processedTokens < nPromptTokens ) { 
+          llama_batch_add(batch, promptTokens[processedTokens], startPos + processedTokens, { activeSeq }, false);
+          //llama_batch_add(batch, promptTokens[processedTokens], currentTokenIndex, { 0 }, false); 
+          processedTokens++;
+          //currentTokenIndex++;
+      }
+      if (processedTokens == nPromptTokens) {
+        // llama_decode will output logits only for the last token of the prompt
+        batch.logits[batch.n_tokens - 1] = true;
+      }
+      if (llama_decode(currentContext, batch) != 0) {
+          LOG_TEE("%s: llama_decode() failed\n", __func__);
+          throw std::runtime_error("llama_decode() failed");
+      }
+    }
+
+    return startPos + nPromptTokens;
+    //return currentTokenIndex;
+  }
+
+  inline llama_token bestFromLastDecode() {
+    return sampleFromLogits(batch.n_tokens - 1, requestRng, &penalties, NULL);
+  }
+
+  inline void decodeToNextTokenScores() {
+    // evaluate the current batch with the transformer model
+    if (llama_decode(currentContext, batch)) {
+        fprintf(stderr, "%s : failed to eval, return code %d\n", __func__, 1);
+        throw std::runtime_error("Error 1313: input exceeded context length.");
+    }
+  }
+ 
+  llama_model* model = 0;
+  llama_model_params modelParams;
+  gpt_params gptParams;
+  int currentTokenIndex;
+  std::string modelPath;
+  llama_load_options loadOptions;
+  llama_context* currentContext = 0;
+  llama_batch batch;
+  int contextTokenLen, randSeed, batchSize;
+
+  ContextGate contextGate;
+  std::mutex schedMutex;
+  llama_sched_stats schedStats = {};
+  std::atomic<int> queuedPromptTokens { 0 };
+  std::atomic<double> prefillMsPerToken { 0.0 };
+  std::atomic<int> runningPrefillTokens { 0 };
+  std::atomic<int> runningDecodeSteps { 0 };
+  std::atomic<double> decodeMsPerStep { 0.0 };
+
+  std::chrono::steady_clock::time_point requestStart;
+  llama_cancel_token* cancelToken = NULL;
+  double deadlineMs = 0, ttftDeadlineMs = 0, firstTokenMs = -1.0;
+  llama_stop_reason stopReason = LLAMA_STOP_ERROR;
+  StopMatcher stopMatcher;
+
+  float samplingTemp = 0, samplingTopP = 1.0f;
+  int samplingTopK = 0;
+  unsigned int samplingSeed = 0;
+  std::mt19937 requestRng;
+  int beamWidth = 0;
+  float beamLengthPenalty = 1.0f;
+  float penaltyRepeat = 1.0f, penaltyFrequency = 0, penaltyPresence = 0;
+  int penaltyLastN = 0;
+  PenaltyWindow penalties;
+  std::vector<const llama_token_mask*> tokenMasks;
+  llama_token_logprobs* logprobsOut = NULL;
+  int logprobsCapacity = 0, topLogprobs = 0, nLogprobs = 0;
+  llama_stream_fn streamFn = NULL;
+  void* streamUserData = NULL;
+  Utf8Assembler utf8;
+  std::vector<char> pieceBuffer = std::vector<char>(64);
+  std::string piece, readyText;
+  std::unique_ptr<GrammarMatcher> grammar;
+  bool pipelineRequested = false;
+  std::unique_ptr<TokenPipeline> tokenPipeline;   // started by the first pipelined request
+  llama_stop_reason deliveryStop = LLAMA_STOP_ERROR;  // set by the delivery thread
+  TokenTrie tokenTrie;          // built on first grammar use
+  llama_tokenizer tokenizer;
+  double grammarMs = 0;
+
+  llama_seq_id activeSeq = 0;   // sequence generateTokens and sessions decode on
+  int retainedCells = 0;        // cells releaseInterrupted leaves on activeSeq
+  std::vector<llama_token>* emittedTokens = NULL;
+  int requestSeqs = 1;
+  int keptSeqs = 0;
+  llama_seq_id nextKeptSeq = keptSeqBase;
+  std::vector<llama_seq_id> freeKeptSeqs;
+  PrefixCache prefixCache;
+  llama_batch_result* batchResults = NULL;   // filled as batch sequences finish
+  llama_adapter* boundAdapter = NULL;         // merged into the weights
+  std::vector<llama_adapter*> adapters;       // registered, under adapterOwnerMutex
+
+  llama_startup_stats startupStats = {};
+  bool backendInitialized = false;
+  std::atomic<bool> abandonLoad { false };
+  std::thread loader;
+  std::mutex loadMutex;
+  std::condition_variable loadCondition;
+  LoadState loadState = LOAD_PENDING;
+};
+
+// The token the model would produce for answer right after text, whose
+// tokens are textTokens; the answer must not merge into text's last token.
+static llama_token answerToken(llama_tokenizer& tokenizer, const std::string& text,
+    const std::vector<llama_token>& textTokens, const char* answer) {
+  std::string withAnswer = text + answer;
+  std::vector<llama_token> tokens = tokenizer.tokenize(withAnswer.c_str(), withAnswer.size(), true, true);
+  size_t k = 0;
+  while (k < tokens.size() && k < textTokens.size() && tokens[k] == textTokens[k]) k++;
+  if (k != textTokens.size() || k == tokens.size()) {
+    throw std::runtime_error("Rerank answer merges with the suffix's last token.");
+  }
+  return tokens[k];
+}
+
+// Wrapper function definitions
+
+extern "C" {
+
+llama_load_options llama_load_default_options(void) {
+    llama_load_options options = {};
+    options.context = 2048;
+    options.gpu_layers = 20;
+    options.threads = 4;
+    options.seed = 777;
+    options.batch = 512;
+    options.prefetch = false;
+    options.mlock = false;
+    options.warmup = false;
+    options.kv_type = LLAMA_KV_F16;
+    options.parallel = 0;
+    options.prefix_cache = false;
+    options.lora = false;
+    options.progress_callback = NULL;
+    options.progress_user_data = NULL;
+    return options;
+}
+
+LlamaCppSimple* llama_create(const char* model_path, int context, int gpu_layers, int threads, int seed, int batch) {
+    llama_load_options options = llama_load_default_options();
+    options.context = context;
+    options.gpu_layers = gpu_layers;
+    options.threads = threads;
+    options.seed = seed;
+    options.batch = batch;
+    return llama_create_with_options(model_path, &options);
+}
+
+LlamaCppSimple* llama_create_with_options(const char* model_path, const llama_load_options* options) {
+    llama_load_options defaults = llama_load_default_options();
+    LlamaCppSimple* instance = nullptr;
+    try {
+        instance = new LlamaCppSimple(model_path, options != nullptr ? *options : defaults);
+        instance->load();
+        instance->markReady();
+        return instance;
+    } catch (const std::exception& e) {
+        // Handle exceptions if necessary
+        delete instance;
+        return nullptr;
+    }
+}
+
+LlamaCppSimple* llama_create_async(const char* model_path, const llama_load_options* options) {
+    llama_load_options defaults = llama_load_default_options();
+    try {
+        LlamaCppSimple* instance = new LlamaCppSimple(model_path, options != nullptr ? *options : defaults);
+        instance->loadAsync();
+        return instance;
+    } catch (const std::exception& e) {
+        return nullptr;
+    }
+}
+
+int llama_is_ready(LlamaCppSimple* instance) {
+    if (instance == nullptr) {
+        return -1;
+    }
+    return instance->readyState();
+}
+
+int llama_wait_ready(LlamaCppSimple* instance) {
+    if (instance == nullptr) {
+        return 0;
+    }
+    return instance->waitReady() ? 1 : 0;
+}
+
+int llama_get_startup_stats(LlamaCppSimple* instance, llama_startup_stats* stats) {
+    if (instance == nullptr || stats == nullptr) {
+        return -1;
+    }
+    *stats = instance->getStartupStats();
+    return 0;
+}
+
+int llama_get_sched_stats(LlamaCppSimple* instance, llama_sched_stats* stats) {
+    if (instance == nullptr || stats == nullptr) {
+        return -1;
+    }
+    *stats = instance->getSchedStats();
+    return 0;
+}
+
+void llama_destroy(LlamaCppSimple* instance) {
+    delete instance;
+}
+
+void* llama_get_context(LlamaCppSimple* instance) {
+  return (void*)(instance->getContext());
+}
+
+int llama_generate_batch(LlamaCppSimple* instance, const llama_batch_request* requests, int n_requests, int max_parallel, const llama_generate_params* params, llama_batch_result* results) {
+    if (instance == nullptr || requests == nullptr || results == nullptr || n_requests < 0) {
+        return -1;
+    }
+    memset(results, 0, sizeof(llama_batch_result) * n_requests);
+    llama_generate_params defaults = llama_generate_default_params();
+    try {
+        instance->generateBatch(requests, n_requests, max_parallel, params != nullptr ? *params : defaults, results);
+        return 0;
+    } catch (const std::exception& e) {
+        llama_batch_results_free(results, n_requests);
+        return -1;
+    }
+}
+
+int llama_generate_n(LlamaCppSimple* instance, const char* prompt, int max_new_tokens, int n, const llama_generate_params* params, llama_batch_result* results) {
+    if (instance == nullptr || prompt == nullptr || results == nullptr || n < 1) {
+        return -1;
+    }
+    memset(results, 0, sizeof(llama_batch_result) * n);
+    llama_generate_params defaults = llama_generate_default_params();
+    try {
+        instance->generateN(prompt, max_new_tokens, n, params != nullptr ? *params : defaults, results);
+        return 0;
+    } catch (const std::exception& e) {
+        llama_batch_results_free(results, n);
+        return -1;
+    }
+}
+
+int llama_score_tokens(LlamaCppSimple* instance, const int* context, int n_context, const int* continuations, const int* counts, int n_continuations, const llama_generate_params* params, float* token_logprobs, double* totals) {
+    if (instance == nullptr || context == nullptr || counts == nullptr || n_continuations < 0 || token_logprobs == nullptr || totals == nullptr) {
+        return -1;
+    }
+    llama_generate_params defaults = llama_generate_default_params();
+    try {
+        bool completed = instance->score(context, n_context, continuations, counts, n_continuations,
+            params != nullptr ? *params : defaults, token_logprobs, totals);
+        return completed ? 0 : -1;
+    } catch (const std::exception& e) {
+        return -1;
+    }
+}
+
+int llama_score_text(LlamaCppSimple* instance, const char* context, const char* const* continuations, int n_continuations, const llama_generate_params* params, float* token_logprobs, int capacity, int* counts, double* totals) {
+    llama_tokenizer* tokenizer = llama_get_tokenizer(instance);
+    if (tokenizer == nullptr || context == nullptr || continuations == nullptr || n_continuations < 0 || counts == nullptr || totals == nullptr) {
+        return -1;
+    }
+    try {
+        std::vector<llama_token> contextTokens = tokenizer->tokenize(context, strlen(context), true, true);
+        std::vector<std::vector<llama_token>> parts;
+        tokenizer->tokenizeMany(continuations, nullptr, n_continuations, false, true, parts);
+        std::vector<llama_token> packed;
+        for (int i = 0; i < n_continuations; i++) {
+            counts[i] = parts[i].size();
+            packed.insert(packed.end(), parts[i].begin(), parts[i].end());
+        }
+        std::vector<float> logprobs(packed.size());
+        if (llama_score_tokens(instance, contextTokens.data(), contextTokens.size(), packed.data(), counts, n_continuations, params, logprobs.data(), totals) != 0) {
+            return -1;
+        }
+        if (token_logprobs != nullptr && (int) logprobs.size() <= capacity) {
+            std::copy(logprobs.begin(), logprobs.end(), token_logprobs);
+        }
+        return logprobs.size();
+    } catch (const std::exception& e) {
+        return -1;
+    }
+}
+
+int llama_rerank_tokens(LlamaCppSimple* instance, const int* prefix, int n_prefix, const int* documents, const int* counts, int n_documents, const int* suffix, int n_suffix, int yes, int no, const llama_generate_params* params, float* scores) {
+    if (instance == nullptr || prefix == nullptr || counts == nullptr || n_documents < 0 || n_suffix < 0 || scores == nullptr) {
+        return -1;
+    }
+    llama_generate_params defaults = llama_generate_default_params();
+    try {
+        bool completed = instance->rerank(prefix, n_prefix, documents, counts, n_documents, suffix, n_suffix,
+            yes, no, params != nullptr ? *params : defaults, scores);
+        return completed ? 0 : -1;
+    } catch (const std::exception& e) {
+        return -1;
+    }
+}
+
+llama_rerank_options llama_rerank_default_options(void) {
+    llama_rerank_options options = {};
+    options.instruction = "Judge whether the document answers the query. Reply with yes or no.\n\nQuery: ";
+    options.document_prefix = "\n\nDocument: ";
+    options.suffix = "\n\nRelevant:";
+    options.yes = " yes";
+    options.no = " no";
+    options.max_document_tokens = 0;
+    return options;
+}
+
+int llama_rerank(LlamaCppSimple* instance, const char* query, const char* const* documents, int n_documents, const llama_rerank_options* options, const llama_generate_params* params, float* scores) {
+    llama_tokenizer* tokenizer = llama_get_tokenizer(instance);
+    if (tokenizer == nullptr || query == nullptr || documents == nullptr || n_documents < 0 || scores == nullptr) {
+        return -1;
+    }
+    if (n_documents == 0) {
+        return 0;
+    }
+    llama_rerank_options defaults = llama_rerank_default_options();
+    const llama_rerank_options& opts = options != nullptr ? *options : defaults;
+    try {
+        // The head is tokenized once. Each document is tokenized behind the
+        // document prefix alone, which re-tokenizes the join; the head then
+        // gives up the tokens the join merged. If the prefix tokenizes
+        // differently at the end of the head, the whole head is the anchor.
+        std::string head = std::string(opts.instruction) + query + opts.document_prefix;
+        std::vector<llama_token> headTokens = tokenizer->tokenize(head.c_str(), head.size(), true, true);
+        std::string anchor = *opts.document_prefix != '\0' ? std::string(opts.document_prefix) : head;
+        std::vector<std::string> texts(n_documents);
+        std::vector<const char*> ptrs(n_documents);
+        std::vector<std::vector<llama_token>> full;
+        size_t joined, dropped;
+        for (;;) {
+            for (int i = 0; i < n_documents; i++) {
+                texts[i] = anchor + documents[i] + opts.suffix;
+                ptrs[i] = texts[i].c_str();
+            }
+            tokenizer->tokenizeMany(ptrs.data(), nullptr, n_documents, true, true, full);
+            std::vector<llama_token> anchorTokens = tokenizer->tokenize(anchor.c_str(), anchor.size(), true, true);
+            joined = anchorTokens.size();
+            for (const auto& tokens : full) {
+                size_t k = 0;
+                while (k < joined && k < tokens.size() && tokens[k] == anchorTokens[k]) k++;
+                joined = k;
+            }
+            dropped = anchorTokens.size() - joined;
+            if (anchor == head || (joined > 0 && dropped < headTokens.size() &&
+                    std::equal(anchorTokens.begin() + joined, anchorTokens.end(), headTokens.end() - dropped))) {
+                break;
+            }
+            anchor = head;
+        }
+
+        size_t shared = headTokens.size() - dropped;
+        const std::vector<llama_token>& first = full[0];
+        size_t tail = first.size() - joined;
+        for (const auto& tokens : full) {
+            size_t k = 0;
+            while (k < tail && k < tokens.size() - joined && tokens[tokens.size() - 1 - k] == first[first.size() - 1 - k]) k++;
+            tail = k;
+        }
+
+        std::vector<llama_token> packed;
+        std::vector<int> counts(n_documents);
+        for (int i = 0; i < n_documents; i++) {
+            int len = full[i].size() - joined - tail;
+            if (opts.max_document_tokens > 0) {
+                len = std::min(len, opts.max_document_tokens);
+            }
+            counts[i] = len;
+            packed.insert(packed.end(), full[i].begin() + joined, full[i].begin() + joined + len);
+        }
+        llama_token yes = answerToken(*tokenizer, texts[0], first, opts.yes);
+        llama_token no = answerToken(*tokenizer, texts[0], first, opts.no);
+        return llama_rerank_tokens(instance, headTokens.data(), shared, packed.data(), counts.data(), n_documents,
+            first.data() + first.size() - tail, tail, yes, no, params, scores);
+    } catch (const std::exception& e) {
+        return -1;
+    }
+}
+
+void llama_prefix_cache_clear(LlamaCppSimple* instance) {
+    if (instance != nullptr) {
+        instance->clearPrefixCache();
+    }
+}
+
+llama_session* llama_session_new(LlamaCppSimple* instance) {
+    if (instance == nullptr) {
+        return nullptr;
+    }
+    llama_session* session = new llama_session();
+    try {
+        instance->openSession(*session);
+        return session;
+    } catch (const std::exception& e) {
+        delete session;
+        return nullptr;
+    }
+}
+
+void llama_session_free(llama_session* session) {
+    if (session == nullptr) {
+        return;
+    }
+    if (session->owner != nullptr) {
+        session->owner->closeSession(*session);
+    }
+    delete session;
+}
+
+int llama_session_set_adapter(llama_session* session, llama_adapter* adapter) {
+    if (session == nullptr || session->owner == nullptr) {
+        return -1;
+    }
+    try {
+        session->owner->setSessionAdapter(*session, adapter);
+        return 0;
+    } catch (const std::exception& e) {
+        return -1;
+    }
+}
+
+llama_adapter* llama_adapter_load(LlamaCppSimple* instance, const char* path, float scale, const char* base_path) {
+    if (instance == nullptr || path == nullptr) {
+        return nullptr;
+    }
+    llama_adapter* adapter = new llama_adapter();
+    adapter->path = path;
+    adapter->basePath = base_path != nullptr ? base_path : "";
+    adapter->scale = scale;
+    try {
+        instance->loadAdapter(*adapter);
+        return adapter;
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s: error: %s\n", __func__, e.what());
+        delete adapter;
+        return nullptr;
+    }
+}
+
+void llama_adapter_free(llama_adapter* adapter) {
+    if (adapter == nullptr) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(adapterOwnerMutex);
+        if (adapter->owner != nullptr) {
+            try {
+                adapter->owner->unregisterAdapter(*adapter);
+            } catch (const std::exception& e) {
+                fprintf(stderr, "%s: error: %s\n", __func__, e.what());
+            }
+        }
+    }
+    delete adapter;
+}
+
+int llama_adapter_get_stats(const llama_adapter* adapter, llama_adapter_stats* stats) {
+    if (adapter == nullptr || stats == nullptr) {
+        return -1;
+    }
+    *stats = adapter->stats;
+    return 0;
+}
+
+llama_session* llama_session_fork(const llama_session* session) {
+    if (session == nullptr || session->owner == nullptr) {
+        return nullptr;
+    }
+    llama_session* child = nullptr;
+    try {
+        child = new llama_session();
+        session->owner->forkSession(*session, *child);
+        return child;
+    } catch (const std::exception& e) {
+        delete child;
+        return nullptr;
+    }
+}
+
+int llama_session_append_text(llama_session* session, const char* text) {
+    if (session == nullptr || session->owner == nullptr || text == nullptr) {
+        return -1;
+    }
+    try {
+        return session->owner->appendTextToSession(*session, text);
+    } catch (const std::exception& e) {
+        return -1;
+    }
+}
+
+int llama_session_append_tokens(llama_session* session, const int* tokens, int n_tokens) {
+    if (session == nullptr || session->owner == nullptr || (tokens == nullptr && n_tokens > 0)) {
+        return -1;
+    }
+    try {
+        return session->owner->appendToSession(*session, tokens, n_tokens);
+    } catch (const std::exception& e) {
+        return -1;
+    }
+}
+
+int llama_session_truncate(llama_session* session, int n_tokens) {
+    if (session == nullptr || session->owner == nullptr) {
+        return -1;
+    }
+    session->owner->truncateSession(*session, n_tokens);
+    return session->history.size();
+}
+
+int llama_session_length(const llama_session* session) {
+    return session == nullptr ? 0 : session->history.size();
+}
+
+int llama_session_tokens(const llama_session* session, int* tokens, int n_max) {
+    if (session == nullptr) {
+        return 0;
+    }
+    if (tokens != nullptr) {
+        int n = std::min(std::max(0, n_max), (int) session->history.size());
+        std::copy(session->history.begin(), session->history.begin() + n, tokens);
+    }
+    return session->history.size();
+}
+
+int llama_session_generate(llama_session* session, int max_new_tokens, const llama_generate_params* params, llama_generate_result* result) {
+    llama_generate_result local = {};
+    if (result == nullptr) {
+        result = &local;
+    }
+    if (session == nullptr || session->owner == nullptr || params == nullptr) {
+        result->stop_reason = LLAMA_STOP_ERROR;
+        return -1;
+    }
+    try {
+        return session->owner->generateInSession(*session, max_new_tokens, *params, *result);
+    } catch (const std::exception& e) {
+        result->stop_reason = LLAMA_STOP_ERROR;
+        return -1;
+    }
+}
+
+void llama_batch_results_free(llama_batch_result* results, int n_results) {
+    if (results == nullptr) {
+        return;
+    }
+    for (int i = 0; i < n_results; i++) {
+        free(results[i].text);
+        results[i].text = NULL;
+    }
+}
+
+llama_token_mask* llama_token_mask_create(LlamaCppSimple* instance, llama_mask_mode mode, const int* tokens, int n_tokens, const char* const* strings, int n_strings) {
+    if (instance == nullptr) {
+        return nullptr;
+    }
+    try {
+        int nVocab = instance->vocabSize();
+        if (nVocab <= 0) {
+            return nullptr;
+        }
+        llama_token_mask* mask = new llama_token_mask();
+        mask->nVocab = nVocab;
+        mask->mode = mode;
+        mask->bits.assign((nVocab + 63) / 64, 0);
+        instance->fillTokenMask(*mask, tokens, n_tokens, strings, n_strings, false, 0.0f);
+        return mask;
+    } catch (const std::exception& e) {
+        return nullptr;
+    }
+}
+
+int llama_token_mask_add_bias(LlamaCppSimple* instance, llama_token_mask* mask, const int* tokens, int n_tokens, const char* const* strings, int n_strings, float bias) {
+    if (instance == nullptr || mask == nullptr) {
+        return -1;
+    }
+    try {
+        instance->fillTokenMask(*mask, tokens, n_tokens, strings, n_strings, true, bias);
+        return 0;
+    } catch (const std::exception& e) {
+        return -1;
+    }
+}
+
+int llama_token_mask_size(const llama_token_mask* mask) {
+    return mask == nullptr ? 0 : (int) mask->members.size();
+}
+
+void llama_token_mask_free(llama_token_mask* mask) {
+    delete mask;
+}
+
+llama_tokenizer* llama_get_tokenizer(LlamaCppSimple* instance) {
+    return instance == nullptr ? nullptr : instance->getTokenizer();
+}
+
+int llama_tokenize_many(llama_tokenizer* tokenizer, const char* const* texts, const int* text_lens, int n_texts, bool add_bos, bool special, int* tokens, int n_tokens_max, int* offsets, int* counts) {
+    if (tokenizer == nullptr || texts == nullptr || n_texts < 0) {
+        return -1;
+    }
+    try {
+        std::vector<std::vector<llama_token>> out;
+        tokenizer->tokenizeMany(texts, text_lens, n_texts, add_bos, special, out);
+        int total = 0;
+        for (int i = 0; i < n_texts; i++) {
+            if (offsets != nullptr) offsets[i] = total;
+            if (counts != nullptr) counts[i] = out[i].size();
+            total += out[i].size();
+        }
+        if (tokens != nullptr && total <= n_tokens_max) {
+            for (const auto& ids : out) {
+                std::copy(ids.begin(), ids.end(), tokens);
+                tokens += ids.size();
+            }
+        }
+        return total;
+    } catch (const std::exception& e) {
+        return -1;
+    }
+}
+
+int llama_count_tokens_many(llama_tokenizer* tokenizer, const char* const* texts, const int* text_lens, int n_texts, bool add_bos, bool special, int* counts) {
+    return llama_tokenize_many(tokenizer, texts, text_lens, n_texts, add_bos, special, nullptr, 0, nullptr, counts);
+}
+
+int llama_detokenize_many(llama_tokenizer* tokenizer, const int* tokens, const int* counts, int n_seqs, char* text, int text_max, int* offsets, int* lengths) {
+    if (tokenizer == nullptr || counts == nullptr || n_seqs < 0) {
+        return -1;
+    }
+    try {
+        std::vector<int> starts(n_seqs);
+        int nTokens = 0;
+        for (int i = 0; i < n_seqs; i++) {
+            starts[i] = nTokens;
+            nTokens += counts[i];
+        }
+        std::vector<std::string> out(n_seqs);
+        parallelFor(n_seqs, nTokens < 4096 ? 1 : tokenizer->threads, [&](int i) {
+            out[i] = tokenizer->detokenize(tokens + starts[i], counts[i]);
+        });
+        int total = 0;
+        for (int i = 0; i < n_seqs; i++) {
+            if (offsets != nullptr) offsets[i] = total;
+            if (lengths != nullptr) lengths[i] = out[i].size();
+            total += out[i].size();
+        }
+        if (text != nullptr && total <= text_max) {
+            for (const auto& piece : out) {
+                memcpy(text, piece.data(), piece.size());
+                text += piece.size();
+            }
+        }
+        return total;
+    } catch (const std::exception& e) {
+        return -1;
+    }
+}
+
+int llama_tokenizer_cache_add(llama_tokenizer* tokenizer, const char* text, bool add_bos, bool special) {
+    if (tokenizer == nullptr || text == nullptr) {
+        return -1;
+    }
+    try {
+        return tokenizer->pinSegment(text, add_bos, special);
+    } catch (const std::exception& e) {
+        return -1;
+    }
+}
+
+void llama_tokenizer_cache_clear(llama_tokenizer* tokenizer) {
+    if (tokenizer != nullptr) {
+        tokenizer->clearSegments();
+    }
+}
+
+llama_plan_request llama_plan_default_request(void) {
+    llama_plan_request request = {};
+    request.budget_bytes = 0;
+    request.min_ctx = 512;
+    request.max_ctx = 0;
+    request.max_parallel = 1;
+    request.batch = 512;
+    request.allow_quantized_kv = true;
+    return request;
+}
+
+llama_quantize_options llama_quantize_default_options(void) {
+    llama_quantize_options options = {};
+    options.type = LLAMA_QUANT_Q4_K_M;
+    options.threads = 0;
+    options.allow_requantize = false;
+    options.quantize_output = true;
+    options.progress = NULL;
+    options.progress_user_data = NULL;
+    return options;
+}
+
+int llama_quantize_model(const char* input_path, const char* output_path, const llama_quantize_options* options, llama_quantize_result* result) {
+    if (input_path == nullptr || output_path == nullptr) {
+        return -1;
+    }
+    llama_quantize_options opts = options != nullptr ? *options : llama_quantize_default_options();
+    llama_ftype ftype;
+    if (!quantFtype(opts.type, ftype)) {
+        fprintf(stderr, "%s: error: unknown quantization type %d\n", __func__, (int) opts.type);
+        return -1;
+    }
+    auto start = std::chrono::steady_clock::now();
+
+    llama_backend_init(false);
+    llama_model_quantize_params params = llama_model_quantize_default_params();
+    params.nthread = opts.threads > 0 ? opts.threads : (int) std::max(1u, std::thread::hardware_concurrency());
+    params.ftype = ftype;
+    params.allow_requantize = opts.allow_requantize;
+    params.quantize_output_tensor = opts.quantize_output;
+
+    QuantizeProgress progress = { opts.progress, opts.progress_user_data, 0 };
+    uint32_t status;
+    {
+        std::lock_guard<std::mutex> lock(quantizeMutex);
+        llama_log_set(quantizeLog, &progress);
+        status = llama_model_quantize(input_path, output_path, &params);
+        llama_log_set(NULL, NULL);
+    }
+    if (status != 0) {
+        fprintf(stderr, "%s: error: failed to quantize %s\n", __func__, input_path);
+        return -1;
+    }
+    if (progress.fn != NULL) {
+        progress.fn(progress.total, progress.total, "", progress.userData);
+    }
+
+    if (result != nullptr) {
+        result->n_tensors = progress.total;
+        result->input_bytes = fileBytes(input_path);
+        result->output_bytes = fileBytes(output_path);
+        result->total_ms = msSince(start);
+    }
+    return 0;
+}
+
+int llama_plan_memory(const char* model_path, const llama_plan_request* request, llama_memory_plan* candidates, int n_candidates_max, llama_memory_plan* chosen) {
+    if (model_path == nullptr || request == nullptr) {
+        return -1;
+    }
+    ModelShape shape;
+    if (!readModelShape(model_path, shape)) {
+        fprintf(stderr, "%s: error: unable to read model shape from %s\n", __func__, model_path);
+        return -1;
+    }
+
+    const int maxCtx = request->max_ctx > 0 ? request->max_ctx : shape.nCtxTrain;
+    const int minCtx = std::max(1, std::min(request->min_ctx, maxCtx));
+    const int maxParallel = std::max(1, request->max_parallel);
+    const int batch = request->batch > 0 ? request->batch : 512;
+
+    std::vector<llama_kv_type> kvTypes = { LLAMA_KV_F16 };
+    if (request->allow_quantized_kv) {
+        kvTypes.push_back(LLAMA_KV_Q8_0);
+        kvTypes.push_back(LLAMA_KV_Q4_0);
+    }
+    // parallel counts in powers of two up to the limit, contexts halving
+    // down to the minimum; both ends always included
+    std::vector<int> parallels;
+    for (int p = 1; p < maxParallel; p *= 2) parallels.push_back(p);
+    parallels.push_back(maxParallel);
+    std::vector<int> contexts;
+    for (int c = maxCtx; c > minCtx; c /= 2) contexts.push_back(c);
+    contexts.push_back(minCtx);
+
+    std::vector<llama_memory_plan> plans;
+    for (llama_kv_type kvType : kvTypes) {
+        for (int parallel : parallels) {
+            for (int ctx : contexts) {
+                plans.push_back(estimateMemory(shape, ctx * parallel, parallel, kvType, batch, request->budget_bytes));
+            }
+        }
+    }
+
+    // kvTypes run best quality first, so the first full-size fit wins;
+    // failing that, take the most cells with ties to the earlier candidate
+    const llama_memory_plan* best = nullptr;
+    for (const auto& plan : plans) {
+        if (plan.fits && plan.n_parallel == maxParallel && plan.n_ctx == maxCtx * maxParallel) {
+            best = &plan;
+            break;
+        }
+    }
+    if (best == nullptr) {
+        for (const auto& plan : plans) {
+            if (plan.fits && (best == nullptr || plan.n_ctx > best->n_ctx)) {
+                best = &plan;
+            }
+        }
+    }
+
+    if (chosen != nullptr) {
+        if (best != nullptr) {
+            *chosen = *best;
+        } else {
+            // the smallest configuration, to show how far over budget it is
+            *chosen = estimateMemory(shape, minCtx, 1, kvTypes.back(), batch, request->budget_bytes);
+        }
+    }
+    if (candidates != nullptr) {
+        int n = std::min((int) plans.size(), std::max(0, n_candidates_max));
+        std::copy(plans.begin(), plans.begin() + n, candidates);
+    }
+    return (int) plans.size();
+}
+
+llama_tokenizer* llama_tokenizer_load(const char* model_path, int threads) {
+    if (model_path == nullptr) {
+        return nullptr;
+    }
+    llama_backend_init(false);
+
+    llama_model_params params = llama_model_default_params();
+    params.vocab_only = true;
+    llama_model* model = llama_load_model_from_file(model_path, params);
+    if (model == NULL) {
+        fprintf(stderr, "%s: error: unable to load vocabulary from %s\n", __func__, model_path);
+        return nullptr;
+    }
+
+    llama_tokenizer* tokenizer = new llama_tokenizer();
+    tokenizer->model = model;
+    tokenizer->ownsModel = true;
+    tokenizer->threads = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+    return tokenizer;
+}
+
+void llama_tokenizer_free(llama_tokenizer* tokenizer) {
+    // an instance's tokenizer is released by llama_destroy
+    if (tokenizer != nullptr && tokenizer->ownsModel) {
+        delete tokenizer;
+    }
+}
+
+int llama_tokenizer_metadata(llama_tokenizer* tokenizer, llama_model_metadata* metadata) {
+    if (tokenizer == nullptr || metadata == nullptr) {
+        return -1;
+    }
+    const llama_model* model = tokenizer->model;
+    *metadata = llama_model_metadata();
+    metadata->n_vocab = llama_n_vocab(model);
+    metadata->n_ctx_train = llama_n_ctx_train(model);
+    metadata->n_embd = llama_n_embd(model);
+    metadata->vocab_type = llama_vocab_type(model);
+    metadata->bos = llama_token_bos(model);
+    metadata->eos = llama_token_eos(model);
+    metadata->nl = llama_token_nl(model);
+    metadata->prefix = llama_token_prefix(model);
+    metadata->middle = llama_token_middle(model);
+    metadata->suffix = llama_token_suffix(model);
+    metadata->eot = llama_token_eot(model);
+    metadata->add_bos = llama_add_bos_token(model);
+    llama_model_desc(model, metadata->desc, sizeof(metadata->desc));
+    return 0;
+}
+
+int llama_tokenizer_meta_str(llama_tokenizer* tokenizer, const char* key, char* buf, int buf_size) {
+    if (tokenizer == nullptr || key == nullptr) {
+        return -1;
+    }
+    return llama_model_meta_val_str(tokenizer->model, key, buf, buf_size);
+}
+
+llama_cancel_token* llama_cancel_token_new(void) {
+    return new llama_cancel_token();
+}
+
+void llama_cancel_token_free(llama_cancel_token* token) {
+    delete token;
+}
+
+void llama_cancel_token_cancel(llama_cancel_token* token) {
+    if (token != nullptr) {
+        token->cancelled.store(true);
+    }
+}
+
+void llama_cancel_token_reset(llama_cancel_token* token) {
+    if (token != nullptr) {
+        token->cancelled.store(false);
+    }
+}
+
+bool llama_cancel_token_is_cancelled(const llama_cancel_token* token) {
+    return token != nullptr && token->cancelled.load();
+}
+
+llama_generate_params llama_generate_default_params(void) {
+    llama_generate_params params = {};
+    params.cancel = NULL;
+    params.deadline_ms = 0;
+    params.ttft_deadline_ms = 0;
+    params.stop_sequences = NULL;
+    params.n_stop_sequences = 0;
+    params.temperature = 0.0f;
+    params.top_k = 0;
+    params.top_p = 1.0f;
+    params.seed = 0;
+    params.beam_width = 0;
+    params.length_penalty = 1.0f;
+    params.repeat_penalty = 1.0f;
+    params.repeat_last_n = 64;
+    params.frequency_penalty = 0.0f;
+    params.presence_penalty = 0.0f;
+    params.grammar = NULL;
+    params.stream = NULL;
+    params.stream_user_data = NULL;
+    params.top_logprobs = 0;
+    params.logprobs = NULL;
+    params.logprobs_capacity = 0;
+    params.masks = NULL;
+    params.n_masks = 0;
+    params.adapter = NULL;
+    params.priority = 0;
+    params.pipelined = false;
+    return params;
+}
+
+int llama_generate_text(LlamaCppSimple* instance, const char* prompt, int total_tokens) {
+    llama_generate_params params = llama_generate_default_params();
+    return llama_generate_text_with_params(instance, prompt, total_tokens, &params, NULL);
+}
+
+int llama_generate_tokens(LlamaCppSimple* instance, const int* tokens, int n_tokens, int max_new_tokens, const llama_generate_params* params, llama_generate_result* result) {
+    llama_generate_result local = {};
+    if (result == nullptr) {
+        result = &local;
+    }
+    if (instance == nullptr || tokens == nullptr || params == nullptr) {
+        result->stop_reason = LLAMA_STOP_ERROR;
+        return -1;
+    }
+    try {
+        return instance->generateTokens(tokens, n_tokens, max_new_tokens, *params, *result);
+    } catch (const std::exception& e) {
+        result->stop_reason = LLAMA_STOP_ERROR;
+        return -1;
+    }
+}
+
+int llama_generate_text_with_params(LlamaCppSimple* instance, const char* prompt, int total_tokens, const llama_generate_params* params, llama_generate_result* result) {
+    llama_generate_result local = {};
+    if (result == nullptr) {
+        result = &local;
+    }
+    if (instance == nullptr || params == nullptr) {
+        result->stop_reason = LLAMA_STOP_ERROR;
         return -1; // Indicate error
     }
     try {
-        return instance->generateText(prompt, total_tokens);
+        return instance->generateText(prompt, total_tokens, *params, *result);
     } catch (const std::exception& e) {
         // Handle exceptions if necessary
+        result->stop_reason = LLAMA_STOP_ERROR;
         return -1; // Indicate error
     }
 }
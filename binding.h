@@ -5,7 +5,7 @@
 extern "C" {
 #endif
 
-
+#include <stdbool.h>
 
 extern unsigned int tokenCallback(void *, char *);
 
@@ -19,11 +19,451 @@ class LlamaCppSimple;
 typedef struct LlamaCppSimple LlamaCppSimple;
 #endif
 
+// Cancellation flag that may be set from any thread while a generation runs.
+typedef struct llama_cancel_token llama_cancel_token;
+
+// Precompiled token allow/deny set with optional per-token logit biases,
+// built once and reusable across requests and threads.
+typedef struct llama_token_mask llama_token_mask;
+
+// Thread-safe tokenizer with a cache of pinned prompt segments.
+typedef struct llama_tokenizer llama_tokenizer;
+
+// A conversation that keeps its own KV sequence and token history.
+typedef struct llama_session llama_session;
+
+// A LoRA adapter registered with an instance and merged into its weights
+// for the requests that ask for it.
+typedef struct llama_adapter llama_adapter;
+
+typedef enum llama_mask_mode {
+    LLAMA_MASK_NONE = 0,       // biases only
+    LLAMA_MASK_ALLOW = 1,      // only the mask's tokens may be sampled
+    LLAMA_MASK_DENY = 2,       // the mask's tokens are never sampled
+} llama_mask_mode;
+
+// Why a generation ended.
+typedef enum llama_stop_reason {
+    LLAMA_STOP_ERROR = 0,
+    LLAMA_STOP_EOS = 1,
+    LLAMA_STOP_LENGTH = 2,
+    LLAMA_STOP_SEQUENCE = 3,
+    LLAMA_STOP_DEADLINE = 4,
+    LLAMA_STOP_CANCELLED = 5,
+    LLAMA_STOP_CALLBACK = 6,   // tokenCallback returned false
+    LLAMA_STOP_REJECTED = 7,   // not started, the deadline could not be met
+} llama_stop_reason;
+
+#define LLAMA_MAX_TOP_LOGPROBS 20
+
+// Log-probability of one generated token and its most likely alternatives,
+// taken from the distribution it was sampled from (after penalties and
+// masks, before temperature).
+typedef struct llama_token_logprobs {
+    int token;
+    float logprob;
+    int n_top;
+    int top_tokens[LLAMA_MAX_TOP_LOGPROBS];     // best first
+    float top_logprobs[LLAMA_MAX_TOP_LOGPROBS];
+} llama_token_logprobs;
+
+// Receives generated text as raw bytes with an explicit length; chunks never
+// split a UTF-8 character. Return false to stop. The bytes are only valid
+// during the call.
+typedef bool (*llama_stream_fn)(const char* bytes, int len, void* user_data);
+
+// Per-request options for llama_generate_text_with_params.
+typedef struct llama_generate_params {
+    llama_cancel_token* cancel; // optional, checked between prefill chunks and decode steps
+    double deadline_ms;         // wall-clock limit for the whole request, 0 = none
+    double ttft_deadline_ms;    // limit until the first generated token, 0 = none
+    const char* const* stop_sequences;
+    int n_stop_sequences;
+    float temperature;          // <= 0 is greedy
+    int top_k;                  // 0 = whole vocabulary
+    float top_p;                // 1 = disabled
+    unsigned int seed;          // 0 = the instance seed; sequence i uses seed + i
+    int beam_width;             // > 1 switches llama_generate_text to beam search
+    float length_penalty;       // beams are ranked by logprob / length^length_penalty
+    float repeat_penalty;       // 1 = disabled
+    int repeat_last_n;          // penalty window, prompt included; 0 = disabled, -1 = context size
+    float frequency_penalty;    // subtracted once per occurrence in the window
+    float presence_penalty;     // subtracted once if present in the window
+    const char* grammar;        // GBNF source constraining the output, NULL = none; batch and n calls fail with one
+    llama_stream_fn stream;     // replaces tokenCallback for this request, NULL = none
+    void* stream_user_data;
+    int top_logprobs;           // alternatives per token, at most LLAMA_MAX_TOP_LOGPROBS
+    llama_token_logprobs* logprobs; // one entry per generated token of llama_generate_text*, NULL = off
+    int logprobs_capacity;
+    const llama_token_mask* const* masks; // applied in order before sampling
+    int n_masks;
+    llama_adapter* adapter;     // LoRA adapter of the same instance, NULL = the base model
+    int priority;               // higher gets the context first and preempts lower batches
+    // The decode thread hands each sampled token to a delivery thread through
+    // a lock-free ring and goes on to the next decode; detokenizing, stop
+    // matching and stream/tokenCallback run there, overlapping it. A stop
+    // (false from the callback, or a stop sequence) reaches the decode loop
+    // before its next step, and tokens decoded past it are dropped from the
+    // result, the KV cache and sessions. The call returns once delivery is
+    // done. Single-prompt generation and sessions only; beam search ignores it.
+    bool pipelined;
+} llama_generate_params;
+
+typedef struct llama_generate_result {
+    llama_stop_reason stop_reason;
+    int prompt_tokens;
+    int cached_tokens;          // prompt tokens shared from the prefix cache
+    int generated_tokens;
+    double prefill_ms;
+    double ttft_ms;             // -1 if no token was generated
+    double total_ms;            // includes time spent queued
+    double grammar_ms;          // time spent masking logits with the grammar
+    int n_logprobs;             // entries written to params.logprobs
+} llama_generate_result;
+
+// One prompt for llama_generate_batch.
+typedef struct llama_batch_request {
+    const char* prompt;
+    int max_new_tokens;
+    const int* tokens;          // pre-tokenized prompt used instead of prompt, NULL = none
+    int n_tokens;
+    // Text as it is generated, whole UTF-8 characters per call; return false
+    // to stop this prompt. Once it ends its result is filled in and stream is
+    // called once more with len 0. NULL = none.
+    llama_stream_fn stream;
+    void* stream_user_data;
+} llama_batch_request;
+
+// Output for one prompt of llama_generate_batch; text is owned by the
+// binding, release it with llama_batch_results_free.
+typedef struct llama_batch_result {
+    char* text;
+    int text_len;
+    llama_stop_reason stop_reason;
+    int prompt_tokens;
+    int cached_tokens;
+    int generated_tokens;
+    double prefill_ms;          // from admission until the prompt was prefilled
+    double ttft_ms;
+    double total_ms;
+    double logprob;             // cumulative log-probability of the sampled tokens
+} llama_batch_result;
+
+typedef void (*llama_progress_fn)(float progress, void* user_data);
+
+// Element type of the KV cache. Quantized types apply to the K cache only;
+// llama.cpp keeps the V cache in f16.
+typedef enum llama_kv_type {
+    LLAMA_KV_F16 = 0,
+    LLAMA_KV_Q8_0 = 1,
+    LLAMA_KV_Q4_0 = 2,
+} llama_kv_type;
+
+// Startup options for llama_create_with_options / llama_create_async; a NULL
+// options pointer there loads with llama_load_default_options().
+typedef struct llama_load_options {
+    int context;
+    int gpu_layers;
+    int threads;
+    int seed;
+    int batch;
+    bool prefetch;      // read the model file into the page cache before loading
+    bool mlock;         // lock the model weights in RAM
+    bool warmup;        // run warm-up decodes before the instance is ready
+    llama_kv_type kv_type;
+    int parallel;       // default max_parallel for llama_generate_batch (0 = batch)
+    bool prefix_cache;  // keep prompt prefixes in the KV cache and share them
+    bool lora;          // load the weights without mmap so LoRA adapters can be merged
+    llama_progress_fn progress_callback; // overall progress in [0, 1]
+    void* progress_user_data;
+} llama_load_options;
+
+// What llama_plan_memory may choose from.
+typedef struct llama_plan_request {
+    double budget_bytes;
+    int min_ctx;            // smallest useful context per sequence
+    int max_ctx;            // largest context per sequence (0 = training context)
+    int max_parallel;       // most sequences decoded together
+    int batch;              // n_batch the context will be created with
+    bool allow_quantized_kv;
+} llama_plan_request;
+
+// Estimated bytes for one configuration. n_ctx counts KV cells for all
+// sequences together (n_parallel * per-sequence context).
+typedef struct llama_memory_plan {
+    int n_ctx;
+    int n_parallel;
+    llama_kv_type kv_type;
+    double weight_bytes;
+    double kv_bytes;
+    double compute_bytes;
+    double total_bytes;
+    bool fits;
+} llama_memory_plan;
+
+// Output formats of llama_quantize_model. The k-quant mixes (_S/_M/_L)
+// keep the most sensitive tensors at a higher precision.
+typedef enum llama_quant_type {
+    LLAMA_QUANT_F16 = 0,
+    LLAMA_QUANT_Q4_0,
+    LLAMA_QUANT_Q4_1,
+    LLAMA_QUANT_Q5_0,
+    LLAMA_QUANT_Q5_1,
+    LLAMA_QUANT_Q8_0,
+    LLAMA_QUANT_Q2_K,
+    LLAMA_QUANT_Q3_K_S,
+    LLAMA_QUANT_Q3_K_M,
+    LLAMA_QUANT_Q3_K_L,
+    LLAMA_QUANT_Q4_K_S,
+    LLAMA_QUANT_Q4_K_M,
+    LLAMA_QUANT_Q5_K_S,
+    LLAMA_QUANT_Q5_K_M,
+    LLAMA_QUANT_Q6_K,
+} llama_quant_type;
+
+// Called as each tensor starts with the number already written, and once
+// more with done == total when the file is complete.
+typedef void (*llama_quantize_progress_fn)(int done, int total, const char* tensor, void* user_data);
+
+typedef struct llama_quantize_options {
+    llama_quant_type type;
+    int threads;                // threads per tensor, 0 = all cores
+    bool allow_requantize;      // accept already-quantized input (loses quality)
+    bool quantize_output;       // also quantize output.weight
+    llama_quantize_progress_fn progress;    // NULL = none
+    void* progress_user_data;
+} llama_quantize_options;
+
+typedef struct llama_quantize_result {
+    int n_tensors;
+    double input_bytes;
+    double output_bytes;
+    double total_ms;
+} llama_quantize_result;
+
+typedef struct llama_adapter_stats {
+    double file_bytes;      // held in the page cache, the base weights are not copied
+    double load_ms;
+    double last_apply_ms;   // last merge or unmerge
+    double apply_ms;        // all merges and unmerges
+    int applies;
+} llama_adapter_stats;
+
+// Preemption of llama_generate_batch calls by requests of higher priority.
+typedef struct llama_sched_stats {
+    int preemptions;
+    int refilled_tokens;    // decoded again to rebuild paused sequences' cells
+    double refill_ms;
+    int waiting;            // calls waiting for the context now
+} llama_sched_stats;
+
+// Judge prompt of llama_rerank: instruction + query + document_prefix +
+// document + suffix, after which the model's next token is compared
+// between yes and no.
+typedef struct llama_rerank_options {
+    const char* instruction;
+    const char* document_prefix;
+    const char* suffix;
+    const char* yes;            // its first token after suffix is compared
+    const char* no;
+    int max_document_tokens;    // longer documents are cut, 0 = as much as fits
+} llama_rerank_options;
+
+// Instruction set of the CPU kernels in use.
+typedef enum llama_cpu_kernels {
+    LLAMA_CPU_GENERIC = 0,
+    LLAMA_CPU_AVX2,         // with FMA and F16C
+    LLAMA_CPU_AVX512,
+    LLAMA_CPU_AVX512_VNNI,
+    LLAMA_CPU_NEON,
+} llama_cpu_kernels;
+
+// Wall-clock milliseconds spent in each startup phase.
+typedef struct llama_startup_stats {
+    double backend_ms;
+    double prefetch_ms;
+    double load_ms;
+    double context_ms;
+    double warmup_ms;
+    double total_ms;
+    llama_cpu_kernels cpu_kernels;
+    bool cpu_dispatch;      // picked from cpuid at runtime rather than fixed by the build
+} llama_startup_stats;
+
+// Vocabulary and training metadata; special tokens are -1 when absent.
+typedef struct llama_model_metadata {
+    int n_vocab;
+    int n_ctx_train;
+    int n_embd;
+    int vocab_type;     // 0 = SentencePiece, 1 = BPE
+    int bos;
+    int eos;
+    int nl;
+    int prefix;         // infill tokens
+    int middle;
+    int suffix;
+    int eot;
+    int add_bos;        // 1 or 0 from the GGUF, -1 if unspecified
+    char desc[128];
+} llama_model_metadata;
+
 // C-compatible function declarations
+llama_load_options llama_load_default_options(void);
+llama_plan_request llama_plan_default_request(void);
+// Estimates memory for candidate configurations of the model at model_path,
+// reading only its metadata, and picks one under the budget: the best KV type
+// that fits max_parallel sequences of max_ctx, otherwise the candidate with
+// the most cells. Writes up to n_candidates_max candidates and returns how
+// many there are, or -1 if the model cannot be read. chosen->fits is false
+// when nothing fits.
+int llama_plan_memory(const char* model_path, const llama_plan_request* request, llama_memory_plan* candidates, int n_candidates_max, llama_memory_plan* chosen);
+llama_quantize_options llama_quantize_default_options(void);
+// Writes a quantized copy of the GGUF model at input_path to output_path.
+// Tensors are read through mmap, quantized one at a time by options->threads
+// threads and written as they finish, so memory stays near one tensor.
+// options may be NULL; result may be NULL. Returns 0 on success.
+int llama_quantize_model(const char* input_path, const char* output_path, const llama_quantize_options* options, llama_quantize_result* result);
 LlamaCppSimple* llama_create(const char* model_path, int context, int gpu_layers, int threads, int seed, int batch);
+LlamaCppSimple* llama_create_with_options(const char* model_path, const llama_load_options* options);
+LlamaCppSimple* llama_create_async(const char* model_path, const llama_load_options* options);
+int llama_is_ready(LlamaCppSimple* instance);   // 1 ready, 0 loading, -1 failed
+int llama_wait_ready(LlamaCppSimple* instance); // 1 ready, 0 failed
+int llama_get_startup_stats(LlamaCppSimple* instance, llama_startup_stats* stats);
+int llama_get_sched_stats(LlamaCppSimple* instance, llama_sched_stats* stats);
 void llama_destroy(LlamaCppSimple* instance);
 void* llama_get_context(LlamaCppSimple* instance);
 int llama_generate_text(LlamaCppSimple* instance, const char* prompt, int total_tokens);
+int llama_generate_text_with_params(LlamaCppSimple* instance, const char* prompt, int total_tokens, const llama_generate_params* params, llama_generate_result* result);
+llama_generate_params llama_generate_default_params(void);
+
+// Like llama_generate_text_with_params for a prompt that is already token
+// ids, BOS included if wanted. The ids are read in place.
+int llama_generate_tokens(LlamaCppSimple* instance, const int* tokens, int n_tokens, int max_new_tokens, const llama_generate_params* params, llama_generate_result* result);
+
+// Generates for many prompts in one call, decoding all live prompts together.
+// max_parallel caps concurrent sequences (0 = the load options' parallel, or
+// as many as the KV cache holds).
+// params applies to the whole call; returns 0 on success.
+// Calls take the context in priority order. Between decode steps a batch
+// lends it to waiting stateless requests of higher priority with the same
+// adapter: its live prompts give up their KV cells, the requests run, and
+// the cells are rebuilt from the prompts' tokens (cached prompt prefixes are
+// shared again). Session calls wait for the batch.
+int llama_generate_batch(LlamaCppSimple* instance, const llama_batch_request* requests, int n_requests, int max_parallel, const llama_generate_params* params, llama_batch_result* results);
+void llama_batch_results_free(llama_batch_result* results, int n_results);
+
+// Samples n completions of one prompt. The prompt is prefilled once and its
+// KV cells are shared by all n sequences. results holds n entries.
+int llama_generate_n(LlamaCppSimple* instance, const char* prompt, int max_new_tokens, int n, const llama_generate_params* params, llama_batch_result* results);
+
+// Log-probabilities of continuations given one shared context, whose KV
+// cells are computed once and reused by every continuation. continuations
+// holds the ids of all continuations back to back, counts[i] each; one
+// log-prob per continuation token is written to token_logprobs in the same
+// layout, and each continuation's sum to totals. Returns 0, or -1 on error
+// or when params' cancel token or deadline stopped it.
+int llama_score_tokens(LlamaCppSimple* instance, const int* context, int n_context, const int* continuations, const int* counts, int n_continuations, const llama_generate_params* params, float* token_logprobs, double* totals);
+// Text form: the context is tokenized with BOS, each continuation on its own
+// without. counts and totals are always filled; token_logprobs only when the
+// total token count fits in capacity. Returns that count, or -1.
+int llama_score_text(LlamaCppSimple* instance, const char* context, const char* const* continuations, int n_continuations, const llama_generate_params* params, float* token_logprobs, int capacity, int* counts, double* totals);
+
+// Cross-encoder reranking with the model as judge. The prefix (instructions
+// and query) is decoded once; each document gets a sequence sharing its
+// cells, and document plus suffix tokens of many documents are packed into
+// one batch, with logits only at each document's last position. scores[i]
+// is log p(yes) - log p(no) there, so sigmoid(score) is the relative chance
+// of yes. Documents are cut to fit the context. Returns 0, or -1 on error or
+// when params' cancel token or deadline stopped it.
+int llama_rerank_tokens(LlamaCppSimple* instance, const int* prefix, int n_prefix, const int* documents, const int* counts, int n_documents, const int* suffix, int n_suffix, int yes, int no, const llama_generate_params* params, float* scores);
+llama_rerank_options llama_rerank_default_options(void);
+// Text form. Each judge prompt is tokenized whole; the prefix and suffix
+// are the tokens all of them share. options may be NULL.
+int llama_rerank(LlamaCppSimple* instance, const char* query, const char* const* documents, int n_documents, const llama_rerank_options* options, const llama_generate_params* params, float* scores);
+
+// With prefix_cache set, prompts keep their KV cells after a request in a
+// radix tree, and later prompts (batch entries included) share the longest
+// cached prefix instead of prefilling it. Unused prefixes are evicted least
+// recently used first when cells are needed; this drops them all.
+void llama_prefix_cache_clear(LlamaCppSimple* instance);
+
+// Sessions keep their KV cells between calls, so each turn decodes only what
+// was added. Free every session before llama_destroy; a session must not be
+// used from two threads at once. Sessions evict cached prefixes for room like
+// other requests, and fail once the cells all sessions hold fill the cache.
+llama_session* llama_session_new(LlamaCppSimple* instance);
+void llama_session_free(llama_session* session);
+// A new session sharing the parent's decoded cells; nothing is recomputed.
+llama_session* llama_session_fork(const llama_session* session);
+// Appends return the history length, or -1. Text is tokenized with BOS when
+// the session is empty.
+int llama_session_append_text(llama_session* session, const char* text);
+int llama_session_append_tokens(llama_session* session, const int* tokens, int n_tokens);
+// Keeps the first n_tokens of the history.
+int llama_session_truncate(llama_session* session, int n_tokens);
+int llama_session_length(const llama_session* session);
+// Copies up to n_max history tokens; returns the history length.
+int llama_session_tokens(const llama_session* session, int* tokens, int n_max);
+// Generates from the history; generated tokens (not EOS) are appended. A
+// cancelled or expired call leaves the history unchanged.
+int llama_session_generate(llama_session* session, int max_new_tokens, const llama_generate_params* params, llama_generate_result* result);
+
+// llama.cpp merges LoRA adapters into the weights, so an instance has at
+// most one adapter bound at a time. Requests name theirs in
+// llama_generate_params.adapter and the binding merges it, unmerging the
+// previous one, when it differs; group requests by adapter to limit switches.
+// Unmerging restores the touched tensors from base_path when given (use it
+// with quantized models), else merges with the negated scale, which is only
+// lossless enough for f16/f32 weights. Switching drops the prefix cache.
+// Needs llama_load_options.lora. Returns NULL on failure.
+llama_adapter* llama_adapter_load(LlamaCppSimple* instance, const char* path, float scale, const char* base_path);
+// Unbinds the adapter if it is bound; may outlive its instance.
+void llama_adapter_free(llama_adapter* adapter);
+int llama_adapter_get_stats(const llama_adapter* adapter, llama_adapter_stats* stats);
+// Decodes the session under adapter (NULL = the base model). Only allowed
+// while the session is empty, since its cells depend on the weights; forks
+// keep the adapter. Returns 0 on success.
+int llama_session_set_adapter(llama_session* session, llama_adapter* adapter);
+
+// Token ids and every token of each string (tokenized like prompt text)
+// form the set. Returns NULL on failure.
+llama_token_mask* llama_token_mask_create(LlamaCppSimple* instance, llama_mask_mode mode, const int* tokens, int n_tokens, const char* const* strings, int n_strings);
+int llama_token_mask_add_bias(LlamaCppSimple* instance, llama_token_mask* mask, const int* tokens, int n_tokens, const char* const* strings, int n_strings, float bias);
+int llama_token_mask_size(const llama_token_mask* mask);
+void llama_token_mask_free(llama_token_mask* mask);
+
+// The instance's tokenizer, valid until llama_destroy; waits for loading and
+// returns NULL if it failed. Tokenizer calls are thread-safe.
+llama_tokenizer* llama_get_tokenizer(LlamaCppSimple* instance);
+
+// Tokenizes n_texts strings in parallel. text_lens may be NULL for
+// NUL-terminated texts. Ids are packed into tokens: text i starts at
+// offsets[i] and has counts[i] ids. Returns the total number of ids (-1 on
+// error); tokens is only written when that total fits in n_tokens_max, while
+// offsets and counts are always filled.
+int llama_tokenize_many(llama_tokenizer* tokenizer, const char* const* texts, const int* text_lens, int n_texts, bool add_bos, bool special, int* tokens, int n_tokens_max, int* offsets, int* counts);
+int llama_count_tokens_many(llama_tokenizer* tokenizer, const char* const* texts, const int* text_lens, int n_texts, bool add_bos, bool special, int* counts);
+// Inverse of llama_tokenize_many: sequence i is counts[i] ids read from the
+// packed tokens array; text is packed the same way (not NUL-terminated).
+int llama_detokenize_many(llama_tokenizer* tokenizer, const int* tokens, const int* counts, int n_seqs, char* text, int text_max, int* offsets, int* lengths);
+// Pins a fixed segment; texts equal to it are served from the cache. Returns
+// its token count.
+int llama_tokenizer_cache_add(llama_tokenizer* tokenizer, const char* text, bool add_bos, bool special);
+void llama_tokenizer_cache_clear(llama_tokenizer* tokenizer);
+
+// Loads only the vocabulary and metadata of a GGUF file (no weights), for
+// services that tokenize without generating. threads <= 0 uses all cores.
+llama_tokenizer* llama_tokenizer_load(const char* model_path, int threads);
+void llama_tokenizer_free(llama_tokenizer* tokenizer);
+int llama_tokenizer_metadata(llama_tokenizer* tokenizer, llama_model_metadata* metadata);
+// Raw GGUF metadata value, e.g. "general.name"; returns its length or -1.
+int llama_tokenizer_meta_str(llama_tokenizer* tokenizer, const char* key, char* buf, int buf_size);
+
+llama_cancel_token* llama_cancel_token_new(void);
+void llama_cancel_token_free(llama_cancel_token* token);
+void llama_cancel_token_cancel(llama_cancel_token* token);
+void llama_cancel_token_reset(llama_cancel_token* token);
+bool llama_cancel_token_is_cancelled(const llama_cancel_token* token);
 
 #ifdef __cplusplus
 }
@@ -5,6 +5,297 @@
 pub struct LlamaCppSimple {
     _unused: [u8; 0],
 }
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct llama_cancel_token {
+    _unused: [u8; 0],
+}
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct llama_token_mask {
+    _unused: [u8; 0],
+}
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct llama_tokenizer {
+    _unused: [u8; 0],
+}
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct llama_session {
+    _unused: [u8; 0],
+}
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct llama_adapter {
+    _unused: [u8; 0],
+}
+pub const llama_mask_mode_LLAMA_MASK_NONE: llama_mask_mode = 0;
+pub const llama_mask_mode_LLAMA_MASK_ALLOW: llama_mask_mode = 1;
+pub const llama_mask_mode_LLAMA_MASK_DENY: llama_mask_mode = 2;
+pub type llama_mask_mode = ::std::os::raw::c_uint;
+pub const llama_stop_reason_LLAMA_STOP_ERROR: llama_stop_reason = 0;
+pub const llama_stop_reason_LLAMA_STOP_EOS: llama_stop_reason = 1;
+pub const llama_stop_reason_LLAMA_STOP_LENGTH: llama_stop_reason = 2;
+pub const llama_stop_reason_LLAMA_STOP_SEQUENCE: llama_stop_reason = 3;
+pub const llama_stop_reason_LLAMA_STOP_DEADLINE: llama_stop_reason = 4;
+pub const llama_stop_reason_LLAMA_STOP_CANCELLED: llama_stop_reason = 5;
+pub const llama_stop_reason_LLAMA_STOP_CALLBACK: llama_stop_reason = 6;
+pub const llama_stop_reason_LLAMA_STOP_REJECTED: llama_stop_reason = 7;
+pub type llama_stop_reason = ::std::os::raw::c_uint;
+pub const LLAMA_MAX_TOP_LOGPROBS: u32 = 20;
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct llama_token_logprobs {
+    pub token: ::std::os::raw::c_int,
+    pub logprob: f32,
+    pub n_top: ::std::os::raw::c_int,
+    pub top_tokens: [::std::os::raw::c_int; 20usize],
+    pub top_logprobs: [f32; 20usize],
+}
+pub type llama_stream_fn = ::std::option::Option<
+    unsafe extern "C" fn(
+        bytes: *const ::std::os::raw::c_char,
+        len: ::std::os::raw::c_int,
+        user_data: *mut ::std::os::raw::c_void,
+    ) -> bool,
+>;
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct llama_generate_params {
+    pub cancel: *mut llama_cancel_token,
+    pub deadline_ms: f64,
+    pub ttft_deadline_ms: f64,
+    pub stop_sequences: *const *const ::std::os::raw::c_char,
+    pub n_stop_sequences: ::std::os::raw::c_int,
+    pub temperature: f32,
+    pub top_k: ::std::os::raw::c_int,
+    pub top_p: f32,
+    pub seed: ::std::os::raw::c_uint,
+    pub beam_width: ::std::os::raw::c_int,
+    pub length_penalty: f32,
+    pub repeat_penalty: f32,
+    pub repeat_last_n: ::std::os::raw::c_int,
+    pub frequency_penalty: f32,
+    pub presence_penalty: f32,
+    pub grammar: *const ::std::os::raw::c_char,
+    pub stream: llama_stream_fn,
+    pub stream_user_data: *mut ::std::os::raw::c_void,
+    pub top_logprobs: ::std::os::raw::c_int,
+    pub logprobs: *mut llama_token_logprobs,
+    pub logprobs_capacity: ::std::os::raw::c_int,
+    pub masks: *const *const llama_token_mask,
+    pub n_masks: ::std::os::raw::c_int,
+    pub adapter: *mut llama_adapter,
+    pub priority: ::std::os::raw::c_int,
+    pub pipelined: bool,
+}
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+pub struct llama_generate_result {
+    pub stop_reason: llama_stop_reason,
+    pub prompt_tokens: ::std::os::raw::c_int,
+    pub cached_tokens: ::std::os::raw::c_int,
+    pub generated_tokens: ::std::os::raw::c_int,
+    pub prefill_ms: f64,
+    pub ttft_ms: f64,
+    pub total_ms: f64,
+    pub grammar_ms: f64,
+    pub n_logprobs: ::std::os::raw::c_int,
+}
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct llama_batch_request {
+    pub prompt: *const ::std::os::raw::c_char,
+    pub max_new_tokens: ::std::os::raw::c_int,
+    pub tokens: *const ::std::os::raw::c_int,
+    pub n_tokens: ::std::os::raw::c_int,
+    pub stream: llama_stream_fn,
+    pub stream_user_data: *mut ::std::os::raw::c_void,
+}
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct llama_batch_result {
+    pub text: *mut ::std::os::raw::c_char,
+    pub text_len: ::std::os::raw::c_int,
+    pub stop_reason: llama_stop_reason,
+    pub prompt_tokens: ::std::os::raw::c_int,
+    pub cached_tokens: ::std::os::raw::c_int,
+    pub generated_tokens: ::std::os::raw::c_int,
+    pub prefill_ms: f64,
+    pub ttft_ms: f64,
+    pub total_ms: f64,
+    pub logprob: f64,
+}
+impl Default for llama_batch_result {
+    fn default() -> Self {
+        let mut s = ::std::mem::MaybeUninit::<Self>::uninit();
+        unsafe {
+            ::std::ptr::write_bytes(s.as_mut_ptr(), 0, 1);
+            s.assume_init()
+        }
+    }
+}
+pub type llama_progress_fn = ::std::option::Option<
+    unsafe extern "C" fn(progress: f32, user_data: *mut ::std::os::raw::c_void),
+>;
+pub const llama_kv_type_LLAMA_KV_F16: llama_kv_type = 0;
+pub const llama_kv_type_LLAMA_KV_Q8_0: llama_kv_type = 1;
+pub const llama_kv_type_LLAMA_KV_Q4_0: llama_kv_type = 2;
+pub type llama_kv_type = ::std::os::raw::c_uint;
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct llama_load_options {
+    pub context: ::std::os::raw::c_int,
+    pub gpu_layers: ::std::os::raw::c_int,
+    pub threads: ::std::os::raw::c_int,
+    pub seed: ::std::os::raw::c_int,
+    pub batch: ::std::os::raw::c_int,
+    pub prefetch: bool,
+    pub mlock: bool,
+    pub warmup: bool,
+    pub kv_type: llama_kv_type,
+    pub parallel: ::std::os::raw::c_int,
+    pub prefix_cache: bool,
+    pub lora: bool,
+    pub progress_callback: llama_progress_fn,
+    pub progress_user_data: *mut ::std::os::raw::c_void,
+}
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct llama_plan_request {
+    pub budget_bytes: f64,
+    pub min_ctx: ::std::os::raw::c_int,
+    pub max_ctx: ::std::os::raw::c_int,
+    pub max_parallel: ::std::os::raw::c_int,
+    pub batch: ::std::os::raw::c_int,
+    pub allow_quantized_kv: bool,
+}
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+pub struct llama_memory_plan {
+    pub n_ctx: ::std::os::raw::c_int,
+    pub n_parallel: ::std::os::raw::c_int,
+    pub kv_type: llama_kv_type,
+    pub weight_bytes: f64,
+    pub kv_bytes: f64,
+    pub compute_bytes: f64,
+    pub total_bytes: f64,
+    pub fits: bool,
+}
+pub const llama_quant_type_LLAMA_QUANT_F16: llama_quant_type = 0;
+pub const llama_quant_type_LLAMA_QUANT_Q4_0: llama_quant_type = 1;
+pub const llama_quant_type_LLAMA_QUANT_Q4_1: llama_quant_type = 2;
+pub const llama_quant_type_LLAMA_QUANT_Q5_0: llama_quant_type = 3;
+pub const llama_quant_type_LLAMA_QUANT_Q5_1: llama_quant_type = 4;
+pub const llama_quant_type_LLAMA_QUANT_Q8_0: llama_quant_type = 5;
+pub const llama_quant_type_LLAMA_QUANT_Q2_K: llama_quant_type = 6;
+pub const llama_quant_type_LLAMA_QUANT_Q3_K_S: llama_quant_type = 7;
+pub const llama_quant_type_LLAMA_QUANT_Q3_K_M: llama_quant_type = 8;
+pub const llama_quant_type_LLAMA_QUANT_Q3_K_L: llama_quant_type = 9;
+pub const llama_quant_type_LLAMA_QUANT_Q4_K_S: llama_quant_type = 10;
+pub const llama_quant_type_LLAMA_QUANT_Q4_K_M: llama_quant_type = 11;
+pub const llama_quant_type_LLAMA_QUANT_Q5_K_S: llama_quant_type = 12;
+pub const llama_quant_type_LLAMA_QUANT_Q5_K_M: llama_quant_type = 13;
+pub const llama_quant_type_LLAMA_QUANT_Q6_K: llama_quant_type = 14;
+pub type llama_quant_type = ::std::os::raw::c_uint;
+pub type llama_quantize_progress_fn = ::std::option::Option<
+    unsafe extern "C" fn(
+        done: ::std::os::raw::c_int,
+        total: ::std::os::raw::c_int,
+        tensor: *const ::std::os::raw::c_char,
+        user_data: *mut ::std::os::raw::c_void,
+    ),
+>;
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct llama_quantize_options {
+    pub type_: llama_quant_type,
+    pub threads: ::std::os::raw::c_int,
+    pub allow_requantize: bool,
+    pub quantize_output: bool,
+    pub progress: llama_quantize_progress_fn,
+    pub progress_user_data: *mut ::std::os::raw::c_void,
+}
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+pub struct llama_quantize_result {
+    pub n_tensors: ::std::os::raw::c_int,
+    pub input_bytes: f64,
+    pub output_bytes: f64,
+    pub total_ms: f64,
+}
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+pub struct llama_adapter_stats {
+    pub file_bytes: f64,
+    pub load_ms: f64,
+    pub last_apply_ms: f64,
+    pub apply_ms: f64,
+    pub applies: ::std::os::raw::c_int,
+}
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+pub struct llama_sched_stats {
+    pub preemptions: ::std::os::raw::c_int,
+    pub refilled_tokens: ::std::os::raw::c_int,
+    pub refill_ms: f64,
+    pub waiting: ::std::os::raw::c_int,
+}
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct llama_rerank_options {
+    pub instruction: *const ::std::os::raw::c_char,
+    pub document_prefix: *const ::std::os::raw::c_char,
+    pub suffix: *const ::std::os::raw::c_char,
+    pub yes: *const ::std::os::raw::c_char,
+    pub no: *const ::std::os::raw::c_char,
+    pub max_document_tokens: ::std::os::raw::c_int,
+}
+pub const llama_cpu_kernels_LLAMA_CPU_GENERIC: llama_cpu_kernels = 0;
+pub const llama_cpu_kernels_LLAMA_CPU_AVX2: llama_cpu_kernels = 1;
+pub const llama_cpu_kernels_LLAMA_CPU_AVX512: llama_cpu_kernels = 2;
+pub const llama_cpu_kernels_LLAMA_CPU_AVX512_VNNI: llama_cpu_kernels = 3;
+pub const llama_cpu_kernels_LLAMA_CPU_NEON: llama_cpu_kernels = 4;
+pub type llama_cpu_kernels = ::std::os::raw::c_uint;
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+pub struct llama_startup_stats {
+    pub backend_ms: f64,
+    pub prefetch_ms: f64,
+    pub load_ms: f64,
+    pub context_ms: f64,
+    pub warmup_ms: f64,
+    pub total_ms: f64,
+    pub cpu_kernels: llama_cpu_kernels,
+    pub cpu_dispatch: bool,
+}
+extern "C" {
+    pub fn llama_load_default_options() -> llama_load_options;
+}
+extern "C" {
+    pub fn llama_plan_default_request() -> llama_plan_request;
+}
+extern "C" {
+    pub fn llama_plan_memory(
+        model_path: *const ::std::os::raw::c_char,
+        request: *const llama_plan_request,
+        candidates: *mut llama_memory_plan,
+        n_candidates_max: ::std::os::raw::c_int,
+        chosen: *mut llama_memory_plan,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_quantize_default_options() -> llama_quantize_options;
+}
+extern "C" {
+    pub fn llama_quantize_model(
+        input_path: *const ::std::os::raw::c_char,
+        output_path: *const ::std::os::raw::c_char,
+        options: *const llama_quantize_options,
+        result: *mut llama_quantize_result,
+    ) -> ::std::os::raw::c_int;
+}
 extern "C" {
     pub fn llama_create(
         model_path: *const ::std::os::raw::c_char,
@@ -15,6 +306,36 @@ extern "C" {
         batch_size: ::std::os::raw::c_int,
     ) -> *mut LlamaCppSimple;
 }
+extern "C" {
+    pub fn llama_create_with_options(
+        model_path: *const ::std::os::raw::c_char,
+        options: *const llama_load_options,
+    ) -> *mut LlamaCppSimple;
+}
+extern "C" {
+    pub fn llama_create_async(
+        model_path: *const ::std::os::raw::c_char,
+        options: *const llama_load_options,
+    ) -> *mut LlamaCppSimple;
+}
+extern "C" {
+    pub fn llama_is_ready(instance: *mut LlamaCppSimple) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_wait_ready(instance: *mut LlamaCppSimple) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_get_startup_stats(
+        instance: *mut LlamaCppSimple,
+        stats: *mut llama_startup_stats,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_get_sched_stats(
+        instance: *mut LlamaCppSimple,
+        stats: *mut llama_sched_stats,
+    ) -> ::std::os::raw::c_int;
+}
 extern "C" {
     pub fn llama_destroy(instance: *mut LlamaCppSimple);
 }
@@ -28,3 +349,309 @@ extern "C" {
         total_tokens: ::std::os::raw::c_int,
     ) -> ::std::os::raw::c_int;
 }
+extern "C" {
+    pub fn llama_generate_tokens(
+        instance: *mut LlamaCppSimple,
+        tokens: *const ::std::os::raw::c_int,
+        n_tokens: ::std::os::raw::c_int,
+        max_new_tokens: ::std::os::raw::c_int,
+        params: *const llama_generate_params,
+        result: *mut llama_generate_result,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_generate_text_with_params(
+        instance: *mut LlamaCppSimple,
+        prompt: *const ::std::os::raw::c_char,
+        total_tokens: ::std::os::raw::c_int,
+        params: *const llama_generate_params,
+        result: *mut llama_generate_result,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_generate_default_params() -> llama_generate_params;
+}
+extern "C" {
+    pub fn llama_generate_batch(
+        instance: *mut LlamaCppSimple,
+        requests: *const llama_batch_request,
+        n_requests: ::std::os::raw::c_int,
+        max_parallel: ::std::os::raw::c_int,
+        params: *const llama_generate_params,
+        results: *mut llama_batch_result,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_batch_results_free(results: *mut llama_batch_result, n_results: ::std::os::raw::c_int);
+}
+extern "C" {
+    pub fn llama_generate_n(
+        instance: *mut LlamaCppSimple,
+        prompt: *const ::std::os::raw::c_char,
+        max_new_tokens: ::std::os::raw::c_int,
+        n: ::std::os::raw::c_int,
+        params: *const llama_generate_params,
+        results: *mut llama_batch_result,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_score_tokens(
+        instance: *mut LlamaCppSimple,
+        context: *const ::std::os::raw::c_int,
+        n_context: ::std::os::raw::c_int,
+        continuations: *const ::std::os::raw::c_int,
+        counts: *const ::std::os::raw::c_int,
+        n_continuations: ::std::os::raw::c_int,
+        params: *const llama_generate_params,
+        token_logprobs: *mut f32,
+        totals: *mut f64,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_score_text(
+        instance: *mut LlamaCppSimple,
+        context: *const ::std::os::raw::c_char,
+        continuations: *const *const ::std::os::raw::c_char,
+        n_continuations: ::std::os::raw::c_int,
+        params: *const llama_generate_params,
+        token_logprobs: *mut f32,
+        capacity: ::std::os::raw::c_int,
+        counts: *mut ::std::os::raw::c_int,
+        totals: *mut f64,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_rerank_tokens(
+        instance: *mut LlamaCppSimple,
+        prefix: *const ::std::os::raw::c_int,
+        n_prefix: ::std::os::raw::c_int,
+        documents: *const ::std::os::raw::c_int,
+        counts: *const ::std::os::raw::c_int,
+        n_documents: ::std::os::raw::c_int,
+        suffix: *const ::std::os::raw::c_int,
+        n_suffix: ::std::os::raw::c_int,
+        yes: ::std::os::raw::c_int,
+        no: ::std::os::raw::c_int,
+        params: *const llama_generate_params,
+        scores: *mut f32,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_rerank_default_options() -> llama_rerank_options;
+}
+extern "C" {
+    pub fn llama_rerank(
+        instance: *mut LlamaCppSimple,
+        query: *const ::std::os::raw::c_char,
+        documents: *const *const ::std::os::raw::c_char,
+        n_documents: ::std::os::raw::c_int,
+        options: *const llama_rerank_options,
+        params: *const llama_generate_params,
+        scores: *mut f32,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_prefix_cache_clear(instance: *mut LlamaCppSimple);
+}
+extern "C" {
+    pub fn llama_session_new(instance: *mut LlamaCppSimple) -> *mut llama_session;
+}
+extern "C" {
+    pub fn llama_session_free(session: *mut llama_session);
+}
+extern "C" {
+    pub fn llama_session_fork(session: *const llama_session) -> *mut llama_session;
+}
+extern "C" {
+    pub fn llama_adapter_load(
+        instance: *mut LlamaCppSimple,
+        path: *const ::std::os::raw::c_char,
+        scale: f32,
+        base_path: *const ::std::os::raw::c_char,
+    ) -> *mut llama_adapter;
+}
+extern "C" {
+    pub fn llama_adapter_free(adapter: *mut llama_adapter);
+}
+extern "C" {
+    pub fn llama_adapter_get_stats(
+        adapter: *const llama_adapter,
+        stats: *mut llama_adapter_stats,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_session_set_adapter(
+        session: *mut llama_session,
+        adapter: *mut llama_adapter,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_session_append_text(
+        session: *mut llama_session,
+        text: *const ::std::os::raw::c_char,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_session_append_tokens(
+        session: *mut llama_session,
+        tokens: *const ::std::os::raw::c_int,
+        n_tokens: ::std::os::raw::c_int,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_session_truncate(
+        session: *mut llama_session,
+        n_tokens: ::std::os::raw::c_int,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_session_length(session: *const llama_session) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_session_tokens(
+        session: *const llama_session,
+        tokens: *mut ::std::os::raw::c_int,
+        n_max: ::std::os::raw::c_int,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_session_generate(
+        session: *mut llama_session,
+        max_new_tokens: ::std::os::raw::c_int,
+        params: *const llama_generate_params,
+        result: *mut llama_generate_result,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_token_mask_create(
+        instance: *mut LlamaCppSimple,
+        mode: llama_mask_mode,
+        tokens: *const ::std::os::raw::c_int,
+        n_tokens: ::std::os::raw::c_int,
+        strings: *const *const ::std::os::raw::c_char,
+        n_strings: ::std::os::raw::c_int,
+    ) -> *mut llama_token_mask;
+}
+extern "C" {
+    pub fn llama_token_mask_add_bias(
+        instance: *mut LlamaCppSimple,
+        mask: *mut llama_token_mask,
+        tokens: *const ::std::os::raw::c_int,
+        n_tokens: ::std::os::raw::c_int,
+        strings: *const *const ::std::os::raw::c_char,
+        n_strings: ::std::os::raw::c_int,
+        bias: f32,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_token_mask_size(mask: *const llama_token_mask) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_token_mask_free(mask: *mut llama_token_mask);
+}
+extern "C" {
+    pub fn llama_get_tokenizer(instance: *mut LlamaCppSimple) -> *mut llama_tokenizer;
+}
+extern "C" {
+    pub fn llama_tokenize_many(
+        tokenizer: *mut llama_tokenizer,
+        texts: *const *const ::std::os::raw::c_char,
+        text_lens: *const ::std::os::raw::c_int,
+        n_texts: ::std::os::raw::c_int,
+        add_bos: bool,
+        special: bool,
+        tokens: *mut ::std::os::raw::c_int,
+        n_tokens_max: ::std::os::raw::c_int,
+        offsets: *mut ::std::os::raw::c_int,
+        counts: *mut ::std::os::raw::c_int,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_count_tokens_many(
+        tokenizer: *mut llama_tokenizer,
+        texts: *const *const ::std::os::raw::c_char,
+        text_lens: *const ::std::os::raw::c_int,
+        n_texts: ::std::os::raw::c_int,
+        add_bos: bool,
+        special: bool,
+        counts: *mut ::std::os::raw::c_int,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_detokenize_many(
+        tokenizer: *mut llama_tokenizer,
+        tokens: *const ::std::os::raw::c_int,
+        counts: *const ::std::os::raw::c_int,
+        n_seqs: ::std::os::raw::c_int,
+        text: *mut ::std::os::raw::c_char,
+        text_max: ::std::os::raw::c_int,
+        offsets: *mut ::std::os::raw::c_int,
+        lengths: *mut ::std::os::raw::c_int,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_tokenizer_cache_add(
+        tokenizer: *mut llama_tokenizer,
+        text: *const ::std::os::raw::c_char,
+        add_bos: bool,
+        special: bool,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_tokenizer_cache_clear(tokenizer: *mut llama_tokenizer);
+}
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct llama_model_metadata {
+    pub n_vocab: ::std::os::raw::c_int,
+    pub n_ctx_train: ::std::os::raw::c_int,
+    pub n_embd: ::std::os::raw::c_int,
+    pub vocab_type: ::std::os::raw::c_int,
+    pub bos: ::std::os::raw::c_int,
+    pub eos: ::std::os::raw::c_int,
+    pub nl: ::std::os::raw::c_int,
+    pub prefix: ::std::os::raw::c_int,
+    pub middle: ::std::os::raw::c_int,
+    pub suffix: ::std::os::raw::c_int,
+    pub eot: ::std::os::raw::c_int,
+    pub add_bos: ::std::os::raw::c_int,
+    pub desc: [::std::os::raw::c_char; 128usize],
+}
+extern "C" {
+    pub fn llama_tokenizer_load(
+        model_path: *const ::std::os::raw::c_char,
+        threads: ::std::os::raw::c_int,
+    ) -> *mut llama_tokenizer;
+}
+extern "C" {
+    pub fn llama_tokenizer_free(tokenizer: *mut llama_tokenizer);
+}
+extern "C" {
+    pub fn llama_tokenizer_metadata(
+        tokenizer: *mut llama_tokenizer,
+        metadata: *mut llama_model_metadata,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_tokenizer_meta_str(
+        tokenizer: *mut llama_tokenizer,
+        key: *const ::std::os::raw::c_char,
+        buf: *mut ::std::os::raw::c_char,
+        buf_size: ::std::os::raw::c_int,
+    ) -> ::std::os::raw::c_int;
+}
+extern "C" {
+    pub fn llama_cancel_token_new() -> *mut llama_cancel_token;
+}
+extern "C" {
+    pub fn llama_cancel_token_free(token: *mut llama_cancel_token);
+}
+extern "C" {
+    pub fn llama_cancel_token_cancel(token: *mut llama_cancel_token);
+}
+extern "C" {
+    pub fn llama_cancel_token_reset(token: *mut llama_cancel_token);
+}
+extern "C" {
+    pub fn llama_cancel_token_is_cancelled(token: *const llama_cancel_token) -> bool;
+}
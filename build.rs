@@ -3,6 +3,16 @@ use std::path::PathBuf;
 
 use cc::Build;
 
+// Instruction set levels ggml-quants.c is compiled for when the kernels are
+// dispatched at runtime, with the flags added to the x86-64 baseline.
+// ggml-dispatch.c selects one from cpuid; keep the names in sync with it.
+const CPU_KERNEL_LEVELS: [(&str, &str); 4] = [
+    ("generic", ""),
+    ("avx2", "-mavx -mavx2 -mfma -mf16c"),
+    ("avx512", "-mavx -mavx2 -mfma -mf16c -mavx512f -mavx512dq -mavx512bw -mavx512vl"),
+    ("avx512_vnni", "-mavx -mavx2 -mfma -mf16c -mavx512f -mavx512dq -mavx512bw -mavx512vl -mavx512vnni"),
+];
+
 fn compile_bindings(out_path: &PathBuf) {
     let bindings = bindgen::Builder::default()
         .header("./binding.h")
@@ -105,16 +115,60 @@ fn compile_cuda(cxx_flags: &str) {
         .compile("ggml-cuda");
 }
 
-fn compile_ggml(cx: &mut Build, cx_flags: &str) {
+// Compiles ggml-quants.c once per CPU_KERNEL_LEVELS entry, each copy with
+// its kernels renamed by ggml-dispatch-rename.h, and returns the objects.
+fn compile_ggml_kernels(cx_flags: &str, out_path: &PathBuf) -> Vec<PathBuf> {
+    let mut objects = Vec::new();
+
+    for (level, isa_flags) in CPU_KERNEL_LEVELS.iter() {
+        let level_out = out_path.join(format!("ggml-{}", level));
+        let mut kernels = cc::Build::new();
+
+        for flag in cx_flags.split_whitespace().chain(isa_flags.split_whitespace()) {
+            kernels.flag(flag);
+        }
+        if *level != "generic" {
+            // the generic copy keeps the scalar functions under their names
+            kernels.define("GGML_DISPATCH_RENAME_ALL", None);
+        }
+
+        kernels
+            .flag("-include")
+            .flag("./ggml-dispatch-rename.h")
+            .define("GGML_DISPATCH_SUFFIX", Some(format!("_{}", level).as_str()))
+            .include("./llama.cpp")
+            .file("./llama.cpp/ggml-quants.c")
+            .cpp(false)
+            .define("_GNU_SOURCE", None)
+            .define("GGML_USE_K_QUANTS", None)
+            .out_dir(&level_out)
+            .cargo_metadata(false)
+            .compile(&format!("ggml-quants-{}", level));
+
+        objects.push(level_out.join("llama.cpp/ggml-quants.o"));
+    }
+
+    objects
+}
+
+fn compile_ggml(cx: &mut Build, cx_flags: &str, out_path: &PathBuf, dispatch: bool) {
     for cx_flag in cx_flags.split_whitespace() {
         cx.flag(cx_flag);
     }
 
+    if dispatch {
+        for object in compile_ggml_kernels(cx_flags, out_path) {
+            cx.object(object);
+        }
+    } else {
+        cx.file("./llama.cpp/ggml-quants.c");
+    }
+
     cx.include("./llama.cpp")
         .file("./llama.cpp/ggml.c")
         .file("./llama.cpp/ggml-alloc.c")
         .file("./llama.cpp/ggml-backend.c")
-        .file("./llama.cpp/ggml-quants.c")
+        .file("./ggml-dispatch.c")
         .cpp(false)
         .define("_GNU_SOURCE", None)
         .define("GGML_USE_K_QUANTS", None)
@@ -151,6 +205,7 @@ fn compile_llama(cxx: &mut Build, cxx_flags: &str, out_path: &PathBuf, ggml_type
 
     cxx.shared_flag(true)
         .file("./llama.cpp/common/common.cpp")
+        .file("./llama.cpp/common/grammar-parser.cpp")
         .file("./llama.cpp/llama.cpp")
         .file("./binding.cpp")
         .cpp(true)
@@ -164,11 +219,26 @@ fn main() {
     let mut cx_flags = String::from("");
     let mut cxx_flags = String::from("");
 
+    // Without the native feature x86-64 builds target the baseline ISA and
+    // pick the quantized kernels at runtime, so one build runs on any CPU
+    // generation; other targets use their baseline (NEON on aarch64).
+    let unix = cfg!(target_os = "linux") || cfg!(target_os = "macos");
+    let dispatch = unix && cfg!(target_arch = "x86_64") && !cfg!(feature = "native");
+    let cpu_flags = if cfg!(feature = "native") {
+        " -march=native -mtune=native"
+    } else if dispatch {
+        " -march=x86-64 -mtune=generic -DGGML_DISPATCH"
+    } else {
+        ""
+    };
+
     // check if os is linux
     // if so, add -fPIC to cxx_flags
-    if cfg!(target_os = "linux") || cfg!(target_os = "macos") {
-        cx_flags.push_str(" -std=c11 -Wall -Wextra -Wpedantic -Wcast-qual -Wdouble-promotion -Wshadow -Wstrict-prototypes -Wpointer-arith -pthread -march=native -mtune=native");
-        cxx_flags.push_str(" -std=c++11 -Wall -Wdeprecated-declarations -Wunused-but-set-variable -Wextra -Wpedantic -Wcast-qual -Wno-unused-function -Wno-multichar -fPIC -pthread -march=native -mtune=native");
+    if unix {
+        cx_flags.push_str(" -std=c11 -Wall -Wextra -Wpedantic -Wcast-qual -Wdouble-promotion -Wshadow -Wstrict-prototypes -Wpointer-arith -pthread");
+        cxx_flags.push_str(" -std=c++11 -Wall -Wdeprecated-declarations -Wunused-but-set-variable -Wextra -Wpedantic -Wcast-qual -Wno-unused-function -Wno-multichar -fPIC -pthread");
+        cx_flags.push_str(cpu_flags);
+        cxx_flags.push_str(cpu_flags);
     } else if cfg!(target_os = "windows") {
         cx_flags.push_str(" /W4 /Wall /wd4820 /wd4710 /wd4711 /wd4820 /wd4514");
         cxx_flags.push_str(" /W4 /Wall /wd4820 /wd4710 /wd4711 /wd4820 /wd4514");
@@ -210,13 +280,13 @@ fn main() {
             cxx.include(format!("{}/targets/x86_64-linux/include", cuda_path));
         }
 
-        compile_ggml(&mut cx, &cx_flags);
+        compile_ggml(&mut cx, &cx_flags, &out_path, dispatch);
 
         compile_cuda(&cxx_flags);
 
         compile_llama(&mut cxx, &cxx_flags, &out_path, "cuda");
     } else {
-        compile_ggml(&mut cx, &cx_flags);
+        compile_ggml(&mut cx, &cx_flags, &out_path, dispatch);
 
         compile_llama(&mut cxx, &cxx_flags, &out_path, &ggml_type);
     }
@@ -1,13 +1,10 @@
-use llama_cpp_rs::{LlamaOptions, LlamaCppSimple};
+use llama_cpp_rs::{GenerateOptions, LlamaOptions, LlamaCppSimple};
 use strfmt::strfmt;
 use std::collections::HashMap;
-use std::sync::{Arc, Mutex};
 use std::io::{self, Write};
 
 
 fn main() {
-    let options = LlamaOptions::default();
-
     let llama = LlamaCppSimple::new(LlamaOptions {
         model_path: "models/orca-2-7b.Q4_0.gguf".to_string(),
         context: 2048,
@@ -24,45 +21,41 @@ fn main() {
     let promptfmt = "<|im_start|>system\n{system_message}<|im_end|>\n<|im_start|>user\n{user_message}<|im_end|>\n<|im_start|>assistant";
     let prompt = strfmt(&promptfmt,&vars).unwrap();
 
-    let total_tokens = 256;
-
-    let answer = Arc::new(Mutex::new(String::new()));
-    let answer_clone = Arc::clone(&answer);
+    let options = GenerateOptions::default();
+    let mut session = llama.session().unwrap();
+    session.append(&prompt).unwrap();
 
     println!("Start.");
 
-    let result = llama.generate_text(prompt.as_str(), total_tokens, Box::new(move |token_str| {
-        let mut answer = answer_clone.lock().unwrap();
-        answer.push_str(&token_str);
+    let mut answer = String::new();
+    session.generate(256, &options, |text| {
+        answer.push_str(text);
         true
-    }));
+    });
 
     println!("Done.");
-
-    let final_answer = answer.lock().unwrap();
-
-    println!("Answer was: {}", final_answer);
-    println!();
-    println!();
+    println!("Answer was: {}", answer);
     println!();
 
-    let prompt2_ = (&*final_answer).to_string() + "<|im_end|>\n<|im_start|>user\nGive me a list of the key points of your first answer.<|im_end|>\n<|im_start|>assistant";
-    let prompt2 = "<|im_start|>assistant\nThere are different ways to determine if a restaurant is popular among locals or mainly attracts tourists, and one possible reason why this information might be useful is to avoid overpriced or low-quality food. Here are some possible steps to find this information:\n\n- Look for online reviews from locals or travel blogs that mention the restaurant and its food, service, and atmosphere. These can give you an idea of how the restaurant is perceived by the local community and what they like or dislike about it.\n- Check the restaurant's website or social media pages for any information about their target audience, location, or specialties. These can indicate whether the<|im_end|>\n<|im_start|>user\nGive me a list of the key points of your first answer.<|im_end|>\n<|im_start|>assistant";
+    // the session already holds the first turn, so only the new one is decoded
+    session.append("<|im_end|>\n<|im_start|>user\nGive me a list of the key points of your first answer.<|im_end|>\n<|im_start|>assistant").unwrap();
 
-    println!("Prompt2_: {}", prompt2_);
-    println!();
-    println!();
-    println!("Prompt2: {}", prompt2);
+    // fork before answering so the follow-up can be retried from the same point
+    let mut retry = session.fork().unwrap();
 
-    println!();
+    session.generate(256, &options, |text| {
+        print!("{}", text);
+        io::stdout().flush().unwrap();
+        true
+    });
     println!();
     println!();
 
-    let result2 = llama.generate_text(prompt2_.as_str(), 256, Box::new(move |token| {
-        print!("{}", token);
+    let creative = GenerateOptions { temperature: 0.8, ..Default::default() };
+    retry.generate(256, &creative, |text| {
+        print!("{}", text);
         io::stdout().flush().unwrap();
-        false
-    }));
+        true
+    });
+    println!();
 }
-
-
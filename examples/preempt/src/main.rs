@@ -0,0 +1,95 @@
+//! Checks that preempting a batch does not change its output: runs a greedy
+//! `generate_batch` alone, then again while a higher-priority request takes
+//! the context partway through, and compares the texts. Exits with status 1
+//! when they differ or no preemption happened.
+
+use llama_cpp_rs::{BatchEvent, BatchPrompt, GenerateOptions, LlamaCppSimple, LlamaOptions, Prompt};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::time::Duration;
+
+const PROMPTS: [&str; 4] = [
+    "The three primary colors are",
+    "A short poem about the sea:\n",
+    "def fibonacci(n):\n",
+    "The capital of France is",
+];
+
+fn main() {
+    let mut args = std::env::args().skip(1);
+    let model = match args.next() {
+        Some(model) => model,
+        None => {
+            eprintln!("usage: llama_preempt <model> [--prefix-cache]");
+            std::process::exit(2);
+        }
+    };
+    let prefix_cache = args.any(|arg| arg == "--prefix-cache");
+
+    let llama = LlamaCppSimple::new(LlamaOptions {
+        model_path: model,
+        context: 2048,
+        gpu_layers: 0,
+        prefix_cache,
+        ..Default::default()
+    })
+    .expect("failed to load the model");
+
+    let prompts: Vec<BatchPrompt> = PROMPTS
+        .iter()
+        .map(|prompt| BatchPrompt { prompt: prompt.to_string(), max_new_tokens: 48, tokens: None })
+        .collect();
+    // greedy, so both runs pick the same tokens
+    let options = GenerateOptions { temperature: 0.0, ..Default::default() };
+
+    let alone = llama.generate_batch(&prompts, 4, &options).expect("batch failed");
+
+    let preemptions_before = llama.sched_stats().preemptions;
+    let guest_started = AtomicBool::new(false);
+    let preempted = std::thread::scope(|scope| {
+        scope.spawn(|| {
+            while !guest_started.load(Ordering::Acquire) {
+                std::thread::sleep(Duration::from_millis(1));
+            }
+            let urgent = GenerateOptions { temperature: 0.0, priority: 1, ..Default::default() };
+            llama.generate_stream(Prompt::Text("Write a long story about a dragon."), 64, &urgent, |_| true);
+        });
+        let mut waited = false;
+        llama.generate_batch_stream(&prompts, 4, &options, |_, event| {
+            if let BatchEvent::Text(_) = event {
+                if !waited {
+                    // hold the context until the urgent request queues, so the
+                    // next decode step lends it
+                    waited = true;
+                    guest_started.store(true, Ordering::Release);
+                    while llama.sched_stats().waiting == 0 {
+                        std::thread::sleep(Duration::from_millis(1));
+                    }
+                }
+            }
+            true
+        })
+    })
+    .expect("preempted batch failed");
+    let stats = llama.sched_stats();
+
+    let mut ok = stats.preemptions > preemptions_before;
+    if !ok {
+        eprintln!("the batch was not preempted");
+    }
+    for (i, (a, b)) in alone.iter().zip(preempted.iter()).enumerate() {
+        if a.text != b.text {
+            eprintln!("prompt {} differs:\n  alone:     {:?}\n  preempted: {:?}", i, a.text, b.text);
+            ok = false;
+        }
+    }
+    println!(
+        "preemptions: {}, refilled tokens: {} in {:.1} ms",
+        stats.preemptions - preemptions_before,
+        stats.refilled_tokens,
+        stats.refill_ms
+    );
+    if !ok {
+        std::process::exit(1);
+    }
+    println!("preempted output matches");
+}
@@ -0,0 +1,122 @@
+//! Just enough HTTP/1.1 for the OpenAI endpoints: one request at a time per
+//! connection, Content-Length bodies and server-sent events.
+
+use tokio::io::{AsyncBufReadExt, AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt, BufReader};
+
+const MAX_HEADER_BYTES: usize = 16 * 1024;
+const MAX_BODY_BYTES: usize = 4 * 1024 * 1024;
+
+pub struct Request {
+    pub method: String,
+    pub path: String,
+    pub body: Vec<u8>,
+    pub keep_alive: bool,
+}
+
+pub enum ReadError {
+    /// The peer closed the connection between requests.
+    Closed,
+    /// Malformed or oversized; answered with this status, then closed.
+    Bad(u16),
+    Io,
+}
+
+/// Reads the next request; the stream stays positioned at the one after it.
+pub async fn read_request<S: AsyncRead + AsyncWrite + Unpin>(
+    stream: &mut BufReader<S>,
+) -> Result<Request, ReadError> {
+    let mut line = String::new();
+    let mut header_bytes = 0;
+    if stream.read_line(&mut line).await.map_err(|_| ReadError::Io)? == 0 {
+        return Err(ReadError::Closed);
+    }
+    let mut parts = line.split_whitespace();
+    let (method, target, version) = match (parts.next(), parts.next(), parts.next()) {
+        (Some(m), Some(t), Some(v)) => (m.to_string(), t.to_string(), v.to_string()),
+        _ => return Err(ReadError::Bad(400)),
+    };
+    let path = target.split('?').next().unwrap_or("").to_string();
+
+    let mut content_length = 0usize;
+    let mut keep_alive = version == "HTTP/1.1";
+    loop {
+        line.clear();
+        let n = stream.read_line(&mut line).await.map_err(|_| ReadError::Io)?;
+        header_bytes += n;
+        if n == 0 || header_bytes > MAX_HEADER_BYTES {
+            return Err(ReadError::Bad(431));
+        }
+        let header = line.trim_end();
+        if header.is_empty() {
+            break;
+        }
+        let (name, value) = match header.split_once(':') {
+            Some((name, value)) => (name.trim().to_ascii_lowercase(), value.trim()),
+            None => return Err(ReadError::Bad(400)),
+        };
+        match name.as_str() {
+            "content-length" => content_length = value.parse().map_err(|_| ReadError::Bad(400))?,
+            "connection" => keep_alive = !value.eq_ignore_ascii_case("close"),
+            "transfer-encoding" => return Err(ReadError::Bad(501)),
+            _ => {}
+        }
+    }
+    if content_length > MAX_BODY_BYTES {
+        return Err(ReadError::Bad(413));
+    }
+
+    let mut body = vec![0; content_length];
+    stream.read_exact(&mut body).await.map_err(|_| ReadError::Io)?;
+    Ok(Request { method, path, body, keep_alive })
+}
+
+fn reason(status: u16) -> &'static str {
+    match status {
+        200 => "OK",
+        400 => "Bad Request",
+        404 => "Not Found",
+        405 => "Method Not Allowed",
+        413 => "Payload Too Large",
+        431 => "Request Header Fields Too Large",
+        500 => "Internal Server Error",
+        501 => "Not Implemented",
+        503 => "Service Unavailable",
+        _ => "Unknown",
+    }
+}
+
+pub async fn write_response<W: AsyncWrite + Unpin>(
+    stream: &mut W,
+    status: u16,
+    content_type: &str,
+    body: &[u8],
+    keep_alive: bool,
+) -> std::io::Result<()> {
+    let head = format!(
+        "HTTP/1.1 {} {}\r\nContent-Type: {}\r\nContent-Length: {}\r\nConnection: {}\r\n\r\n",
+        status,
+        reason(status),
+        content_type,
+        body.len(),
+        if keep_alive { "keep-alive" } else { "close" },
+    );
+    stream.write_all(head.as_bytes()).await?;
+    stream.write_all(body).await?;
+    stream.flush().await
+}
+
+/// Starts an event stream; the connection is closed after it.
+pub async fn write_sse_head<W: AsyncWrite + Unpin>(stream: &mut W) -> std::io::Result<()> {
+    stream
+        .write_all(
+            b"HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n",
+        )
+        .await?;
+    stream.flush().await
+}
+
+pub async fn write_sse_data<W: AsyncWrite + Unpin>(stream: &mut W, data: &str) -> std::io::Result<()> {
+    let event = format!("data: {}\n\n", data);
+    stream.write_all(event.as_bytes()).await?;
+    stream.flush().await
+}
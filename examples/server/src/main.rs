@@ -0,0 +1,379 @@
+//! A local OpenAI-compatible server: `/v1/completions` and
+//! `/v1/chat/completions`, streamed as server-sent events when asked, over
+//! TCP or a Unix socket. All connections share one model; the scheduler
+//! decodes concurrent requests together. LoRA adapters given with `--lora`
+//! are served as extra models on the same weights.
+
+mod http;
+mod scheduler;
+
+use http::{read_request, write_response, write_sse_data, write_sse_head, ReadError, Request};
+use llama_cpp_rs::{BatchOutput, LlamaCppSimple, LlamaOptions, StopReason};
+use scheduler::{Event, Job, Sampling, Scheduler};
+use serde::Deserialize;
+use serde_json::{json, Value};
+use std::collections::HashMap;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::{SystemTime, UNIX_EPOCH};
+use tokio::io::{AsyncRead, AsyncWrite, BufReader};
+
+struct Args {
+    model: String,
+    context: i32,
+    parallel: usize,
+    threads: i32,
+    batch: i32,
+    queue: usize,
+    gpu_layers: i32,
+    prefix_cache: bool,
+    /// (name, adapter path)
+    loras: Vec<(String, String)>,
+    lora_base: Option<String>,
+    listen: String,
+    unix: Option<String>,
+}
+
+const USAGE: &str = "usage: llama_server --model <path> [--ctx 4096] [--parallel 4] [--threads 4] \
+[--batch 512] [--queue 64] [--gpu-layers 0] [--prefix-cache] [--lora <name>=<path>]... [--lora-base <f16 model>] \
+[--listen 127.0.0.1:8080 | --unix <path>]";
+
+fn parse_args() -> Result<Args, String> {
+    let mut args = Args {
+        model: String::new(),
+        context: 4096,
+        parallel: 4,
+        threads: 4,
+        batch: 512,
+        queue: 64,
+        gpu_layers: 0,
+        prefix_cache: false,
+        loras: Vec::new(),
+        lora_base: None,
+        listen: "127.0.0.1:8080".to_string(),
+        unix: None,
+    };
+    let mut it = std::env::args().skip(1);
+    while let Some(flag) = it.next() {
+        if flag == "--prefix-cache" {
+            args.prefix_cache = true;
+            continue;
+        }
+        let value = it.next().ok_or_else(|| format!("{} needs a value", flag))?;
+        let number = |v: &str| v.parse::<i64>().map_err(|_| format!("{}: not a number: {}", flag, v));
+        match flag.as_str() {
+            "--model" => args.model = value,
+            "--ctx" => args.context = number(&value)? as i32,
+            "--parallel" => args.parallel = number(&value)?.max(1) as usize,
+            "--threads" => args.threads = number(&value)? as i32,
+            "--batch" => args.batch = number(&value)? as i32,
+            "--queue" => args.queue = number(&value)?.max(1) as usize,
+            "--gpu-layers" => args.gpu_layers = number(&value)? as i32,
+            "--lora" => match value.split_once('=') {
+                Some((name, path)) => args.loras.push((name.to_string(), path.to_string())),
+                None => return Err(format!("--lora: expected <name>=<path>, got {}", value)),
+            },
+            "--lora-base" => args.lora_base = Some(value),
+            "--listen" => args.listen = value,
+            "--unix" => args.unix = Some(value),
+            _ => return Err(format!("unknown option {}", flag)),
+        }
+    }
+    if args.model.is_empty() {
+        return Err("--model is required".to_string());
+    }
+    Ok(args)
+}
+
+struct Server {
+    scheduler: Arc<Scheduler>,
+    model_name: String,
+    next_id: AtomicU64,
+}
+
+#[tokio::main]
+async fn main() {
+    let args = match parse_args() {
+        Ok(args) => args,
+        Err(message) => {
+            eprintln!("{}\n{}", message, USAGE);
+            std::process::exit(2);
+        }
+    };
+
+    let llama = LlamaCppSimple::new(LlamaOptions {
+        model_path: args.model.clone(),
+        context: args.context,
+        gpu_layers: args.gpu_layers,
+        threads: args.threads,
+        batch_size: args.batch,
+        parallel: args.parallel as i32,
+        prefix_cache: args.prefix_cache,
+        lora: !args.loras.is_empty(),
+        ..Default::default()
+    })
+    .expect("failed to load the model");
+    let mut adapters = HashMap::new();
+    for (name, path) in &args.loras {
+        let adapter = llama
+            .load_adapter(path, 1.0, args.lora_base.as_deref())
+            .unwrap_or_else(|| panic!("failed to load the LoRA adapter {}", path));
+        eprintln!("adapter {}: {} MiB in {:.0} ms", name, adapter.stats().file_bytes >> 20, adapter.stats().load_ms);
+        adapters.insert(name.clone(), adapter);
+    }
+    let model_name = std::path::Path::new(&args.model)
+        .file_stem()
+        .map(|s| s.to_string_lossy().into_owned())
+        .unwrap_or_else(|| args.model.clone());
+
+    let server = Arc::new(Server {
+        scheduler: Scheduler::start(Arc::new(llama), adapters, args.parallel, args.queue),
+        model_name,
+        next_id: AtomicU64::new(1),
+    });
+
+    #[cfg(unix)]
+    if let Some(path) = &args.unix {
+        let _ = std::fs::remove_file(path);
+        let listener = tokio::net::UnixListener::bind(path).expect("failed to bind the socket");
+        eprintln!("listening on {}", path);
+        loop {
+            let (stream, _) = match listener.accept().await {
+                Ok(accepted) => accepted,
+                Err(_) => continue,
+            };
+            tokio::spawn(serve_connection(server.clone(), stream));
+        }
+    }
+
+    let listener = tokio::net::TcpListener::bind(&args.listen).await.expect("failed to bind the address");
+    eprintln!("listening on http://{}", args.listen);
+    loop {
+        let (stream, _) = match listener.accept().await {
+            Ok(accepted) => accepted,
+            Err(_) => continue,
+        };
+        let _ = stream.set_nodelay(true);
+        tokio::spawn(serve_connection(server.clone(), stream));
+    }
+}
+
+async fn serve_connection<S: AsyncRead + AsyncWrite + Unpin>(server: Arc<Server>, stream: S) {
+    let mut stream = BufReader::new(stream);
+    loop {
+        let request = match read_request(&mut stream).await {
+            Ok(request) => request,
+            Err(ReadError::Bad(status)) => {
+                let body = error_body(&format!("bad request ({})", status));
+                let _ = write_response(&mut stream, status, "application/json", &body, false).await;
+                return;
+            }
+            Err(ReadError::Closed) | Err(ReadError::Io) => return,
+        };
+        match route(&server, &request, &mut stream).await {
+            Ok(true) if request.keep_alive => continue,
+            _ => return,
+        }
+    }
+}
+
+/// Answers one request; Ok(false) when the connection must close after it.
+async fn route<W: AsyncWrite + Unpin>(server: &Server, request: &Request, stream: &mut W) -> std::io::Result<bool> {
+    let keep_alive = request.keep_alive;
+    let (status, body) = match (request.method.as_str(), request.path.as_str()) {
+        ("POST", "/v1/completions") => return completion(server, request, stream, false).await,
+        ("POST", "/v1/chat/completions") => return completion(server, request, stream, true).await,
+        ("GET", "/v1/models") => {
+            let mut data = vec![json!({"id": server.model_name, "object": "model", "owned_by": "local"})];
+            for name in server.scheduler.adapter_names() {
+                data.push(json!({"id": name, "object": "model", "owned_by": "local", "parent": server.model_name}));
+            }
+            let models = json!({"object": "list", "data": data});
+            (200, models.to_string().into_bytes())
+        }
+        ("GET", "/metrics") => {
+            let text = server.scheduler.render_metrics();
+            write_response(stream, 200, "text/plain; version=0.0.4", text.as_bytes(), keep_alive).await?;
+            return Ok(true);
+        }
+        ("GET", "/health") => (200, json!({"status": "ok"}).to_string().into_bytes()),
+        (_, "/v1/completions") | (_, "/v1/chat/completions") => (405, error_body("use POST")),
+        _ => (404, error_body("not found")),
+    };
+    write_response(stream, status, "application/json", &body, keep_alive).await?;
+    Ok(true)
+}
+
+fn error_body(message: &str) -> Vec<u8> {
+    json!({"error": {"message": message, "type": "invalid_request_error"}})
+        .to_string()
+        .into_bytes()
+}
+
+#[derive(Deserialize)]
+#[serde(untagged)]
+enum Stop {
+    One(String),
+    Many(Vec<String>),
+}
+
+#[derive(Deserialize)]
+struct Message {
+    role: String,
+    content: String,
+}
+
+#[derive(Deserialize)]
+struct CompletionRequest {
+    /// An adapter name selects that adapter; anything else the base model.
+    model: Option<String>,
+    prompt: Option<String>,
+    messages: Option<Vec<Message>>,
+    max_tokens: Option<i32>,
+    temperature: Option<f32>,
+    top_p: Option<f32>,
+    top_k: Option<i32>,
+    seed: Option<u32>,
+    stop: Option<Stop>,
+    #[serde(default)]
+    stream: bool,
+}
+
+/// ChatML, the template most local chat models are tuned on.
+fn chat_prompt(messages: &[Message]) -> String {
+    let mut prompt = String::new();
+    for message in messages {
+        prompt.push_str(&format!("<|im_start|>{}\n{}<|im_end|>\n", message.role, message.content));
+    }
+    prompt.push_str("<|im_start|>assistant\n");
+    prompt
+}
+
+fn finish_reason(reason: StopReason) -> &'static str {
+    match reason {
+        StopReason::Length => "length",
+        _ => "stop",
+    }
+}
+
+fn usage(output: &BatchOutput) -> Value {
+    json!({
+        "prompt_tokens": output.prompt_tokens,
+        "completion_tokens": output.generated_tokens,
+        "total_tokens": output.prompt_tokens + output.generated_tokens,
+    })
+}
+
+async fn completion<W: AsyncWrite + Unpin>(
+    server: &Server,
+    request: &Request,
+    stream: &mut W,
+    chat: bool,
+) -> std::io::Result<bool> {
+    let keep_alive = request.keep_alive;
+    let parsed: CompletionRequest = match serde_json::from_slice(&request.body) {
+        Ok(parsed) => parsed,
+        Err(e) => {
+            write_response(stream, 400, "application/json", &error_body(&e.to_string()), keep_alive).await?;
+            return Ok(true);
+        }
+    };
+    let mut stop = match parsed.stop {
+        Some(Stop::One(s)) => vec![s],
+        Some(Stop::Many(v)) => v,
+        None => Vec::new(),
+    };
+    let prompt = if chat {
+        stop.push("<|im_end|>".to_string());
+        parsed.messages.as_deref().map(chat_prompt)
+    } else {
+        parsed.prompt
+    };
+    let prompt = match prompt {
+        Some(prompt) => prompt,
+        None => {
+            let missing = if chat { "messages is required" } else { "prompt is required" };
+            write_response(stream, 400, "application/json", &error_body(missing), keep_alive).await?;
+            return Ok(true);
+        }
+    };
+    let sampling = Sampling {
+        temperature: parsed.temperature.unwrap_or(1.0),
+        top_p: parsed.top_p.unwrap_or(1.0),
+        top_k: parsed.top_k.unwrap_or(0),
+        seed: parsed.seed.unwrap_or(0),
+        stop,
+    };
+
+    let adapter = parsed.model.filter(|name| server.scheduler.has_adapter(name));
+    let model_name = adapter.clone().unwrap_or_else(|| server.model_name.clone());
+    let max_tokens = parsed.max_tokens.unwrap_or(if chat { 512 } else { 16 });
+    let (job, mut events) = Job::new(prompt, max_tokens, sampling, adapter);
+    if server.scheduler.submit(job).is_err() {
+        write_response(stream, 503, "application/json", &error_body("queue is full"), keep_alive).await?;
+        return Ok(true);
+    }
+
+    let id = format!(
+        "{}-{}",
+        if chat { "chatcmpl" } else { "cmpl" },
+        server.next_id.fetch_add(1, Ordering::Relaxed)
+    );
+    let created = SystemTime::now().duration_since(UNIX_EPOCH).map(|d| d.as_secs()).unwrap_or(0);
+    let object = match (chat, parsed.stream) {
+        (true, true) => "chat.completion.chunk",
+        (true, false) => "chat.completion",
+        (false, _) => "text_completion",
+    };
+    let chunk = |text: Option<&str>, finish: Option<&str>| {
+        let choice = if chat {
+            let delta = match text {
+                Some(text) => json!({"role": "assistant", "content": text}),
+                None => json!({}),
+            };
+            json!({"index": 0, "delta": delta, "finish_reason": finish})
+        } else {
+            json!({"index": 0, "text": text.unwrap_or(""), "logprobs": null, "finish_reason": finish})
+        };
+        json!({"id": id, "object": object, "created": created, "model": model_name, "choices": [choice]})
+    };
+
+    if !parsed.stream {
+        // dropping `events` on a write error stops the job
+        while let Some(event) = events.recv().await {
+            if let Event::Done(output) = event {
+                if output.stop_reason == StopReason::Error {
+                    break;
+                }
+                let choice = if chat {
+                    json!({"index": 0, "message": {"role": "assistant", "content": output.text}, "finish_reason": finish_reason(output.stop_reason)})
+                } else {
+                    json!({"index": 0, "text": output.text, "logprobs": null, "finish_reason": finish_reason(output.stop_reason)})
+                };
+                let body = json!({
+                    "id": id, "object": object, "created": created, "model": model_name,
+                    "choices": [choice], "usage": usage(&output),
+                });
+                write_response(stream, 200, "application/json", body.to_string().as_bytes(), keep_alive).await?;
+                return Ok(true);
+            }
+        }
+        write_response(stream, 500, "application/json", &error_body("generation failed"), keep_alive).await?;
+        return Ok(true);
+    }
+
+    write_sse_head(stream).await?;
+    while let Some(event) = events.recv().await {
+        match event {
+            Event::Text(text) => write_sse_data(stream, &chunk(Some(&text), None).to_string()).await?,
+            Event::Done(output) => {
+                let mut last = chunk(None, Some(finish_reason(output.stop_reason)));
+                last["usage"] = usage(&output);
+                write_sse_data(stream, &last.to_string()).await?;
+                break;
+            }
+        }
+    }
+    write_sse_data(stream, "[DONE]").await?;
+    Ok(false)
+}
@@ -0,0 +1,267 @@
+//! Runs queued requests on the shared model. One thread owns generation:
+//! it takes up to `parallel` queued requests that sample the same way and
+//! use the same LoRA adapter, and decodes them together with
+//! `generate_batch_stream`, sending each one's text to its connection as it
+//! is produced.
+
+use llama_cpp_rs::{Adapter, BatchEvent, BatchOutput, BatchPrompt, GenerateOptions, LlamaCppSimple, StopReason};
+use std::collections::{HashMap, VecDeque};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Condvar, Mutex};
+use std::time::Instant;
+use tokio::sync::mpsc;
+
+/// Sampling settings; only requests with equal settings share a batch,
+/// since `generate_batch` applies one set to the whole call.
+#[derive(Debug, Clone, PartialEq)]
+pub struct Sampling {
+    pub temperature: f32,
+    pub top_p: f32,
+    pub top_k: i32,
+    pub seed: u32,
+    pub stop: Vec<String>,
+}
+
+impl Sampling {
+    fn options(&self) -> GenerateOptions {
+        GenerateOptions {
+            temperature: self.temperature,
+            top_p: self.top_p,
+            top_k: self.top_k,
+            seed: self.seed,
+            stop_sequences: self.stop.clone(),
+            ..Default::default()
+        }
+    }
+}
+
+pub enum Event {
+    Text(String),
+    Done(BatchOutput),
+}
+
+pub struct Job {
+    pub prompt: String,
+    pub max_tokens: i32,
+    pub sampling: Sampling,
+    /// Name of a LoRA adapter given to `Scheduler::start`; `None` is the
+    /// base model.
+    pub adapter: Option<String>,
+    /// Dropped by the connection when the client goes away, which stops the
+    /// job at its next token.
+    pub events: mpsc::UnboundedSender<Event>,
+    queued: Instant,
+}
+
+impl Job {
+    pub fn new(
+        prompt: String,
+        max_tokens: i32,
+        sampling: Sampling,
+        adapter: Option<String>,
+    ) -> (Job, mpsc::UnboundedReceiver<Event>) {
+        let (events, receiver) = mpsc::unbounded_channel();
+        let job = Job {
+            prompt,
+            max_tokens,
+            sampling,
+            adapter,
+            events,
+            queued: Instant::now(),
+        };
+        (job, receiver)
+    }
+}
+
+#[derive(Default)]
+pub struct Metrics {
+    pub requests: AtomicU64,
+    pub rejected: AtomicU64,
+    pub failed: AtomicU64,
+    pub running: AtomicU64,
+    pub batches: AtomicU64,
+    pub adapter_switches: AtomicU64,
+    pub prompt_tokens: AtomicU64,
+    pub cached_tokens: AtomicU64,
+    pub generated_tokens: AtomicU64,
+    queue_us: AtomicU64,
+    ttft_us: AtomicU64,
+    ttft_count: AtomicU64,
+    generate_us: AtomicU64,
+}
+
+pub struct Scheduler {
+    queue: Mutex<VecDeque<Job>>,
+    ready: Condvar,
+    capacity: usize,
+    parallel: usize,
+    adapters: HashMap<String, Adapter>,
+    pub metrics: Metrics,
+}
+
+impl Scheduler {
+    /// Starts the generation thread; `capacity` bounds the waiting requests.
+    pub fn start(
+        llama: Arc<LlamaCppSimple>,
+        adapters: HashMap<String, Adapter>,
+        parallel: usize,
+        capacity: usize,
+    ) -> Arc<Scheduler> {
+        let scheduler = Arc::new(Scheduler {
+            queue: Mutex::new(VecDeque::new()),
+            ready: Condvar::new(),
+            capacity,
+            parallel: parallel.max(1),
+            adapters,
+            metrics: Metrics::default(),
+        });
+        let worker = scheduler.clone();
+        std::thread::Builder::new()
+            .name("generate".to_string())
+            .spawn(move || worker.run(&llama))
+            .expect("failed to start the generation thread");
+        scheduler
+    }
+
+    /// Queues a job, or hands it back if the queue is full.
+    pub fn submit(&self, job: Job) -> Result<(), Job> {
+        let mut queue = self.queue.lock().unwrap();
+        if queue.len() >= self.capacity {
+            self.metrics.rejected.fetch_add(1, Ordering::Relaxed);
+            return Err(job);
+        }
+        self.metrics.requests.fetch_add(1, Ordering::Relaxed);
+        queue.push_back(job);
+        self.ready.notify_one();
+        Ok(())
+    }
+
+    pub fn has_adapter(&self, name: &str) -> bool {
+        self.adapters.contains_key(name)
+    }
+
+    pub fn adapter_names(&self) -> Vec<String> {
+        let mut names: Vec<String> = self.adapters.keys().cloned().collect();
+        names.sort();
+        names
+    }
+
+    pub fn queued(&self) -> usize {
+        self.queue.lock().unwrap().len()
+    }
+
+    /// The oldest queued job plus younger ones with the same sampling and
+    /// adapter, up to `parallel`; jobs whose client has gone are dropped.
+    fn next_wave(&self) -> Vec<Job> {
+        let mut queue = self.queue.lock().unwrap();
+        loop {
+            queue.retain(|job| !job.events.is_closed());
+            if !queue.is_empty() {
+                break;
+            }
+            queue = self.ready.wait(queue).unwrap();
+        }
+        let first = queue.pop_front().unwrap();
+        let mut wave = vec![first];
+        let mut i = 0;
+        while i < queue.len() && wave.len() < self.parallel {
+            if queue[i].sampling == wave[0].sampling && queue[i].adapter == wave[0].adapter {
+                wave.push(queue.remove(i).unwrap());
+            } else {
+                i += 1;
+            }
+        }
+        wave
+    }
+
+    fn run(&self, llama: &LlamaCppSimple) {
+        let metrics = &self.metrics;
+        loop {
+            let wave = self.next_wave();
+            let started = Instant::now();
+            for job in &wave {
+                let waited = started.duration_since(job.queued).as_micros() as u64;
+                metrics.queue_us.fetch_add(waited, Ordering::Relaxed);
+            }
+            metrics.batches.fetch_add(1, Ordering::Relaxed);
+            metrics.running.fetch_add(wave.len() as u64, Ordering::Relaxed);
+
+            let prompts: Vec<BatchPrompt> = wave
+                .iter()
+                .map(|job| BatchPrompt {
+                    prompt: job.prompt.clone(),
+                    max_new_tokens: job.max_tokens,
+                    tokens: None,
+                })
+                .collect();
+            let mut options = wave[0].sampling.options();
+            options.adapter = wave[0].adapter.as_ref().and_then(|name| self.adapters.get(name).cloned());
+            let applies_before = self.adapter_applies();
+            let outputs = llama.generate_batch_stream(&prompts, self.parallel as i32, &options, |i, event| {
+                let job = &wave[i];
+                match event {
+                    BatchEvent::Text(text) => job.events.send(Event::Text(text.to_string())).is_ok(),
+                    BatchEvent::Done(output) => {
+                        self.record(&output);
+                        let _ = job.events.send(Event::Done(output));
+                        true
+                    }
+                }
+            });
+            if outputs.is_none() {
+                // the jobs' senders drop with the wave, ending their streams
+                metrics.failed.fetch_add(wave.len() as u64, Ordering::Relaxed);
+            }
+            metrics
+                .adapter_switches
+                .fetch_add(self.adapter_applies() - applies_before, Ordering::Relaxed);
+            metrics.running.fetch_sub(wave.len() as u64, Ordering::Relaxed);
+            metrics.generate_us.fetch_add(started.elapsed().as_micros() as u64, Ordering::Relaxed);
+        }
+    }
+
+    /// Merges and unmerges so far, over all adapters.
+    fn adapter_applies(&self) -> u64 {
+        self.adapters.values().map(|adapter| adapter.stats().applies as u64).sum()
+    }
+
+    fn record(&self, output: &BatchOutput) {
+        let metrics = &self.metrics;
+        if output.stop_reason == StopReason::Error {
+            metrics.failed.fetch_add(1, Ordering::Relaxed);
+        }
+        metrics.prompt_tokens.fetch_add(output.prompt_tokens.max(0) as u64, Ordering::Relaxed);
+        metrics.cached_tokens.fetch_add(output.cached_tokens.max(0) as u64, Ordering::Relaxed);
+        metrics.generated_tokens.fetch_add(output.generated_tokens.max(0) as u64, Ordering::Relaxed);
+        if let Some(ttft) = output.ttft_ms {
+            metrics.ttft_us.fetch_add((ttft * 1000.0) as u64, Ordering::Relaxed);
+            metrics.ttft_count.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    /// Counters in the Prometheus text format.
+    pub fn render_metrics(&self) -> String {
+        let m = &self.metrics;
+        let get = |counter: &AtomicU64| counter.load(Ordering::Relaxed);
+        let seconds = |counter: &AtomicU64| counter.load(Ordering::Relaxed) as f64 / 1e6;
+        let mut out = String::new();
+        let mut add = |name: &str, kind: &str, help: &str, value: String| {
+            out.push_str(&format!("# HELP {} {}\n# TYPE {} {}\n{} {}\n", name, help, name, kind, name, value));
+        };
+        add("llama_requests_total", "counter", "Requests accepted into the queue.", get(&m.requests).to_string());
+        add("llama_requests_rejected_total", "counter", "Requests refused because the queue was full.", get(&m.rejected).to_string());
+        add("llama_requests_failed_total", "counter", "Requests that ended with an error.", get(&m.failed).to_string());
+        add("llama_requests_queued", "gauge", "Requests waiting for a batch.", self.queued().to_string());
+        add("llama_requests_running", "gauge", "Requests in the running batch.", get(&m.running).to_string());
+        add("llama_batches_total", "counter", "Batches started.", get(&m.batches).to_string());
+        add("llama_adapter_switches_total", "counter", "LoRA adapter merges and unmerges.", get(&m.adapter_switches).to_string());
+        add("llama_prompt_tokens_total", "counter", "Prompt tokens processed.", get(&m.prompt_tokens).to_string());
+        add("llama_cached_tokens_total", "counter", "Prompt tokens served from the prefix cache.", get(&m.cached_tokens).to_string());
+        add("llama_generated_tokens_total", "counter", "Tokens generated.", get(&m.generated_tokens).to_string());
+        add("llama_queue_seconds_total", "counter", "Time requests spent queued.", seconds(&m.queue_us).to_string());
+        add("llama_ttft_seconds_sum", "counter", "Time to first token, summed over requests.", seconds(&m.ttft_us).to_string());
+        add("llama_ttft_seconds_count", "counter", "Requests that produced a first token.", get(&m.ttft_count).to_string());
+        add("llama_generate_seconds_total", "counter", "Time the model spent generating batches.", seconds(&m.generate_us).to_string());
+        out
+    }
+}
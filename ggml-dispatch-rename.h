@@ -0,0 +1,73 @@
+#pragma once
+
+// Force-included (-include) in each per-level compile of ggml-quants.c.
+// Gives the kernels ggml-dispatch.c routes to a per-level name, e.g.
+// ggml_vec_dot_q4_0_q8_0_avx2, so all copies link into one library. Copies
+// other than the generic one also rename the scalar functions they would
+// otherwise define twice (GGML_DISPATCH_RENAME_ALL).
+
+#ifndef GGML_DISPATCH_SUFFIX
+#error "GGML_DISPATCH_SUFFIX must be defined"
+#endif
+
+#define GGML_DISPATCH_PASTE_(name, suffix) name##suffix
+#define GGML_DISPATCH_PASTE(name, suffix) GGML_DISPATCH_PASTE_(name, suffix)
+#define GGML_DISPATCH_RENAME(name) GGML_DISPATCH_PASTE(name, GGML_DISPATCH_SUFFIX)
+
+// dispatched: keep in sync with the lists in ggml-dispatch.c
+#define quantize_row_q4_0 GGML_DISPATCH_RENAME(quantize_row_q4_0)
+#define quantize_row_q4_1 GGML_DISPATCH_RENAME(quantize_row_q4_1)
+#define quantize_row_q5_0 GGML_DISPATCH_RENAME(quantize_row_q5_0)
+#define quantize_row_q5_1 GGML_DISPATCH_RENAME(quantize_row_q5_1)
+#define quantize_row_q8_0 GGML_DISPATCH_RENAME(quantize_row_q8_0)
+#define quantize_row_q8_1 GGML_DISPATCH_RENAME(quantize_row_q8_1)
+#define quantize_row_q2_K GGML_DISPATCH_RENAME(quantize_row_q2_K)
+#define quantize_row_q3_K GGML_DISPATCH_RENAME(quantize_row_q3_K)
+#define quantize_row_q4_K GGML_DISPATCH_RENAME(quantize_row_q4_K)
+#define quantize_row_q5_K GGML_DISPATCH_RENAME(quantize_row_q5_K)
+#define quantize_row_q6_K GGML_DISPATCH_RENAME(quantize_row_q6_K)
+#define quantize_row_q8_K GGML_DISPATCH_RENAME(quantize_row_q8_K)
+
+#define dequantize_row_q4_0 GGML_DISPATCH_RENAME(dequantize_row_q4_0)
+#define dequantize_row_q4_1 GGML_DISPATCH_RENAME(dequantize_row_q4_1)
+#define dequantize_row_q5_0 GGML_DISPATCH_RENAME(dequantize_row_q5_0)
+#define dequantize_row_q5_1 GGML_DISPATCH_RENAME(dequantize_row_q5_1)
+#define dequantize_row_q8_0 GGML_DISPATCH_RENAME(dequantize_row_q8_0)
+#define dequantize_row_q2_K GGML_DISPATCH_RENAME(dequantize_row_q2_K)
+#define dequantize_row_q3_K GGML_DISPATCH_RENAME(dequantize_row_q3_K)
+#define dequantize_row_q4_K GGML_DISPATCH_RENAME(dequantize_row_q4_K)
+#define dequantize_row_q5_K GGML_DISPATCH_RENAME(dequantize_row_q5_K)
+#define dequantize_row_q6_K GGML_DISPATCH_RENAME(dequantize_row_q6_K)
+#define dequantize_row_q8_K GGML_DISPATCH_RENAME(dequantize_row_q8_K)
+
+#define ggml_vec_dot_q4_0_q8_0 GGML_DISPATCH_RENAME(ggml_vec_dot_q4_0_q8_0)
+#define ggml_vec_dot_q4_1_q8_1 GGML_DISPATCH_RENAME(ggml_vec_dot_q4_1_q8_1)
+#define ggml_vec_dot_q5_0_q8_0 GGML_DISPATCH_RENAME(ggml_vec_dot_q5_0_q8_0)
+#define ggml_vec_dot_q5_1_q8_1 GGML_DISPATCH_RENAME(ggml_vec_dot_q5_1_q8_1)
+#define ggml_vec_dot_q8_0_q8_0 GGML_DISPATCH_RENAME(ggml_vec_dot_q8_0_q8_0)
+#define ggml_vec_dot_q2_K_q8_K GGML_DISPATCH_RENAME(ggml_vec_dot_q2_K_q8_K)
+#define ggml_vec_dot_q3_K_q8_K GGML_DISPATCH_RENAME(ggml_vec_dot_q3_K_q8_K)
+#define ggml_vec_dot_q4_K_q8_K GGML_DISPATCH_RENAME(ggml_vec_dot_q4_K_q8_K)
+#define ggml_vec_dot_q5_K_q8_K GGML_DISPATCH_RENAME(ggml_vec_dot_q5_K_q8_K)
+#define ggml_vec_dot_q6_K_q8_K GGML_DISPATCH_RENAME(ggml_vec_dot_q6_K_q8_K)
+
+#ifdef GGML_DISPATCH_RENAME_ALL
+#define quantize_row_q4_0_reference GGML_DISPATCH_RENAME(quantize_row_q4_0_reference)
+#define quantize_row_q4_1_reference GGML_DISPATCH_RENAME(quantize_row_q4_1_reference)
+#define quantize_row_q5_0_reference GGML_DISPATCH_RENAME(quantize_row_q5_0_reference)
+#define quantize_row_q5_1_reference GGML_DISPATCH_RENAME(quantize_row_q5_1_reference)
+#define quantize_row_q8_0_reference GGML_DISPATCH_RENAME(quantize_row_q8_0_reference)
+#define quantize_row_q8_1_reference GGML_DISPATCH_RENAME(quantize_row_q8_1_reference)
+#define quantize_row_q2_K_reference GGML_DISPATCH_RENAME(quantize_row_q2_K_reference)
+#define quantize_row_q3_K_reference GGML_DISPATCH_RENAME(quantize_row_q3_K_reference)
+#define quantize_row_q4_K_reference GGML_DISPATCH_RENAME(quantize_row_q4_K_reference)
+#define quantize_row_q5_K_reference GGML_DISPATCH_RENAME(quantize_row_q5_K_reference)
+#define quantize_row_q6_K_reference GGML_DISPATCH_RENAME(quantize_row_q6_K_reference)
+#define quantize_row_q8_K_reference GGML_DISPATCH_RENAME(quantize_row_q8_K_reference)
+
+#define ggml_quantize_q2_K GGML_DISPATCH_RENAME(ggml_quantize_q2_K)
+#define ggml_quantize_q3_K GGML_DISPATCH_RENAME(ggml_quantize_q3_K)
+#define ggml_quantize_q4_K GGML_DISPATCH_RENAME(ggml_quantize_q4_K)
+#define ggml_quantize_q5_K GGML_DISPATCH_RENAME(ggml_quantize_q5_K)
+#define ggml_quantize_q6_K GGML_DISPATCH_RENAME(ggml_quantize_q6_K)
+#endif
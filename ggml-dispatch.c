@@ -0,0 +1,163 @@
+#include "ggml-dispatch.h"
+
+#include <stddef.h>
+
+#if defined(GGML_DISPATCH)
+
+#include "ggml-quants.h"
+
+#include <cpuid.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Kernels with a copy per level; keep in sync with ggml-dispatch-rename.h.
+#define GGML_DISPATCH_QUANTIZE(X, level) \
+    X(q4_0, level) X(q4_1, level) X(q5_0, level) X(q5_1, level) X(q8_0, level) X(q8_1, level) \
+    X(q2_K, level) X(q3_K, level) X(q4_K, level) X(q5_K, level) X(q6_K, level) X(q8_K, level)
+#define GGML_DISPATCH_DEQUANTIZE(X, level) \
+    X(q4_0, level) X(q4_1, level) X(q5_0, level) X(q5_1, level) X(q8_0, level) \
+    X(q2_K, level) X(q3_K, level) X(q4_K, level) X(q5_K, level) X(q6_K, level) X(q8_K, level)
+#define GGML_DISPATCH_VEC_DOT(X, level) \
+    X(q4_0_q8_0, level) X(q4_1_q8_1, level) X(q5_0_q8_0, level) X(q5_1_q8_1, level) X(q8_0_q8_0, level) \
+    X(q2_K_q8_K, level) X(q3_K_q8_K, level) X(q4_K_q8_K, level) X(q5_K_q8_K, level) X(q6_K_q8_K, level)
+
+#define GGML_DISPATCH_ALL(X, level) \
+    GGML_DISPATCH_QUANTIZE(X##_QUANTIZE, level) \
+    GGML_DISPATCH_DEQUANTIZE(X##_DEQUANTIZE, level) \
+    GGML_DISPATCH_VEC_DOT(X##_VEC_DOT, level)
+
+// per-level copies compiled from ggml-quants.c
+#define DECLARE_QUANTIZE(type, level) \
+    void quantize_row_##type##_##level(const float * restrict x, void * restrict y, int k);
+#define DECLARE_DEQUANTIZE(type, level) \
+    void dequantize_row_##type##_##level(const block_##type * restrict x, float * restrict y, int k);
+#define DECLARE_VEC_DOT(types, level) \
+    void ggml_vec_dot_##types##_##level(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+
+GGML_DISPATCH_ALL(DECLARE, generic)
+GGML_DISPATCH_ALL(DECLARE, avx2)
+GGML_DISPATCH_ALL(DECLARE, avx512)
+GGML_DISPATCH_ALL(DECLARE, avx512_vnni)
+
+// the names ggml.c calls, forwarding to the selected copy
+#define DEFINE_QUANTIZE(type, level) \
+    static void (*quantize_row_##type##_fn)(const float * restrict, void * restrict, int) = quantize_row_##type##_##level; \
+    void quantize_row_##type(const float * restrict x, void * restrict y, int k) { \
+        quantize_row_##type##_fn(x, y, k); \
+    }
+#define DEFINE_DEQUANTIZE(type, level) \
+    static void (*dequantize_row_##type##_fn)(const block_##type * restrict, float * restrict, int) = dequantize_row_##type##_##level; \
+    void dequantize_row_##type(const block_##type * restrict x, float * restrict y, int k) { \
+        dequantize_row_##type##_fn(x, y, k); \
+    }
+#define DEFINE_VEC_DOT(types, level) \
+    static void (*ggml_vec_dot_##types##_fn)(int, float * restrict, const void * restrict, const void * restrict) = ggml_vec_dot_##types##_##level; \
+    void ggml_vec_dot_##types(int n, float * restrict s, const void * restrict vx, const void * restrict vy) { \
+        ggml_vec_dot_##types##_fn(n, s, vx, vy); \
+    }
+
+GGML_DISPATCH_ALL(DEFINE, generic)
+
+#define SELECT_QUANTIZE(type, level) quantize_row_##type##_fn = quantize_row_##type##_##level;
+#define SELECT_DEQUANTIZE(type, level) dequantize_row_##type##_fn = dequantize_row_##type##_##level;
+#define SELECT_VEC_DOT(types, level) ggml_vec_dot_##types##_fn = ggml_vec_dot_##types##_##level;
+
+static int dispatchLevel = GGML_DISPATCH_GENERIC;
+
+static unsigned long long xgetbv0(void) {
+    unsigned int lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((unsigned long long) hi << 32) | lo;
+}
+
+// Best level the CPU and the OS (saved register state) support.
+static int detectLevel(void) {
+    unsigned int a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d)) {
+        return GGML_DISPATCH_GENERIC;
+    }
+    const int fma = (c >> 12) & 1, osxsave = (c >> 27) & 1, avx = (c >> 28) & 1, f16c = (c >> 29) & 1;
+    if (!(fma && osxsave && avx && f16c) || __get_cpuid_max(0, NULL) < 7) {
+        return GGML_DISPATCH_GENERIC;
+    }
+    const unsigned long long xcr0 = xgetbv0();
+    if ((xcr0 & 0x6) != 0x6) {   // XMM and YMM state
+        return GGML_DISPATCH_GENERIC;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    if (!((b >> 5) & 1)) {
+        return GGML_DISPATCH_GENERIC;
+    }
+    const int avx512 = ((b >> 16) & 1) && ((b >> 17) & 1) && ((b >> 30) & 1) && ((b >> 31) & 1);   // F DQ BW VL
+    if (!avx512 || (xcr0 & 0xe0) != 0xe0) {   // opmask and ZMM state
+        return GGML_DISPATCH_AVX2;
+    }
+    return ((c >> 11) & 1) ? GGML_DISPATCH_AVX512_VNNI : GGML_DISPATCH_AVX512;
+}
+
+static int levelFromName(const char * name) {
+    for (int level = GGML_DISPATCH_GENERIC; level <= GGML_DISPATCH_AVX512_VNNI; level++) {
+        if (strcmp(name, ggml_dispatch_name(level)) == 0) {
+            return level;
+        }
+    }
+    return -1;
+}
+
+// Runs while the library loads, before any thread can call a kernel.
+__attribute__((constructor))
+static void ggml_dispatch_init(void) {
+    int level = detectLevel();
+    const char * cap = getenv("LLAMA_CPU_KERNELS");
+    if (cap != NULL && levelFromName(cap) >= 0 && levelFromName(cap) < level) {
+        level = levelFromName(cap);
+    }
+
+    switch (level) {
+        case GGML_DISPATCH_AVX512_VNNI: GGML_DISPATCH_ALL(SELECT, avx512_vnni) break;
+        case GGML_DISPATCH_AVX512:      GGML_DISPATCH_ALL(SELECT, avx512) break;
+        case GGML_DISPATCH_AVX2:        GGML_DISPATCH_ALL(SELECT, avx2) break;
+        default: break;
+    }
+    dispatchLevel = level;
+}
+
+int ggml_dispatch_level(void) {
+    return dispatchLevel;
+}
+
+int ggml_dispatch_runtime(void) {
+    return 1;
+}
+
+#else
+
+int ggml_dispatch_level(void) {
+#if defined(__AVX512F__) && defined(__AVX512VNNI__)
+    return GGML_DISPATCH_AVX512_VNNI;
+#elif defined(__AVX512F__)
+    return GGML_DISPATCH_AVX512;
+#elif defined(__AVX2__)
+    return GGML_DISPATCH_AVX2;
+#elif defined(__ARM_NEON)
+    return GGML_DISPATCH_NEON;
+#else
+    return GGML_DISPATCH_GENERIC;
+#endif
+}
+
+int ggml_dispatch_runtime(void) {
+    return 0;
+}
+
+#endif
+
+const char * ggml_dispatch_name(int level) {
+    switch (level) {
+        case GGML_DISPATCH_AVX2:        return "avx2";
+        case GGML_DISPATCH_AVX512:      return "avx512";
+        case GGML_DISPATCH_AVX512_VNNI: return "avx512_vnni";
+        case GGML_DISPATCH_NEON:        return "neon";
+        default:                        return "generic";
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+// Runtime selection of the quantized ggml kernels (ggml-quants.c). Builds
+// without the native feature compile those kernels once per instruction set
+// level and define GGML_DISPATCH; ggml-dispatch.c then routes every kernel to
+// the best copy the CPU supports. Native builds just report what they target.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Same values as llama_cpu_kernels in binding.h.
+#define GGML_DISPATCH_GENERIC     0   // x86-64 baseline, or a non-x86 build without NEON
+#define GGML_DISPATCH_AVX2        1   // AVX2, FMA and F16C
+#define GGML_DISPATCH_AVX512      2   // AVX-512 F, DQ, BW and VL
+#define GGML_DISPATCH_AVX512_VNNI 3
+#define GGML_DISPATCH_NEON        4
+
+// Level of the kernels in use. With GGML_DISPATCH it is chosen from cpuid
+// when the library is loaded, capped by the LLAMA_CPU_KERNELS environment
+// variable (generic, avx2, avx512 or avx512_vnni) if set.
+int ggml_dispatch_level(void);
+// 1 if the level was picked at runtime, 0 if it is fixed by the build.
+int ggml_dispatch_runtime(void);
+const char* ggml_dispatch_name(int level);
+
+#ifdef __cplusplus
+}
+#endif
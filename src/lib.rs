@@ -1,21 +1,21 @@
-use lazy_static::lazy_static;
-use libc::{c_char, c_void};
-use std::collections::HashMap;
+use libc::{c_char, c_int, c_void};
 use std::ffi::{CStr, CString};
-use std::sync::Mutex;
+use std::marker::PhantomData;
+use std::sync::Arc;
+use std::time::Duration;
 
+#[allow(non_camel_case_types, non_upper_case_globals, dead_code)]
 mod bindings {
     include!("../bindings.rs");
 }
 
-lazy_static! {
-    static ref CALLBACKS: Mutex<HashMap<usize, Box<dyn FnMut(String) -> bool + Send + 'static>>> =
-        Mutex::new(HashMap::new());
-}
+type ProgressCallback = Box<dyn FnMut(f32) + Send + 'static>;
 
 #[derive(Debug)]
 pub struct LlamaCppSimple {
     inner: *mut bindings::LlamaCppSimple,
+    // Boxed ProgressCallback owned by the loader thread until llama_destroy.
+    progress: *mut c_void,
 }
 
 #[derive(Debug, Clone)]
@@ -25,7 +25,320 @@ pub struct LlamaOptions {
     pub gpu_layers: i32,
     pub threads: i32,
     pub seed: i32,
-    pub batch_size: i32
+    pub batch_size: i32,
+    /// Read the model file into the page cache before loading it.
+    pub prefetch: bool,
+    /// Lock the model weights in RAM.
+    pub mlock: bool,
+    /// Run warm-up decodes before the instance reports ready.
+    pub warmup: bool,
+    pub kv_type: KvType,
+    /// Default `max_parallel` for `generate_batch`; 0 uses `batch_size`.
+    pub parallel: i32,
+    /// Keep prompt prefixes in the KV cache and share them with later
+    /// prompts that start the same way.
+    pub prefix_cache: bool,
+    /// Load the weights into memory instead of mapping them, so LoRA
+    /// adapters can be merged into them (see `load_adapter`).
+    pub lora: bool,
+}
+
+/// Element type of the KV cache. Quantized types shrink the K cache; the V
+/// cache stays f16.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum KvType {
+    F16,
+    /// q8_0
+    Q8,
+    /// q4_0
+    Q4,
+}
+
+impl KvType {
+    fn to_raw(self) -> bindings::llama_kv_type {
+        match self {
+            KvType::F16 => bindings::llama_kv_type_LLAMA_KV_F16,
+            KvType::Q8 => bindings::llama_kv_type_LLAMA_KV_Q8_0,
+            KvType::Q4 => bindings::llama_kv_type_LLAMA_KV_Q4_0,
+        }
+    }
+
+    fn from_raw(raw: bindings::llama_kv_type) -> Self {
+        match raw {
+            bindings::llama_kv_type_LLAMA_KV_Q8_0 => KvType::Q8,
+            bindings::llama_kv_type_LLAMA_KV_Q4_0 => KvType::Q4,
+            _ => KvType::F16,
+        }
+    }
+}
+
+/// Limits for `plan_memory`.
+#[derive(Debug, Clone, Copy)]
+pub struct PlanRequest {
+    pub budget_bytes: u64,
+    /// Smallest useful context per sequence.
+    pub min_ctx: i32,
+    /// Largest context per sequence; 0 uses the training context.
+    pub max_ctx: i32,
+    pub max_parallel: i32,
+    pub batch_size: i32,
+    pub allow_quantized_kv: bool,
+}
+
+impl PlanRequest {
+    pub fn new(budget_bytes: u64) -> Self {
+        let raw = unsafe { bindings::llama_plan_default_request() };
+        PlanRequest {
+            budget_bytes,
+            min_ctx: raw.min_ctx,
+            max_ctx: raw.max_ctx,
+            max_parallel: raw.max_parallel,
+            batch_size: raw.batch,
+            allow_quantized_kv: raw.allow_quantized_kv,
+        }
+    }
+}
+
+/// Estimated memory for one configuration. `context` is the KV cell count
+/// shared by all `parallel` sequences.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct MemoryPlan {
+    pub context: i32,
+    pub parallel: i32,
+    pub kv_type: KvType,
+    pub weight_bytes: u64,
+    pub kv_bytes: u64,
+    pub compute_bytes: u64,
+    pub total_bytes: u64,
+    pub fits: bool,
+}
+
+impl From<&bindings::llama_memory_plan> for MemoryPlan {
+    fn from(raw: &bindings::llama_memory_plan) -> Self {
+        MemoryPlan {
+            context: raw.n_ctx,
+            parallel: raw.n_parallel,
+            kv_type: KvType::from_raw(raw.kv_type),
+            weight_bytes: raw.weight_bytes as u64,
+            kv_bytes: raw.kv_bytes as u64,
+            compute_bytes: raw.compute_bytes as u64,
+            total_bytes: raw.total_bytes as u64,
+            fits: raw.fits,
+        }
+    }
+}
+
+#[derive(Debug, Clone)]
+pub struct MemoryReport {
+    pub candidates: Vec<MemoryPlan>,
+    /// Check `fits`: when nothing fits this is the smallest configuration.
+    pub chosen: MemoryPlan,
+}
+
+/// Estimates weight, KV cache and compute memory for the model at
+/// `model_path` across context sizes, parallel sequence counts and KV types,
+/// and picks a configuration under the budget. Only the model's metadata is
+/// read. Returns `None` if the file cannot be read.
+pub fn plan_memory(model_path: &str, request: &PlanRequest) -> Option<MemoryReport> {
+    let c_model_path = CString::new(model_path).ok()?;
+    let mut raw_request = unsafe { bindings::llama_plan_default_request() };
+    raw_request.budget_bytes = request.budget_bytes as f64;
+    raw_request.min_ctx = request.min_ctx;
+    raw_request.max_ctx = request.max_ctx;
+    raw_request.max_parallel = request.max_parallel;
+    raw_request.batch = request.batch_size;
+    raw_request.allow_quantized_kv = request.allow_quantized_kv;
+
+    let mut chosen = bindings::llama_memory_plan::default();
+    let count = unsafe {
+        bindings::llama_plan_memory(c_model_path.as_ptr(), &raw_request, std::ptr::null_mut(), 0, &mut chosen)
+    };
+    if count < 0 {
+        return None;
+    }
+    let mut candidates = vec![bindings::llama_memory_plan::default(); count as usize];
+    unsafe {
+        bindings::llama_plan_memory(c_model_path.as_ptr(), &raw_request, candidates.as_mut_ptr(), count, &mut chosen)
+    };
+    Some(MemoryReport {
+        candidates: candidates.iter().map(MemoryPlan::from).collect(),
+        chosen: MemoryPlan::from(&chosen),
+    })
+}
+
+/// Output format of `quantize_model`. The k-quant mixes (`S`/`M`/`L`) keep
+/// the most sensitive tensors at a higher precision.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum QuantType {
+    F16,
+    Q4_0,
+    Q4_1,
+    Q5_0,
+    Q5_1,
+    Q8_0,
+    Q2K,
+    Q3KS,
+    Q3KM,
+    Q3KL,
+    Q4KS,
+    Q4KM,
+    Q5KS,
+    Q5KM,
+    Q6K,
+}
+
+impl QuantType {
+    fn to_raw(self) -> bindings::llama_quant_type {
+        match self {
+            QuantType::F16 => bindings::llama_quant_type_LLAMA_QUANT_F16,
+            QuantType::Q4_0 => bindings::llama_quant_type_LLAMA_QUANT_Q4_0,
+            QuantType::Q4_1 => bindings::llama_quant_type_LLAMA_QUANT_Q4_1,
+            QuantType::Q5_0 => bindings::llama_quant_type_LLAMA_QUANT_Q5_0,
+            QuantType::Q5_1 => bindings::llama_quant_type_LLAMA_QUANT_Q5_1,
+            QuantType::Q8_0 => bindings::llama_quant_type_LLAMA_QUANT_Q8_0,
+            QuantType::Q2K => bindings::llama_quant_type_LLAMA_QUANT_Q2_K,
+            QuantType::Q3KS => bindings::llama_quant_type_LLAMA_QUANT_Q3_K_S,
+            QuantType::Q3KM => bindings::llama_quant_type_LLAMA_QUANT_Q3_K_M,
+            QuantType::Q3KL => bindings::llama_quant_type_LLAMA_QUANT_Q3_K_L,
+            QuantType::Q4KS => bindings::llama_quant_type_LLAMA_QUANT_Q4_K_S,
+            QuantType::Q4KM => bindings::llama_quant_type_LLAMA_QUANT_Q4_K_M,
+            QuantType::Q5KS => bindings::llama_quant_type_LLAMA_QUANT_Q5_K_S,
+            QuantType::Q5KM => bindings::llama_quant_type_LLAMA_QUANT_Q5_K_M,
+            QuantType::Q6K => bindings::llama_quant_type_LLAMA_QUANT_Q6_K,
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct QuantizeOptions {
+    pub quant_type: QuantType,
+    /// Threads per tensor; 0 uses all cores.
+    pub threads: i32,
+    /// Accept an already-quantized input, at a loss of quality.
+    pub allow_requantize: bool,
+    /// Also quantize `output.weight`.
+    pub quantize_output: bool,
+}
+
+impl Default for QuantizeOptions {
+    fn default() -> Self {
+        let raw = unsafe { bindings::llama_quantize_default_options() };
+        QuantizeOptions {
+            quant_type: QuantType::Q4KM,
+            threads: raw.threads,
+            allow_requantize: raw.allow_requantize,
+            quantize_output: raw.quantize_output,
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct QuantizeReport {
+    pub tensors: usize,
+    pub input_bytes: u64,
+    pub output_bytes: u64,
+    pub total_ms: f64,
+}
+
+unsafe extern "C" fn quantize_progress_trampoline<F: FnMut(usize, usize, &str)>(
+    done: c_int,
+    total: c_int,
+    tensor: *const c_char,
+    user_data: *mut c_void,
+) {
+    let callback = &mut *(user_data as *mut F);
+    let name = CStr::from_ptr(tensor).to_string_lossy();
+    callback(done as usize, total as usize, &name);
+}
+
+/// Writes a quantized copy of the GGUF model at `input_path` to
+/// `output_path`. Tensors are quantized one at a time, each split across
+/// `options.threads`, and written as they finish, so memory stays near one
+/// tensor. `on_progress(done, total, tensor)` is called as each tensor
+/// starts and once more with `done == total`. Returns `None` on failure.
+pub fn quantize_model<F: FnMut(usize, usize, &str)>(
+    input_path: &str,
+    output_path: &str,
+    options: &QuantizeOptions,
+    mut on_progress: F,
+) -> Option<QuantizeReport> {
+    let c_input = CString::new(input_path).ok()?;
+    let c_output = CString::new(output_path).ok()?;
+    let mut raw = unsafe { bindings::llama_quantize_default_options() };
+    raw.type_ = options.quant_type.to_raw();
+    raw.threads = options.threads;
+    raw.allow_requantize = options.allow_requantize;
+    raw.quantize_output = options.quantize_output;
+    raw.progress = Some(quantize_progress_trampoline::<F>);
+    raw.progress_user_data = &mut on_progress as *mut F as *mut c_void;
+
+    let mut result = bindings::llama_quantize_result::default();
+    let status = unsafe { bindings::llama_quantize_model(c_input.as_ptr(), c_output.as_ptr(), &raw, &mut result) };
+    if status != 0 {
+        return None;
+    }
+    Some(QuantizeReport {
+        tensors: result.n_tensors.max(0) as usize,
+        input_bytes: result.input_bytes as u64,
+        output_bytes: result.output_bytes as u64,
+        total_ms: result.total_ms,
+    })
+}
+
+/// Milliseconds spent in each startup phase, and the CPU kernels in use.
+#[derive(Debug, Default, Clone, Copy)]
+pub struct StartupStats {
+    pub backend_ms: f64,
+    pub prefetch_ms: f64,
+    pub load_ms: f64,
+    pub context_ms: f64,
+    pub warmup_ms: f64,
+    pub total_ms: f64,
+    pub cpu_kernels: CpuKernels,
+    /// The kernels were picked from cpuid at runtime; false for builds with
+    /// the `native` feature or for non-x86 targets.
+    pub cpu_dispatch: bool,
+}
+
+/// Preemption counters, see `GenerateOptions::priority`.
+#[derive(Debug, Default, Clone, Copy)]
+pub struct SchedStats {
+    pub preemptions: usize,
+    /// Tokens decoded again to rebuild the KV cells of paused batches.
+    pub refilled_tokens: usize,
+    /// Time spent on it.
+    pub refill_ms: f64,
+    /// Calls waiting for the context now.
+    pub waiting: usize,
+}
+
+/// Instruction set of the quantized CPU kernels.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum CpuKernels {
+    Generic,
+    /// AVX2 with FMA and F16C.
+    Avx2,
+    Avx512,
+    Avx512Vnni,
+    Neon,
+}
+
+impl Default for CpuKernels {
+    fn default() -> Self {
+        CpuKernels::Generic
+    }
+}
+
+impl From<bindings::llama_cpu_kernels> for CpuKernels {
+    fn from(kernels: bindings::llama_cpu_kernels) -> Self {
+        match kernels {
+            bindings::llama_cpu_kernels_LLAMA_CPU_AVX2 => CpuKernels::Avx2,
+            bindings::llama_cpu_kernels_LLAMA_CPU_AVX512 => CpuKernels::Avx512,
+            bindings::llama_cpu_kernels_LLAMA_CPU_AVX512_VNNI => CpuKernels::Avx512Vnni,
+            bindings::llama_cpu_kernels_LLAMA_CPU_NEON => CpuKernels::Neon,
+            _ => CpuKernels::Generic,
+        }
+    }
 }
 
 unsafe impl Send for LlamaCppSimple {}
@@ -40,25 +353,1030 @@ impl Default for LlamaOptions {
             gpu_layers: 20,
             threads: 4,
             seed: 777,
-            batch_size: 512
+            batch_size: 512,
+            prefetch: false,
+            mlock: false,
+            warmup: false,
+            kv_type: KvType::F16,
+            parallel: 0,
+            prefix_cache: false,
+            lora: false,
         }
     }
 }
 
-fn set_callback(
-    //state: *mut c_void,
-    state: usize,
-    callback: Option<Box<dyn FnMut(String) -> bool + Send + 'static>>,
-) {
-    let mut callbacks = CALLBACKS.lock().unwrap();
+impl LlamaOptions {
+    fn to_load_options(&self) -> bindings::llama_load_options {
+        let mut options = unsafe { bindings::llama_load_default_options() };
+        options.context = self.context;
+        options.gpu_layers = self.gpu_layers;
+        options.threads = self.threads;
+        options.seed = self.seed;
+        options.batch = self.batch_size;
+        options.prefetch = self.prefetch;
+        options.mlock = self.mlock;
+        options.warmup = self.warmup;
+        options.kv_type = self.kv_type.to_raw();
+        options.parallel = self.parallel;
+        options.prefix_cache = self.prefix_cache;
+        options.lora = self.lora;
+        options
+    }
+
+    /// Sizes the context from a plan returned by `plan_memory`.
+    pub fn apply_plan(&mut self, plan: &MemoryPlan) {
+        self.context = plan.context;
+        self.parallel = plan.parallel;
+        self.kv_type = plan.kv_type;
+    }
+}
+
+#[derive(Debug)]
+struct CancelHandle(*mut bindings::llama_cancel_token);
+
+unsafe impl Send for CancelHandle {}
+unsafe impl Sync for CancelHandle {}
+
+impl Drop for CancelHandle {
+    fn drop(&mut self) {
+        unsafe { bindings::llama_cancel_token_free(self.0) };
+    }
+}
+
+/// Stops a running generation from any thread. The check happens between
+/// prompt chunks and before every decode step.
+#[derive(Debug, Clone)]
+pub struct CancelToken {
+    handle: Arc<CancelHandle>,
+}
+
+impl CancelToken {
+    pub fn new() -> Self {
+        CancelToken { handle: Arc::new(CancelHandle(unsafe { bindings::llama_cancel_token_new() })) }
+    }
+
+    pub fn cancel(&self) {
+        unsafe { bindings::llama_cancel_token_cancel(self.handle.0) }
+    }
+
+    pub fn reset(&self) {
+        unsafe { bindings::llama_cancel_token_reset(self.handle.0) }
+    }
+
+    pub fn is_cancelled(&self) -> bool {
+        unsafe { bindings::llama_cancel_token_is_cancelled(self.handle.0) }
+    }
+}
+
+impl Default for CancelToken {
+    fn default() -> Self {
+        CancelToken::new()
+    }
+}
+
+#[derive(Debug)]
+struct MaskHandle(*mut bindings::llama_token_mask);
+
+unsafe impl Send for MaskHandle {}
+unsafe impl Sync for MaskHandle {}
+
+impl Drop for MaskHandle {
+    fn drop(&mut self) {
+        unsafe { bindings::llama_token_mask_free(self.0) };
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum MaskMode {
+    /// Biases only.
+    None,
+    /// Only the mask's tokens may be sampled.
+    Allow,
+    /// The mask's tokens are never sampled.
+    Deny,
+}
+
+/// A precompiled token allow/deny set with optional logit biases. Build it
+/// once with `LlamaCppSimple::token_mask` and pass it to any number of
+/// requests through `GenerateOptions::masks`.
+#[derive(Debug, Clone)]
+pub struct TokenMask {
+    handle: Arc<MaskHandle>,
+}
+
+impl TokenMask {
+    /// Number of tokens in the allow/deny set.
+    pub fn len(&self) -> usize {
+        unsafe { bindings::llama_token_mask_size(self.handle.0) as usize }
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+}
+
+#[derive(Debug)]
+struct AdapterHandle(*mut bindings::llama_adapter);
+
+unsafe impl Send for AdapterHandle {}
+unsafe impl Sync for AdapterHandle {}
+
+impl Drop for AdapterHandle {
+    fn drop(&mut self) {
+        unsafe { bindings::llama_adapter_free(self.0) };
+    }
+}
+
+/// A LoRA adapter loaded with `LlamaCppSimple::load_adapter`. Requests that
+/// name it through `GenerateOptions::adapter` run with it merged into the
+/// shared weights; the instance switches adapters between requests.
+#[derive(Debug, Clone)]
+pub struct Adapter {
+    handle: Arc<AdapterHandle>,
+}
+
+/// Loading and switching costs of an adapter.
+#[derive(Debug, Default, Clone, Copy)]
+pub struct AdapterStats {
+    /// Size of the adapter file, the memory it adds on top of the base.
+    pub file_bytes: u64,
+    pub load_ms: f64,
+    /// Time of the last merge or unmerge.
+    pub last_apply_ms: f64,
+    pub apply_ms: f64,
+    pub applies: usize,
+}
+
+impl Adapter {
+    pub fn stats(&self) -> AdapterStats {
+        let mut stats = bindings::llama_adapter_stats::default();
+        unsafe { bindings::llama_adapter_get_stats(self.handle.0, &mut stats) };
+        AdapterStats {
+            file_bytes: stats.file_bytes as u64,
+            load_ms: stats.load_ms,
+            last_apply_ms: stats.last_apply_ms,
+            apply_ms: stats.apply_ms,
+            applies: stats.applies.max(0) as usize,
+        }
+    }
+}
+
+fn with_c_strings<R>(strings: &[&str], f: impl FnOnce(&[*const c_char]) -> R) -> R {
+    let c_strings: Vec<CString> = strings
+        .iter()
+        .map(|s| CString::new(*s).expect("CString::new failed"))
+        .collect();
+    let ptrs: Vec<*const c_char> = c_strings.iter().map(|s| s.as_ptr()).collect();
+    f(&ptrs)
+}
+
+/// Thread-safe tokenizer for a model's vocabulary, borrowed from the
+/// `LlamaCppSimple` or `TokenizerModel` that owns it. Batched calls tokenize
+/// across the owner's threads.
+#[derive(Debug, Clone, Copy)]
+pub struct Tokenizer<'a> {
+    inner: *mut bindings::llama_tokenizer,
+    _owner: PhantomData<&'a ()>,
+}
+
+/// Vocabulary and training metadata of a model.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct ModelMetadata {
+    pub n_vocab: i32,
+    pub n_ctx_train: i32,
+    pub n_embd: i32,
+    /// 0 is SentencePiece, 1 is BPE.
+    pub vocab_type: i32,
+    pub bos: i32,
+    pub eos: i32,
+    pub nl: i32,
+    /// Infill tokens; `None` when the vocabulary has none.
+    pub prefix: Option<i32>,
+    pub middle: Option<i32>,
+    pub suffix: Option<i32>,
+    pub eot: Option<i32>,
+    /// Whether the GGUF asks for a BOS token; `None` if unspecified.
+    pub add_bos: Option<bool>,
+    pub desc: String,
+}
+
+/// A tokenizer that loads only the vocabulary and metadata of a GGUF file,
+/// for services that count tokens or build prompts without generating.
+#[derive(Debug)]
+pub struct TokenizerModel {
+    inner: *mut bindings::llama_tokenizer,
+}
+
+unsafe impl Send for TokenizerModel {}
+unsafe impl Sync for TokenizerModel {}
+
+impl TokenizerModel {
+    /// `threads` of 0 uses every core for batched calls.
+    pub fn load(model_path: &str, threads: i32) -> Option<Self> {
+        let c_model_path = CString::new(model_path).unwrap();
+        let inner = unsafe { bindings::llama_tokenizer_load(c_model_path.as_ptr(), threads) };
+        if inner.is_null() {
+            None
+        } else {
+            Some(TokenizerModel { inner })
+        }
+    }
+
+    pub fn tokenizer(&self) -> Tokenizer<'_> {
+        Tokenizer { inner: self.inner, _owner: PhantomData }
+    }
+}
+
+impl Drop for TokenizerModel {
+    fn drop(&mut self) {
+        unsafe { bindings::llama_tokenizer_free(self.inner) };
+    }
+}
+
+unsafe impl Send for Tokenizer<'_> {}
+unsafe impl Sync for Tokenizer<'_> {}
+
+/// Token ids for many texts, packed into one buffer.
+#[derive(Debug, Clone, Default)]
+pub struct TokenizedBatch {
+    pub tokens: Vec<i32>,
+    pub offsets: Vec<i32>,
+    pub counts: Vec<i32>,
+}
+
+impl TokenizedBatch {
+    /// Ids of text `i`.
+    pub fn get(&self, i: usize) -> &[i32] {
+        let start = self.offsets[i] as usize;
+        &self.tokens[start..start + self.counts[i] as usize]
+    }
+
+    pub fn len(&self) -> usize {
+        self.counts.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.counts.is_empty()
+    }
+}
+
+impl<'a> Tokenizer<'a> {
+    /// Tokenizes `texts` into caller-provided buffers. `offsets` and `counts`
+    /// need one slot per text. Returns the total number of ids; `tokens` is
+    /// only written when it is large enough, so `Err(needed)` asks for a
+    /// bigger buffer.
+    pub fn tokenize_into(
+        &self,
+        texts: &[&str],
+        add_bos: bool,
+        special: bool,
+        tokens: &mut [i32],
+        offsets: &mut [i32],
+        counts: &mut [i32],
+    ) -> Result<usize, usize> {
+        assert!(offsets.len() >= texts.len() && counts.len() >= texts.len());
+        let ptrs: Vec<*const c_char> = texts.iter().map(|t| t.as_ptr() as *const c_char).collect();
+        let lens: Vec<i32> = texts.iter().map(|t| t.len() as i32).collect();
+        let total = unsafe {
+            bindings::llama_tokenize_many(
+                self.inner,
+                ptrs.as_ptr(),
+                lens.as_ptr(),
+                texts.len() as i32,
+                add_bos,
+                special,
+                tokens.as_mut_ptr(),
+                tokens.len() as i32,
+                offsets.as_mut_ptr(),
+                counts.as_mut_ptr(),
+            )
+        };
+        if total < 0 {
+            return Err(0);
+        }
+        let total = total as usize;
+        if total <= tokens.len() {
+            Ok(total)
+        } else {
+            Err(total)
+        }
+    }
+
+    pub fn tokenize_many(&self, texts: &[&str], add_bos: bool, special: bool) -> TokenizedBatch {
+        let mut batch = TokenizedBatch {
+            tokens: Vec::new(),
+            offsets: vec![0; texts.len()],
+            counts: vec![0; texts.len()],
+        };
+        // text length plus BOS bounds the id count, so one pass suffices
+        let estimate: usize = texts.iter().map(|t| t.len() + 2).sum();
+        batch.tokens.resize(estimate, 0);
+        loop {
+            match self.tokenize_into(texts, add_bos, special, &mut batch.tokens, &mut batch.offsets, &mut batch.counts) {
+                Ok(total) => {
+                    batch.tokens.truncate(total);
+                    return batch;
+                }
+                Err(0) => return TokenizedBatch::default(),
+                Err(needed) => batch.tokens.resize(needed, 0),
+            }
+        }
+    }
+
+    pub fn tokenize(&self, text: &str, add_bos: bool, special: bool) -> Vec<i32> {
+        self.tokenize_many(&[text], add_bos, special).tokens
+    }
+
+    /// Token counts only; no ids are copied out.
+    pub fn count_tokens_many(&self, texts: &[&str], add_bos: bool, special: bool) -> Vec<usize> {
+        let ptrs: Vec<*const c_char> = texts.iter().map(|t| t.as_ptr() as *const c_char).collect();
+        let lens: Vec<i32> = texts.iter().map(|t| t.len() as i32).collect();
+        let mut counts = vec![0i32; texts.len()];
+        unsafe {
+            bindings::llama_count_tokens_many(
+                self.inner,
+                ptrs.as_ptr(),
+                lens.as_ptr(),
+                texts.len() as i32,
+                add_bos,
+                special,
+                counts.as_mut_ptr(),
+            )
+        };
+        counts.into_iter().map(|c| c as usize).collect()
+    }
+
+    pub fn detokenize_many(&self, sequences: &[&[i32]]) -> Vec<String> {
+        let tokens: Vec<i32> = sequences.concat();
+        let counts: Vec<i32> = sequences.iter().map(|s| s.len() as i32).collect();
+        let mut offsets = vec![0i32; sequences.len()];
+        let mut lengths = vec![0i32; sequences.len()];
+        let mut text: Vec<u8> = vec![0; tokens.len() * 8];
+        loop {
+            let total = unsafe {
+                bindings::llama_detokenize_many(
+                    self.inner,
+                    tokens.as_ptr(),
+                    counts.as_ptr(),
+                    sequences.len() as i32,
+                    text.as_mut_ptr() as *mut c_char,
+                    text.len() as i32,
+                    offsets.as_mut_ptr(),
+                    lengths.as_mut_ptr(),
+                )
+            };
+            if total < 0 {
+                return Vec::new();
+            }
+            if total as usize <= text.len() {
+                break;
+            }
+            text.resize(total as usize, 0);
+        }
+        offsets
+            .iter()
+            .zip(lengths.iter())
+            .map(|(&o, &l)| String::from_utf8_lossy(&text[o as usize..(o + l) as usize]).into_owned())
+            .collect()
+    }
+
+    pub fn detokenize(&self, tokens: &[i32]) -> String {
+        self.detokenize_many(&[tokens]).pop().unwrap_or_default()
+    }
+
+    /// Pins a fixed segment such as a system prompt or chat template marker;
+    /// texts equal to it are then served from the cache. Returns its length.
+    pub fn cache_segment(&self, text: &str, add_bos: bool, special: bool) -> usize {
+        let c_text = CString::new(text).expect("CString::new failed");
+        let n = unsafe { bindings::llama_tokenizer_cache_add(self.inner, c_text.as_ptr(), add_bos, special) };
+        n.max(0) as usize
+    }
+
+    pub fn clear_cache(&self) {
+        unsafe { bindings::llama_tokenizer_cache_clear(self.inner) };
+    }
+
+    pub fn metadata(&self) -> ModelMetadata {
+        let mut raw: bindings::llama_model_metadata = unsafe { std::mem::zeroed() };
+        unsafe { bindings::llama_tokenizer_metadata(self.inner, &mut raw) };
+        let special = |id: i32| if id < 0 { None } else { Some(id) };
+        ModelMetadata {
+            n_vocab: raw.n_vocab,
+            n_ctx_train: raw.n_ctx_train,
+            n_embd: raw.n_embd,
+            vocab_type: raw.vocab_type,
+            bos: raw.bos,
+            eos: raw.eos,
+            nl: raw.nl,
+            prefix: special(raw.prefix),
+            middle: special(raw.middle),
+            suffix: special(raw.suffix),
+            eot: special(raw.eot),
+            add_bos: if raw.add_bos < 0 { None } else { Some(raw.add_bos != 0) },
+            desc: unsafe { CStr::from_ptr(raw.desc.as_ptr()) }.to_string_lossy().into_owned(),
+        }
+    }
+
+    /// Raw GGUF metadata value, e.g. `general.name`.
+    pub fn meta_str(&self, key: &str) -> Option<String> {
+        let c_key = CString::new(key).ok()?;
+        let mut buf = vec![0u8; 256];
+        loop {
+            let n = unsafe {
+                bindings::llama_tokenizer_meta_str(self.inner, c_key.as_ptr(), buf.as_mut_ptr() as *mut c_char, buf.len() as i32)
+            };
+            if n < 0 {
+                return None;
+            }
+            if (n as usize) < buf.len() {
+                buf.truncate(n as usize);
+                return Some(String::from_utf8_lossy(&buf).into_owned());
+            }
+            buf.resize(n as usize + 1, 0);
+        }
+    }
+}
+
+/// Per-request options for `generate_text_with_options`.
+#[derive(Debug, Clone, Default)]
+pub struct GenerateOptions {
+    pub cancel: Option<CancelToken>,
+    /// Wall-clock limit for the whole request, including time spent queued.
+    pub deadline: Option<Duration>,
+    /// Limit until the first generated token.
+    pub ttft_deadline: Option<Duration>,
+    /// Generation stops before any of these strings is emitted.
+    pub stop_sequences: Vec<String>,
+    /// Sampling temperature; 0 or below is greedy.
+    pub temperature: f32,
+    /// Keep only the k most likely tokens; 0 keeps the whole vocabulary.
+    pub top_k: i32,
+    /// Nucleus sampling threshold; 1.0 disables it.
+    pub top_p: f32,
+    /// Sampling seed, 0 uses the instance seed. Sequence i uses seed + i.
+    pub seed: u32,
+    /// Decoding mode of `generate_text_with_options`.
+    pub decoding: Decoding,
+    /// GBNF grammar the output must match, e.g. `JSON_GRAMMAR` or one built
+    /// with `grammar_from_choices`. Applies to single-prompt generation and
+    /// sessions; `generate_batch` and `generate_n` fail with one set.
+    pub grammar: Option<String>,
+    /// Token masks and biases applied, in order, before every sampling step.
+    pub masks: Vec<TokenMask>,
+    /// Repetition penalties; `None` disables them.
+    pub penalties: Option<Penalties>,
+    /// Record each generated token's log-probability plus this many top
+    /// alternatives (at most 20) in `GenerateResult::logprobs`.
+    pub top_logprobs: Option<usize>,
+    /// LoRA adapter to run with; `None` is the base model. Sessions use
+    /// their own, see `Session::set_adapter`.
+    pub adapter: Option<Adapter>,
+    /// Higher priorities get the context first. A running `generate_batch`
+    /// of lower priority and the same adapter pauses between decode steps
+    /// for them; its prompts' KV cells are rebuilt afterwards.
+    pub priority: i32,
+}
+
+/// Repetition, frequency and presence penalties over a window of recent
+/// tokens (prompt included), with llama.cpp's semantics.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct Penalties {
+    /// Divides positive logits and multiplies negative ones; 1.0 disables it.
+    pub repeat: f32,
+    /// Window size in tokens; -1 is the whole context.
+    pub last_n: i32,
+    /// Subtracted once per occurrence in the window.
+    pub frequency: f32,
+    /// Subtracted once if the token occurs in the window.
+    pub presence: f32,
+}
+
+impl Default for Penalties {
+    fn default() -> Self {
+        Penalties {
+            repeat: 1.1,
+            last_n: 64,
+            frequency: 0.0,
+            presence: 0.0,
+        }
+    }
+}
+
+/// GBNF for any JSON object (llama.cpp's grammars/json.gbnf).
+pub const JSON_GRAMMAR: &str = r#"root   ::= object
+value  ::= object | array | string | number | ("true" | "false" | "null") ws
+
+object ::=
+  "{" ws (
+            string ":" ws value
+    ("," ws string ":" ws value)*
+  )? "}" ws
+
+array  ::=
+  "[" ws (
+            value
+    ("," ws value)*
+  )? "]" ws
+
+string ::=
+  "\"" (
+    [^"\\] |
+    "\\" (["\\/bfnrt] | "u" [0-9a-fA-F] [0-9a-fA-F] [0-9a-fA-F] [0-9a-fA-F])
+  )* "\"" ws
+
+number ::= ("-"? ([0-9] | [1-9] [0-9]*)) ("." [0-9]+)? ([eE] [-+]? [0-9]+)? ws
+
+ws ::= ([ \t\n] ws)?
+"#;
+
+/// GBNF that accepts exactly one of `choices`, for enum/classification outputs.
+pub fn grammar_from_choices(choices: &[&str]) -> String {
+    let alternatives: Vec<String> = choices
+        .iter()
+        .map(|choice| {
+            let mut literal = String::from("\"");
+            for c in choice.chars() {
+                match c {
+                    '"' => literal.push_str("\\\""),
+                    '\\' => literal.push_str("\\\\"),
+                    '\n' => literal.push_str("\\n"),
+                    '\r' => literal.push_str("\\r"),
+                    '\t' => literal.push_str("\\t"),
+                    _ => literal.push(c),
+                }
+            }
+            literal.push('"');
+            literal
+        })
+        .collect();
+    format!("root ::= {}", alternatives.join(" | "))
+}
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum Decoding {
+    /// One token per step: greedy, or sampled when `temperature > 0`.
+    Sample,
+    /// Beam search; the best beam is streamed once the search finishes.
+    /// Beams are ranked by `logprob / length^length_penalty`.
+    Beam { width: i32, length_penalty: f32 },
+}
+
+impl Default for Decoding {
+    fn default() -> Self {
+        Decoding::Sample
+    }
+}
+
+impl GenerateOptions {
+    fn to_params(&self) -> bindings::llama_generate_params {
+        let mut params = unsafe { bindings::llama_generate_default_params() };
+        if let Some(cancel) = &self.cancel {
+            params.cancel = cancel.handle.0;
+        }
+        if let Some(adapter) = &self.adapter {
+            params.adapter = adapter.handle.0;
+        }
+        params.priority = self.priority;
+        if let Some(deadline) = self.deadline {
+            params.deadline_ms = deadline.as_secs_f64() * 1000.0;
+        }
+        if let Some(ttft_deadline) = self.ttft_deadline {
+            params.ttft_deadline_ms = ttft_deadline.as_secs_f64() * 1000.0;
+        }
+        params.temperature = self.temperature;
+        params.top_k = self.top_k;
+        params.top_p = if self.top_p > 0.0 { self.top_p } else { 1.0 };
+        params.seed = self.seed;
+        if let Decoding::Beam { width, length_penalty } = self.decoding {
+            params.beam_width = width;
+            params.length_penalty = length_penalty;
+        }
+        if let Some(penalties) = self.penalties {
+            params.repeat_penalty = penalties.repeat;
+            params.repeat_last_n = penalties.last_n;
+            params.frequency_penalty = penalties.frequency;
+            params.presence_penalty = penalties.presence;
+        } else {
+            params.repeat_last_n = 0;
+        }
+        params
+    }
 
-    if let Some(callback) = callback {
-        callbacks.insert(state as usize, callback);
+    fn mask_ptrs(&self) -> Vec<*const bindings::llama_token_mask> {
+        self.masks.iter().map(|mask| mask.handle.0 as *const _).collect()
+    }
+
+    /// `max_new_tokens` sizes the log-probability array.
+    fn prepare(&self, max_new_tokens: i32) -> PreparedParams {
+        let stops: Vec<CString> = self
+            .stop_sequences
+            .iter()
+            .map(|stop| CString::new(stop.as_str()).expect("CString::new failed"))
+            .collect();
+        let stop_ptrs: Vec<*const c_char> = stops.iter().map(|stop| stop.as_ptr()).collect();
+        let mask_ptrs = self.mask_ptrs();
+        let grammar = self
+            .grammar
+            .as_ref()
+            .map(|grammar| CString::new(grammar.as_str()).expect("CString::new failed"));
+
+        let mut params = self.to_params();
+        params.stop_sequences = stop_ptrs.as_ptr();
+        params.n_stop_sequences = stop_ptrs.len() as i32;
+        params.masks = mask_ptrs.as_ptr();
+        params.n_masks = mask_ptrs.len() as i32;
+        if let Some(grammar) = &grammar {
+            params.grammar = grammar.as_ptr();
+        }
+        let mut logprobs = Vec::new();
+        if let Some(k) = self.top_logprobs {
+            logprobs = vec![unsafe { std::mem::zeroed::<bindings::llama_token_logprobs>() }; max_new_tokens.max(0) as usize];
+            params.top_logprobs = k as i32;
+            params.logprobs = logprobs.as_mut_ptr();
+            params.logprobs_capacity = logprobs.len() as i32;
+        }
+        PreparedParams {
+            params,
+            logprobs,
+            _stops: stops,
+            _stop_ptrs: stop_ptrs,
+            _mask_ptrs: mask_ptrs,
+            _grammar: grammar,
+        }
+    }
+}
+
+/// C parameters together with the buffers their pointers refer to.
+struct PreparedParams {
+    params: bindings::llama_generate_params,
+    logprobs: Vec<bindings::llama_token_logprobs>,
+    _stops: Vec<CString>,
+    _stop_ptrs: Vec<*const c_char>,
+    _mask_ptrs: Vec<*const bindings::llama_token_mask>,
+    _grammar: Option<CString>,
+}
+
+/// Prompt for the streaming calls: text, or ids that are read in place.
+#[derive(Debug, Clone, Copy)]
+pub enum Prompt<'a> {
+    Text(&'a str),
+    Tokens(&'a [i32]),
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum StopReason {
+    Error,
+    Eos,
+    Length,
+    StopSequence,
+    Deadline,
+    Cancelled,
+    Callback,
+    /// Not started because the queue's projected prefill time exceeded the deadline.
+    Rejected,
+}
+
+impl From<bindings::llama_stop_reason> for StopReason {
+    fn from(reason: bindings::llama_stop_reason) -> Self {
+        match reason {
+            bindings::llama_stop_reason_LLAMA_STOP_EOS => StopReason::Eos,
+            bindings::llama_stop_reason_LLAMA_STOP_LENGTH => StopReason::Length,
+            bindings::llama_stop_reason_LLAMA_STOP_SEQUENCE => StopReason::StopSequence,
+            bindings::llama_stop_reason_LLAMA_STOP_DEADLINE => StopReason::Deadline,
+            bindings::llama_stop_reason_LLAMA_STOP_CANCELLED => StopReason::Cancelled,
+            bindings::llama_stop_reason_LLAMA_STOP_CALLBACK => StopReason::Callback,
+            bindings::llama_stop_reason_LLAMA_STOP_REJECTED => StopReason::Rejected,
+            _ => StopReason::Error,
+        }
+    }
+}
+
+#[derive(Debug, Clone)]
+pub struct GenerateResult {
+    /// Tokens in the context when generation stopped, -1 on error.
+    pub tokens: i32,
+    pub stop_reason: StopReason,
+    pub prompt_tokens: i32,
+    /// Prompt tokens shared from the prefix cache instead of prefilled.
+    pub cached_tokens: i32,
+    pub generated_tokens: i32,
+    pub prefill_ms: f64,
+    /// None if no token was generated.
+    pub ttft_ms: Option<f64>,
+    pub total_ms: f64,
+    /// Time spent masking logits with the grammar; divide by
+    /// `generated_tokens` for the per-token cost.
+    pub grammar_ms: f64,
+    /// One entry per generated token when `GenerateOptions::top_logprobs` is set.
+    pub logprobs: Vec<TokenLogprobs>,
+}
+
+/// Log-probability of a generated token and its most likely alternatives.
+#[derive(Debug, Clone, PartialEq)]
+pub struct TokenLogprobs {
+    pub token: i32,
+    pub logprob: f32,
+    /// `(token, logprob)`, best first.
+    pub top: Vec<(i32, f32)>,
+}
+
+impl GenerateResult {
+    fn new(tokens: i32, result: &bindings::llama_generate_result, prepared: &PreparedParams) -> Self {
+        let written = (result.n_logprobs.max(0) as usize).min(prepared.logprobs.len());
+        let logprobs = prepared.logprobs[..written]
+            .iter()
+            .map(|entry| TokenLogprobs {
+                token: entry.token,
+                logprob: entry.logprob,
+                top: (0..entry.n_top as usize)
+                    .map(|i| (entry.top_tokens[i], entry.top_logprobs[i]))
+                    .collect(),
+            })
+            .collect();
+        GenerateResult {
+            tokens,
+            stop_reason: result.stop_reason.into(),
+            prompt_tokens: result.prompt_tokens,
+            cached_tokens: result.cached_tokens,
+            generated_tokens: result.generated_tokens,
+            prefill_ms: result.prefill_ms,
+            ttft_ms: if result.ttft_ms < 0.0 { None } else { Some(result.ttft_ms) },
+            total_ms: result.total_ms,
+            grammar_ms: result.grammar_ms,
+            logprobs,
+        }
+    }
+}
+
+/// Log-probabilities of one scored continuation.
+#[derive(Debug, Clone, PartialEq)]
+pub struct ScoreOutput {
+    /// One entry per continuation token.
+    pub token_logprobs: Vec<f32>,
+    /// Sum of `token_logprobs`.
+    pub total: f64,
+}
+
+/// Judge prompt for `LlamaCppSimple::rerank`: instruction, query,
+/// document prefix, document and suffix, after which `yes` and `no` are
+/// compared as the next token.
+#[derive(Debug, Clone, PartialEq)]
+pub struct RerankOptions {
+    pub instruction: String,
+    pub document_prefix: String,
+    pub suffix: String,
+    pub yes: String,
+    pub no: String,
+    /// Longer documents are cut; 0 keeps as much as fits the context.
+    pub max_document_tokens: i32,
+}
+
+impl Default for RerankOptions {
+    fn default() -> Self {
+        let raw = unsafe { bindings::llama_rerank_default_options() };
+        let text = |ptr: *const c_char| unsafe { CStr::from_ptr(ptr) }.to_string_lossy().into_owned();
+        RerankOptions {
+            instruction: text(raw.instruction),
+            document_prefix: text(raw.document_prefix),
+            suffix: text(raw.suffix),
+            yes: text(raw.yes),
+            no: text(raw.no),
+            max_document_tokens: raw.max_document_tokens,
+        }
+    }
+}
+
+impl ScoreOutput {
+    pub fn perplexity(&self) -> f64 {
+        if self.token_logprobs.is_empty() {
+            return f64::NAN;
+        }
+        (-self.total / self.token_logprobs.len() as f64).exp()
+    }
+}
+
+/// A conversation that keeps its KV cache between calls, so each turn only
+/// decodes what was added. Forks share the decoded history.
+#[derive(Debug)]
+pub struct Session<'a> {
+    inner: *mut bindings::llama_session,
+    adapter: Option<Adapter>,
+    _owner: PhantomData<&'a LlamaCppSimple>,
+}
+
+unsafe impl Send for Session<'_> {}
+
+impl<'a> Session<'a> {
+    /// Tokenizes and appends text, with BOS if the session is empty. Returns
+    /// the history length.
+    pub fn append(&mut self, text: &str) -> Option<usize> {
+        let c_text = CString::new(text).ok()?;
+        let len = unsafe { bindings::llama_session_append_text(self.inner, c_text.as_ptr()) };
+        usize::try_from(len).ok()
+    }
+
+    pub fn append_tokens(&mut self, tokens: &[i32]) -> Option<usize> {
+        let len = unsafe {
+            bindings::llama_session_append_tokens(self.inner, tokens.as_ptr(), tokens.len() as i32)
+        };
+        usize::try_from(len).ok()
+    }
+
+    /// Generates from the history, streaming raw bytes like
+    /// `LlamaCppSimple::generate_stream_bytes`. Generated tokens other than
+    /// EOS join the history; a cancelled or expired call leaves it unchanged.
+    /// Beam search is not available in sessions.
+    pub fn generate_bytes<F: FnMut(&[u8]) -> bool>(
+        &mut self,
+        max_new_tokens: i32,
+        options: &GenerateOptions,
+        mut on_bytes: F,
+    ) -> GenerateResult {
+        let mut prepared = options.prepare(max_new_tokens);
+        prepared.params.stream = Some(stream_trampoline::<F>);
+        prepared.params.stream_user_data = &mut on_bytes as *mut F as *mut c_void;
+        let mut result = bindings::llama_generate_result::default();
+
+        let tokens = unsafe {
+            bindings::llama_session_generate(self.inner, max_new_tokens, &prepared.params, &mut result)
+        };
+
+        GenerateResult::new(tokens, &result, &prepared)
+    }
+
+    /// `generate_bytes` with each chunk as `&str`.
+    pub fn generate<F: FnMut(&str) -> bool>(
+        &mut self,
+        max_new_tokens: i32,
+        options: &GenerateOptions,
+        mut on_text: F,
+    ) -> GenerateResult {
+        self.generate_bytes(max_new_tokens, options, |bytes| {
+            on_text(&String::from_utf8_lossy(bytes))
+        })
+    }
+
+    /// Runs the session with a LoRA adapter, `None` for the base model.
+    /// Only possible while the session is empty; forks keep the adapter.
+    pub fn set_adapter(&mut self, adapter: Option<&Adapter>) -> bool {
+        let raw = adapter.map_or(std::ptr::null_mut(), |adapter| adapter.handle.0);
+        if unsafe { bindings::llama_session_set_adapter(self.inner, raw) } != 0 {
+            return false;
+        }
+        self.adapter = adapter.cloned();
+        true
+    }
+
+    /// Keeps the first `n` tokens, e.g. to retry the last turn.
+    pub fn truncate_to(&mut self, n: usize) {
+        unsafe { bindings::llama_session_truncate(self.inner, n as i32) };
+    }
+
+    /// A new session sharing this one's KV cells; nothing is recomputed.
+    pub fn fork(&self) -> Option<Session<'a>> {
+        let inner = unsafe { bindings::llama_session_fork(self.inner) };
+        if inner.is_null() {
+            None
+        } else {
+            Some(Session { inner, adapter: self.adapter.clone(), _owner: PhantomData })
+        }
+    }
+
+    pub fn len(&self) -> usize {
+        unsafe { bindings::llama_session_length(self.inner) as usize }
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    pub fn tokens(&self) -> Vec<i32> {
+        let mut tokens = vec![0i32; self.len()];
+        unsafe { bindings::llama_session_tokens(self.inner, tokens.as_mut_ptr(), tokens.len() as i32) };
+        tokens
+    }
+}
+
+impl Drop for Session<'_> {
+    fn drop(&mut self) {
+        unsafe { bindings::llama_session_free(self.inner) };
+    }
+}
+
+fn split_scores(logprobs: Vec<f32>, counts: &[i32], totals: &[f64]) -> Vec<ScoreOutput> {
+    let mut offset = 0;
+    counts
+        .iter()
+        .zip(totals.iter())
+        .map(|(&count, &total)| {
+            let end = offset + count as usize;
+            let output = ScoreOutput { token_logprobs: logprobs[offset..end].to_vec(), total };
+            offset = end;
+            output
+        })
+        .collect()
+}
+
+/// One prompt for `generate_batch`.
+#[derive(Debug, Clone)]
+pub struct BatchPrompt {
+    pub prompt: String,
+    pub max_new_tokens: i32,
+    /// Pre-tokenized prompt used instead of `prompt`.
+    pub tokens: Option<Vec<i32>>,
+}
+
+/// Output and stats for one prompt of `generate_batch`.
+#[derive(Debug, Clone)]
+pub struct BatchOutput {
+    pub text: String,
+    pub stop_reason: StopReason,
+    pub prompt_tokens: i32,
+    pub cached_tokens: i32,
+    pub generated_tokens: i32,
+    /// From admission into the shared context until the prompt was prefilled.
+    pub prefill_ms: f64,
+    pub ttft_ms: Option<f64>,
+    pub total_ms: f64,
+    /// Cumulative log-probability of the sampled tokens.
+    pub logprob: f64,
+}
+
+/// An event for one prompt of `generate_batch_stream`.
+#[derive(Debug)]
+pub enum BatchEvent<'a> {
+    /// Newly generated text, ending on a UTF-8 character boundary.
+    Text(&'a str),
+    /// The prompt has finished; the other prompts may still be running.
+    Done(BatchOutput),
+}
+
+/// Copies one result out of its binding-owned buffer.
+fn batch_output(r: &bindings::llama_batch_result) -> BatchOutput {
+    let bytes = if r.text.is_null() {
+        &[][..]
+    } else {
+        unsafe { std::slice::from_raw_parts(r.text as *const u8, r.text_len as usize) }
+    };
+    BatchOutput {
+        text: String::from_utf8_lossy(bytes).into_owned(),
+        stop_reason: r.stop_reason.into(),
+        prompt_tokens: r.prompt_tokens,
+        cached_tokens: r.cached_tokens,
+        generated_tokens: r.generated_tokens,
+        prefill_ms: r.prefill_ms,
+        ttft_ms: if r.ttft_ms < 0.0 { None } else { Some(r.ttft_ms) },
+        total_ms: r.total_ms,
+        logprob: r.logprob,
+    }
+}
+
+/// Copies results out of the binding-owned buffers and frees them.
+fn take_batch_results(results: &mut [bindings::llama_batch_result]) -> Vec<BatchOutput> {
+    let outputs = results.iter().map(batch_output).collect();
+
+    unsafe { bindings::llama_batch_results_free(results.as_mut_ptr(), results.len() as i32) };
+    outputs
+}
+
+/// Per-prompt user data for `batch_stream_trampoline`.
+struct BatchStreamSlot<F> {
+    index: usize,
+    callback: *mut F,
+    results: *const bindings::llama_batch_result,
+}
+
+unsafe extern "C" fn stream_trampoline<F: FnMut(&[u8]) -> bool>(
+    bytes: *const c_char,
+    len: c_int,
+    user_data: *mut c_void,
+) -> bool {
+    let callback = &mut *(user_data as *mut F);
+    callback(std::slice::from_raw_parts(bytes as *const u8, len as usize))
+}
+
+unsafe extern "C" fn batch_stream_trampoline<F: FnMut(usize, BatchEvent<'_>) -> bool>(
+    bytes: *const c_char,
+    len: c_int,
+    user_data: *mut c_void,
+) -> bool {
+    let slot = &*(user_data as *const BatchStreamSlot<F>);
+    let callback = &mut *slot.callback;
+    if len == 0 {
+        // the binding has just filled this prompt's result
+        let output = batch_output(&*slot.results.add(slot.index));
+        callback(slot.index, BatchEvent::Done(output))
     } else {
-        callbacks.remove(&(state as usize));
+        let bytes = std::slice::from_raw_parts(bytes as *const u8, len as usize);
+        callback(slot.index, BatchEvent::Text(&String::from_utf8_lossy(bytes)))
     }
 }
 
+unsafe extern "C" fn progress_trampoline(progress: f32, user_data: *mut c_void) {
+    let callback = &mut *(user_data as *mut ProgressCallback);
+    callback(progress);
+}
+
 impl Default for LlamaCppSimple {
     fn default() -> Self {
         LlamaCppSimple::new(LlamaOptions::default())
@@ -68,21 +1386,86 @@ impl Default for LlamaCppSimple {
 
 impl LlamaCppSimple {
     pub fn new(options: LlamaOptions) -> Option<Self> {
-        let c_model_path = CString::new(options.model_path).unwrap();
+        let c_model_path = CString::new(options.model_path.as_str()).unwrap();
+        let load_options = options.to_load_options();
         let inner = unsafe {
-            bindings::llama_create(
-                c_model_path.as_ptr(),
-                options.context,
-                options.gpu_layers,
-                options.threads,
-                options.seed,
-                options.batch_size
-            )
+            bindings::llama_create_with_options(c_model_path.as_ptr(), &load_options)
+        };
+        if inner.is_null() {
+            None
+        } else {
+            Some(Self { inner, progress: std::ptr::null_mut() })
+        }
+    }
+
+    /// Starts loading on a background thread and returns immediately.
+    /// `generate_text` blocks until loading finishes; use `is_ready` or
+    /// `wait_ready` to check first.
+    pub fn new_async(
+        options: LlamaOptions,
+        progress: Option<Box<dyn FnMut(f32) + Send + 'static>>,
+    ) -> Option<Self> {
+        let c_model_path = CString::new(options.model_path.as_str()).unwrap();
+        let mut load_options = options.to_load_options();
+
+        let progress = match progress {
+            Some(callback) => Box::into_raw(Box::new(callback)) as *mut c_void,
+            None => std::ptr::null_mut(),
         };
+        if !progress.is_null() {
+            load_options.progress_callback = Some(progress_trampoline);
+            load_options.progress_user_data = progress;
+        }
+
+        let inner = unsafe { bindings::llama_create_async(c_model_path.as_ptr(), &load_options) };
         if inner.is_null() {
+            if !progress.is_null() {
+                unsafe { drop(Box::from_raw(progress as *mut ProgressCallback)) };
+            }
             None
         } else {
-            Some(Self { inner })
+            Some(Self { inner, progress })
+        }
+    }
+
+    /// `Some(true)` once loaded, `Some(false)` while loading, `None` if loading failed.
+    pub fn is_ready(&self) -> Option<bool> {
+        match unsafe { bindings::llama_is_ready(self.inner) } {
+            1 => Some(true),
+            0 => Some(false),
+            _ => None,
+        }
+    }
+
+    /// Blocks until loading finishes; returns false if it failed.
+    pub fn wait_ready(&self) -> bool {
+        unsafe { bindings::llama_wait_ready(self.inner) == 1 }
+    }
+
+    pub fn startup_stats(&self) -> StartupStats {
+        let mut stats = bindings::llama_startup_stats::default();
+        unsafe { bindings::llama_get_startup_stats(self.inner, &mut stats) };
+        StartupStats {
+            backend_ms: stats.backend_ms,
+            prefetch_ms: stats.prefetch_ms,
+            load_ms: stats.load_ms,
+            context_ms: stats.context_ms,
+            warmup_ms: stats.warmup_ms,
+            total_ms: stats.total_ms,
+            cpu_kernels: stats.cpu_kernels.into(),
+            cpu_dispatch: stats.cpu_dispatch,
+        }
+    }
+
+    /// Preemptions of batches by higher-priority requests so far.
+    pub fn sched_stats(&self) -> SchedStats {
+        let mut stats = bindings::llama_sched_stats::default();
+        unsafe { bindings::llama_get_sched_stats(self.inner, &mut stats) };
+        SchedStats {
+            preemptions: stats.preemptions.max(0) as usize,
+            refilled_tokens: stats.refilled_tokens.max(0) as usize,
+            refill_ms: stats.refill_ms,
+            waiting: stats.waiting.max(0) as usize,
         }
     }
 
@@ -92,12 +1475,501 @@ impl LlamaCppSimple {
         total_tokens: i32,
         callback: Box<dyn FnMut(String) -> bool + Send + 'static>,
     ) -> i32 {
-        let c_prompt = CString::new(prompt).expect("CString::new failed");
+        self.generate_text_with_options(prompt, total_tokens, &GenerateOptions::default(), callback)
+            .tokens
+    }
+
+    pub fn generate_text_with_options(
+        &self,
+        prompt: &str,
+        total_tokens: i32,
+        options: &GenerateOptions,
+        mut callback: Box<dyn FnMut(String) -> bool + Send + 'static>,
+    ) -> GenerateResult {
+        // per-request stream, so concurrent calls keep their own callbacks
+        self.stream_bytes(
+            Prompt::Text(prompt),
+            total_tokens,
+            options,
+            |bytes| callback(String::from_utf8_lossy(bytes).into_owned()),
+            false,
+        )
+    }
+
+    /// Streams generated text as raw bytes borrowed from the binding, without
+    /// a per-token allocation. Chunks end on UTF-8 character boundaries;
+    /// return false to stop. The token callback is not used.
+    pub fn generate_stream_bytes<F: FnMut(&[u8]) -> bool>(
+        &self,
+        prompt: Prompt<'_>,
+        max_new_tokens: i32,
+        options: &GenerateOptions,
+        on_bytes: F,
+    ) -> GenerateResult {
+        self.stream_bytes(prompt, max_new_tokens, options, on_bytes, false)
+    }
+
+    /// `generate_stream_bytes` with `on_bytes` run on the binding's delivery
+    /// thread, so detokenizing and the callback overlap the next decode step
+    /// instead of stalling it. Returning false still stops generation before
+    /// the next step; tokens decoded meanwhile are dropped from the result.
+    pub fn generate_stream_pipelined<F: FnMut(&[u8]) -> bool + Send>(
+        &self,
+        prompt: Prompt<'_>,
+        max_new_tokens: i32,
+        options: &GenerateOptions,
+        on_bytes: F,
+    ) -> GenerateResult {
+        self.stream_bytes(prompt, max_new_tokens, options, on_bytes, true)
+    }
+
+    fn stream_bytes<F: FnMut(&[u8]) -> bool>(
+        &self,
+        prompt: Prompt<'_>,
+        max_new_tokens: i32,
+        options: &GenerateOptions,
+        mut on_bytes: F,
+        pipelined: bool,
+    ) -> GenerateResult {
+        let mut prepared = options.prepare(max_new_tokens);
+        prepared.params.pipelined = pipelined;
+        prepared.params.stream = Some(stream_trampoline::<F>);
+        prepared.params.stream_user_data = &mut on_bytes as *mut F as *mut c_void;
+        let mut result = bindings::llama_generate_result::default();
+
+        let tokens = match prompt {
+            Prompt::Text(text) => {
+                let c_prompt = CString::new(text).expect("CString::new failed");
+                unsafe {
+                    bindings::llama_generate_text_with_params(
+                        self.inner,
+                        c_prompt.as_ptr(),
+                        max_new_tokens,
+                        &prepared.params,
+                        &mut result,
+                    )
+                }
+            }
+            Prompt::Tokens(ids) => unsafe {
+                bindings::llama_generate_tokens(
+                    self.inner,
+                    ids.as_ptr(),
+                    ids.len() as i32,
+                    max_new_tokens,
+                    &prepared.params,
+                    &mut result,
+                )
+            },
+        };
+
+        GenerateResult::new(tokens, &result, &prepared)
+    }
+
+    /// `generate_stream_bytes` with each chunk as `&str`. Chunks are borrowed
+    /// unless the model emitted invalid UTF-8, which is replaced.
+    pub fn generate_stream<F: FnMut(&str) -> bool>(
+        &self,
+        prompt: Prompt<'_>,
+        max_new_tokens: i32,
+        options: &GenerateOptions,
+        mut on_text: F,
+    ) -> GenerateResult {
+        self.generate_stream_bytes(prompt, max_new_tokens, options, |bytes| {
+            on_text(&String::from_utf8_lossy(bytes))
+        })
+    }
 
-        unsafe { set_callback(10000, Some(callback)); }
-        //unsafe { set_callback(self.inner as *mut c_void, Some(callback)); }
+    /// `generate_text_with_options` for a prompt that is already token ids
+    /// (BOS included if wanted). The slice is read in place, so ids from an
+    /// upstream tokenizer are never detokenized or re-tokenized.
+    pub fn generate_tokens_with_options(
+        &self,
+        prompt: &[i32],
+        max_new_tokens: i32,
+        options: &GenerateOptions,
+        mut callback: Box<dyn FnMut(String) -> bool + Send + 'static>,
+    ) -> GenerateResult {
+        // per-request stream, so concurrent calls keep their own callbacks
+        self.stream_bytes(
+            Prompt::Tokens(prompt),
+            max_new_tokens,
+            options,
+            |bytes| callback(String::from_utf8_lossy(bytes).into_owned()),
+            false,
+        )
+    }
 
-        unsafe { bindings::llama_generate_text(self.inner, c_prompt.as_ptr(), total_tokens) }
+    /// Scores each continuation given a shared context in one prefill pass
+    /// per packed batch; the context's KV cache is computed once. The context
+    /// is tokenized with BOS, each continuation on its own without. Only the
+    /// cancel token and deadlines of `options` apply.
+    pub fn score(&self, context: &str, continuations: &[&str], options: &GenerateOptions) -> Option<Vec<ScoreOutput>> {
+        let tokenizer = self.tokenizer()?;
+        let context_tokens = tokenizer.tokenize(context, true, true);
+        let batch = tokenizer.tokenize_many(continuations, false, true);
+        let parts: Vec<&[i32]> = (0..batch.len()).map(|i| batch.get(i)).collect();
+        self.score_tokens(&context_tokens, &parts, options)
+    }
+
+    /// `score` with caller-tokenized inputs, read in place.
+    pub fn score_tokens(
+        &self,
+        context: &[i32],
+        continuations: &[&[i32]],
+        options: &GenerateOptions,
+    ) -> Option<Vec<ScoreOutput>> {
+        let packed: Vec<i32> = continuations.concat();
+        let counts: Vec<i32> = continuations.iter().map(|c| c.len() as i32).collect();
+        let mut logprobs = vec![0f32; packed.len()];
+        let mut totals = vec![0f64; continuations.len()];
+        let prepared = options.prepare(0);
+        let status = unsafe {
+            bindings::llama_score_tokens(
+                self.inner,
+                context.as_ptr(),
+                context.len() as i32,
+                packed.as_ptr(),
+                counts.as_ptr(),
+                counts.len() as i32,
+                &prepared.params,
+                logprobs.as_mut_ptr(),
+                totals.as_mut_ptr(),
+            )
+        };
+        if status != 0 {
+            return None;
+        }
+        Some(split_scores(logprobs, &counts, &totals))
+    }
+
+    /// Relevance of each document to `query`, judged by the model: log p(yes)
+    /// minus log p(no) after the prompt in `options`, so higher ranks first.
+    /// The shared prompt head is decoded once and the documents are packed
+    /// into multi-sequence batches. Returns `None` on failure.
+    pub fn rerank(
+        &self,
+        query: &str,
+        documents: &[&str],
+        options: &RerankOptions,
+        generate: &GenerateOptions,
+    ) -> Option<Vec<f32>> {
+        let to_c = |text: &str| CString::new(text).expect("CString::new failed");
+        let (instruction, document_prefix, suffix) =
+            (to_c(&options.instruction), to_c(&options.document_prefix), to_c(&options.suffix));
+        let (yes, no) = (to_c(&options.yes), to_c(&options.no));
+        let raw = bindings::llama_rerank_options {
+            instruction: instruction.as_ptr(),
+            document_prefix: document_prefix.as_ptr(),
+            suffix: suffix.as_ptr(),
+            yes: yes.as_ptr(),
+            no: no.as_ptr(),
+            max_document_tokens: options.max_document_tokens,
+        };
+        let query = to_c(query);
+        let documents: Vec<CString> = documents.iter().map(|document| to_c(document)).collect();
+        let document_ptrs: Vec<*const c_char> = documents.iter().map(|document| document.as_ptr()).collect();
+        let mut scores = vec![0f32; documents.len()];
+        let prepared = generate.prepare(0);
+        let status = unsafe {
+            bindings::llama_rerank(
+                self.inner,
+                query.as_ptr(),
+                document_ptrs.as_ptr(),
+                document_ptrs.len() as i32,
+                &raw,
+                &prepared.params,
+                scores.as_mut_ptr(),
+            )
+        };
+        if status != 0 {
+            return None;
+        }
+        Some(scores)
+    }
+
+    /// `rerank` with caller-tokenized inputs: each document is scored on
+    /// `prefix` + document + `suffix`, comparing the tokens `yes` and `no`.
+    pub fn rerank_tokens(
+        &self,
+        prefix: &[i32],
+        documents: &[&[i32]],
+        suffix: &[i32],
+        yes: i32,
+        no: i32,
+        options: &GenerateOptions,
+    ) -> Option<Vec<f32>> {
+        let packed: Vec<i32> = documents.concat();
+        let counts: Vec<i32> = documents.iter().map(|d| d.len() as i32).collect();
+        let mut scores = vec![0f32; documents.len()];
+        let prepared = options.prepare(0);
+        let status = unsafe {
+            bindings::llama_rerank_tokens(
+                self.inner,
+                prefix.as_ptr(),
+                prefix.len() as i32,
+                packed.as_ptr(),
+                counts.as_ptr(),
+                counts.len() as i32,
+                suffix.as_ptr(),
+                suffix.len() as i32,
+                yes,
+                no,
+                &prepared.params,
+                scores.as_mut_ptr(),
+            )
+        };
+        if status != 0 {
+            return None;
+        }
+        Some(scores)
+    }
+
+    /// Drops every cached prompt prefix (see `LlamaOptions::prefix_cache`).
+    pub fn clear_prefix_cache(&self) {
+        unsafe { bindings::llama_prefix_cache_clear(self.inner) };
+    }
+
+    /// Opens a session; it holds KV cells in this instance's context until
+    /// dropped.
+    pub fn session(&self) -> Option<Session<'_>> {
+        let inner = unsafe { bindings::llama_session_new(self.inner) };
+        if inner.is_null() {
+            None
+        } else {
+            Some(Session { inner, adapter: None, _owner: PhantomData })
+        }
+    }
+
+    /// Loads a LoRA adapter for this instance, which must have been created
+    /// with `LlamaOptions::lora`. Adapters are merged into the shared
+    /// weights on demand, so each costs only its own file. Pass the f16
+    /// model as `base_path` when the instance runs a quantized one: switching
+    /// away then restores the weights exactly instead of subtracting the
+    /// adapter again. Returns `None` on failure.
+    pub fn load_adapter(&self, path: &str, scale: f32, base_path: Option<&str>) -> Option<Adapter> {
+        let c_path = CString::new(path).ok()?;
+        let c_base = match base_path {
+            Some(base) => Some(CString::new(base).ok()?),
+            None => None,
+        };
+        let adapter = unsafe {
+            bindings::llama_adapter_load(
+                self.inner,
+                c_path.as_ptr(),
+                scale,
+                c_base.as_ref().map_or(std::ptr::null(), |base| base.as_ptr()),
+            )
+        };
+        if adapter.is_null() {
+            None
+        } else {
+            Some(Adapter { handle: Arc::new(AdapterHandle(adapter)) })
+        }
+    }
+
+    /// The instance's tokenizer; `None` if loading failed.
+    pub fn tokenizer(&self) -> Option<Tokenizer<'_>> {
+        let inner = unsafe { bindings::llama_get_tokenizer(self.inner) };
+        if inner.is_null() {
+            None
+        } else {
+            Some(Tokenizer { inner, _owner: PhantomData })
+        }
+    }
+
+    /// Builds a reusable token mask from token ids and strings. Every token
+    /// of each string, tokenized like prompt text, joins the set.
+    pub fn token_mask(&self, mode: MaskMode, tokens: &[i32], strings: &[&str]) -> Option<TokenMask> {
+        let mode = match mode {
+            MaskMode::None => bindings::llama_mask_mode_LLAMA_MASK_NONE,
+            MaskMode::Allow => bindings::llama_mask_mode_LLAMA_MASK_ALLOW,
+            MaskMode::Deny => bindings::llama_mask_mode_LLAMA_MASK_DENY,
+        };
+        let mask = with_c_strings(strings, |ptrs| unsafe {
+            bindings::llama_token_mask_create(
+                self.inner,
+                mode,
+                tokens.as_ptr(),
+                tokens.len() as i32,
+                ptrs.as_ptr(),
+                ptrs.len() as i32,
+            )
+        });
+        if mask.is_null() {
+            None
+        } else {
+            Some(TokenMask { handle: Arc::new(MaskHandle(mask)) })
+        }
+    }
+
+    /// Adds `bias` to the logits of the given tokens and of every token of
+    /// each string whenever `mask` is applied. Call before sharing the mask.
+    pub fn add_mask_bias(&self, mask: &TokenMask, tokens: &[i32], strings: &[&str], bias: f32) -> bool {
+        with_c_strings(strings, |ptrs| unsafe {
+            bindings::llama_token_mask_add_bias(
+                self.inner,
+                mask.handle.0,
+                tokens.as_ptr(),
+                tokens.len() as i32,
+                ptrs.as_ptr(),
+                ptrs.len() as i32,
+                bias,
+            ) == 0
+        })
+    }
+
+    /// Generates for all prompts in one call. Prompts are prefilled together
+    /// under separate sequence ids and decoded in lock-step batches, which is
+    /// much cheaper per token than calling `generate_text` in a loop.
+    /// `max_parallel` caps concurrent sequences, 0 lets the KV cache decide.
+    /// `options` applies to the whole call; no token callback is invoked.
+    pub fn generate_batch(
+        &self,
+        prompts: &[BatchPrompt],
+        max_parallel: i32,
+        options: &GenerateOptions,
+    ) -> Option<Vec<BatchOutput>> {
+        let mut results = vec![bindings::llama_batch_result::default(); prompts.len()];
+        if !self.run_batch(prompts, max_parallel, options, None, &[], &mut results) {
+            return None;
+        }
+
+        Some(take_batch_results(&mut results))
+    }
+
+    /// `generate_batch` that reports each prompt's text as it is generated,
+    /// and its output as soon as it finishes rather than when the whole batch
+    /// does. `on_event` gets the prompt's index; returning false stops that
+    /// prompt only. The outputs are also returned at the end.
+    pub fn generate_batch_stream<F: FnMut(usize, BatchEvent<'_>) -> bool>(
+        &self,
+        prompts: &[BatchPrompt],
+        max_parallel: i32,
+        options: &GenerateOptions,
+        mut on_event: F,
+    ) -> Option<Vec<BatchOutput>> {
+        let mut results = vec![bindings::llama_batch_result::default(); prompts.len()];
+        let mut slots: Vec<BatchStreamSlot<F>> = (0..prompts.len())
+            .map(|index| BatchStreamSlot {
+                index,
+                callback: &mut on_event as *mut F,
+                results: results.as_ptr(),
+            })
+            .collect();
+        let user_data: Vec<*mut c_void> = slots
+            .iter_mut()
+            .map(|slot| slot as *mut BatchStreamSlot<F> as *mut c_void)
+            .collect();
+        let stream: bindings::llama_stream_fn = Some(batch_stream_trampoline::<F>);
+        if !self.run_batch(prompts, max_parallel, options, stream, &user_data, &mut results) {
+            return None;
+        }
+
+        Some(take_batch_results(&mut results))
+    }
+
+    /// Shared by `generate_batch` and `generate_batch_stream`; `user_data`
+    /// is empty or holds one pointer per prompt.
+    fn run_batch(
+        &self,
+        prompts: &[BatchPrompt],
+        max_parallel: i32,
+        options: &GenerateOptions,
+        stream: bindings::llama_stream_fn,
+        user_data: &[*mut c_void],
+        results: &mut [bindings::llama_batch_result],
+    ) -> bool {
+        if options.grammar.is_some() {
+            return false;
+        }
+        let c_prompts: Vec<CString> = prompts
+            .iter()
+            .map(|p| CString::new(p.prompt.as_str()).expect("CString::new failed"))
+            .collect();
+        let requests: Vec<bindings::llama_batch_request> = prompts
+            .iter()
+            .zip(c_prompts.iter())
+            .enumerate()
+            .map(|(i, (p, c_prompt))| bindings::llama_batch_request {
+                prompt: c_prompt.as_ptr(),
+                max_new_tokens: p.max_new_tokens,
+                tokens: p.tokens.as_ref().map_or(std::ptr::null(), |t| t.as_ptr()),
+                n_tokens: p.tokens.as_ref().map_or(0, |t| t.len() as i32),
+                stream,
+                stream_user_data: user_data.get(i).copied().unwrap_or(std::ptr::null_mut()),
+            })
+            .collect();
+
+        let c_stops: Vec<CString> = options
+            .stop_sequences
+            .iter()
+            .map(|stop| CString::new(stop.as_str()).expect("CString::new failed"))
+            .collect();
+        let stop_ptrs: Vec<*const c_char> = c_stops.iter().map(|stop| stop.as_ptr()).collect();
+        let mut params = options.to_params();
+        params.stop_sequences = stop_ptrs.as_ptr();
+        params.n_stop_sequences = stop_ptrs.len() as i32;
+        let mask_ptrs = options.mask_ptrs();
+        params.masks = mask_ptrs.as_ptr();
+        params.n_masks = mask_ptrs.len() as i32;
+
+        let status = unsafe {
+            bindings::llama_generate_batch(
+                self.inner,
+                requests.as_ptr(),
+                requests.len() as i32,
+                max_parallel,
+                &params,
+                results.as_mut_ptr(),
+            )
+        };
+        status == 0
+    }
+
+    /// Samples `n` completions of one prompt. The prompt is prefilled once
+    /// and its KV cache is shared by all branches, which then decode together
+    /// with independent RNGs (set `options.temperature` above 0, otherwise
+    /// every branch is the greedy completion). Each output carries the
+    /// cumulative log-probability of its tokens.
+    pub fn generate_n(
+        &self,
+        prompt: &str,
+        max_new_tokens: i32,
+        n: i32,
+        options: &GenerateOptions,
+    ) -> Option<Vec<BatchOutput>> {
+        if options.grammar.is_some() {
+            return None;
+        }
+        let c_prompt = CString::new(prompt).expect("CString::new failed");
+        let c_stops: Vec<CString> = options
+            .stop_sequences
+            .iter()
+            .map(|stop| CString::new(stop.as_str()).expect("CString::new failed"))
+            .collect();
+        let stop_ptrs: Vec<*const c_char> = c_stops.iter().map(|stop| stop.as_ptr()).collect();
+        let mut params = options.to_params();
+        params.stop_sequences = stop_ptrs.as_ptr();
+        params.n_stop_sequences = stop_ptrs.len() as i32;
+        let mask_ptrs = options.mask_ptrs();
+        params.masks = mask_ptrs.as_ptr();
+        params.n_masks = mask_ptrs.len() as i32;
+
+        let mut results = vec![bindings::llama_batch_result::default(); n.max(0) as usize];
+        let status = unsafe {
+            bindings::llama_generate_n(
+                self.inner,
+                c_prompt.as_ptr(),
+                max_new_tokens,
+                n,
+                &params,
+                results.as_mut_ptr(),
+            )
+        };
+        if status != 0 {
+            return None;
+        }
+        Some(take_batch_results(&mut results))
     }
 }
 
@@ -105,23 +1977,18 @@ impl Drop for LlamaCppSimple {
     fn drop(&mut self) {
         unsafe {
             bindings::llama_destroy(self.inner);
+            if !self.progress.is_null() {
+                drop(Box::from_raw(self.progress as *mut ProgressCallback));
+            }
         }
     }
 }
 
+// The binding calls this for requests without a stream. Every method here
+// sets one, so it is only reached by code driving the C API directly, and
+// stops that request.
 #[no_mangle]
-extern "C" fn tokenCallback(state: *mut c_void, token: *const c_char) -> bool {
-    let mut callbacks = CALLBACKS.lock().unwrap();
-    if let Some(callback) = callbacks.get_mut(&(state as usize)) {
-        let c_str: &CStr = unsafe { CStr::from_ptr(token) };
-        let str_slice: &str = c_str.to_str().unwrap();
-        let string: String = str_slice.to_owned();
-        let result = callback(string);
-        println!("%%% {:?} %%%", result);
-        return result;
-    } else {
-        println!("Could not find callback");
-        return false;
-    };
+extern "C" fn tokenCallback(_state: *mut c_void, _token: *const c_char) -> bool {
+    false
 }
 